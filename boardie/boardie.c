@@ -78,11 +78,11 @@ int recvBytes(uint8 *buf, int count) {
 	return total;
 }
 
-int sendByte(char aByte) {
+int sendBytes(uint8 *buf, int start, int end) {
 	EM_ASM_({
-		window.parent.postMessage([$0]);
-	}, aByte);
-	return 1;
+		window.parent.postMessage(Array.from(HEAPU8.subarray($0, $1)));
+	}, &buf[start], &buf[end]);
+	return end - start;
 }
 
 // System Functions
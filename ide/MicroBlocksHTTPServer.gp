@@ -9,7 +9,7 @@
 //
 // John Maloney and Bernat Romagosa, May, 2019
 
-defineClass MicroBlocksHTTPServer port serverSocket vars workers
+defineClass MicroBlocksHTTPServer port serverSocket vars workers watchedVarIDs watchSentMSecs
 
 to newMicroBlocksHTTPServer {
 	result = (initialize (new 'MicroBlocksHTTPServer'))
@@ -22,6 +22,7 @@ method initialize MicroBlocksHTTPServer {
 	serverSocket = nil
 	vars = (dictionary)
 	workers = (list)
+	watchedVarIDs = (list)
 	return this
 }
 
@@ -111,16 +112,38 @@ method requestVarFromBoard MicroBlocksHTTPServer varName {
 
 	id = (variableIndex this varName)
 	if (isNil id) { return 0 }
-	getVar (smallRuntime) (id - 1) // VM uses zero-based index
+	runtime = (smallRuntime)
+	if (supportsVarWatch runtime) {
+		// subscribe to the variable; the board sends its value whenever it changes
+		watchVariable this (id - 1) // VM uses zero-based index
+		processMessages runtime
+	} else {
+		getVar runtime (id - 1) // VM uses zero-based index
 
-	// wait a bit to allow the board to respond
-	waitMSecs 3
-	processMessages (smallRuntime)
+		// wait a bit to allow the board to respond
+		waitMSecs 3
+		processMessages runtime
+	}
 
 	if (not (contains vars varName)) { atPut vars varName 0 }
 	return (at vars varName)
 }
 
+method watchVariable MicroBlocksHTTPServer varID {
+	// Add the given variable to the board's watch list. The subscription is resent
+	// every few seconds in case the board was reset. At most 32 variables are watched.
+
+	if (and (not (contains watchedVarIDs varID)) ((count watchedVarIDs) < 32)) {
+		add watchedVarIDs varID
+		watchSentMSecs = nil
+	}
+	now = (msecsSinceStart)
+	if (or (isNil watchSentMSecs) ((now - watchSentMSecs) > 3000)) {
+		watchVariables (smallRuntime) watchedVarIDs 10 // update every 100 msecs
+		watchSentMSecs = now
+	}
+}
+
 method varValueReceived MicroBlocksHTTPServer varID value {
 	varNames = (allVariableNames (project (scripter (smallRuntime))))
 	if (varID < (count varNames)) {
@@ -14,7 +14,7 @@ to smallRuntime aScripter {
 	return (global 'smallRuntime')
 }
 
-defineClass SmallRuntime ideVersion latestVMVersion scripter chunkIDs chunkRunning msgDict portName port connectionStartTime lastScanMSecs pingSentMSecs lastPingRecvMSecs recvBuf oldVarNames vmVersion boardType lastBoardDrives loggedData loggedDataNext loggedDataCount vmInstallMSecs disconnected crcDict lastRcvMSecs readFromBoard decompiler decompilerStatus blockForResultImage fileTransferMsgs fileTransferProgress fileTransfer firmwareInstallTimer recompileAll
+defineClass SmallRuntime ideVersion latestVMVersion scripter chunkIDs chunkRunning msgDict portName port connectionStartTime lastScanMSecs pingSentMSecs lastPingRecvMSecs recvBuf oldVarNames vmVersion boardType lastBoardDrives loggedData loggedDataNext loggedDataCount vmInstallMSecs disconnected crcDict lastRcvMSecs readFromBoard decompiler decompilerStatus blockForResultImage fileTransferMsgs fileTransferProgress fileTransfer firmwareInstallTimer recompileAll chunkBatch boardRcvBufKBytes
 
 method scripter SmallRuntime { return scripter }
 method serialPortOpen SmallRuntime { return (notNil port) }
@@ -627,6 +627,61 @@ method webSerialConnect SmallRuntime action {
 	}
 }
 
+// Port I/O
+
+// The port is usually a serial port or pseudo terminal. A Linux VM started with the
+// -tcp option is reached through a TCP socket instead; enter 'localhost:<port>' as the
+// port name. (GP has no Unix domain socket primitives, so the -unix option is not supported.)
+
+method isSocketPort SmallRuntime {
+	return (and (isClass portName 'String') (beginsWith portName 'localhost:'))
+}
+
+method openPort SmallRuntime {
+	// Open the port named portName. Return the port or nil if it could not be opened.
+
+	if (isSocketPort this) {
+		tcpPort = (substring portName 11)
+		if (not (representsAnInteger tcpPort)) { return nil }
+		return (openClientSocket '127.0.0.1' (toNumber tcpPort))
+	}
+	result = (safelyRun (action 'openSerialPort' portName 115200))
+	if (not (isClass result 'Integer')) { return nil } // failed
+	return result
+}
+
+method portIsOpen SmallRuntime {
+	if (isNil port) { return false }
+	if (isSocketPort this) { return (notNil (socketStatus port)) }
+	return (isOpenSerialPort port)
+}
+
+method readPort SmallRuntime {
+	// Return the bytes available from the port or nil if there are none.
+
+	if (isSocketPort this) {
+		data = (readSocket port true)
+		if (or (isNil data) (0 == (byteCount data))) { return nil }
+		return data
+	}
+	return (readSerialPort port true)
+}
+
+method writePort SmallRuntime data {
+	// Write data to the port and return the number of bytes written.
+
+	if (isSocketPort this) {
+		n = (writeSocket port data)
+		if (n < 0) { // connection closed by the VM
+			closeSocket port
+			port = nil
+			return 0
+		}
+		return n
+	}
+	return (writeSerialPort port data)
+}
+
 method selectPort SmallRuntime {
 	if (isNil disconnected) { disconnected = false }
 
@@ -748,10 +803,18 @@ method setPort SmallRuntime newPortName {
 method closePort SmallRuntime {
 	// Close the serial port and clear info about the currently connected board.
 
-	if (notNil port) { closeSerialPort port }
+	if (notNil port) {
+		if (isSocketPort this) {
+			closeSocket port
+		} else {
+			closeSerialPort port
+		}
+	}
 	port = nil
 	vmVersion = nil
 	boardType = nil
+	chunkBatch = nil
+	boardRcvBufKBytes = nil
 
 	// remove running highlights and result bubbles when disconnected
 	clearRunningHighlights this
@@ -781,7 +844,7 @@ method tryToInstallVM SmallRuntime {
 
 	if (and (notNil vmInstallMSecs) ((msecsSinceStart) > vmInstallMSecs)) {
 		vmInstallMSecs = nil
-		if (and (notNil port) (isOpenSerialPort port)) { return }
+		if (portIsOpen this) { return }
 		ok = (confirm (global 'page') nil (join
 			(localized 'The board is not responding.') (newline)
 			(localized 'Try to Install MicroBlocks on the board?')))
@@ -813,7 +876,7 @@ method updateConnection SmallRuntime {
 	if (notNil connectionStartTime) { return (tryToConnect this) }
 
 	// if port is not open, try to reconnect or find a different board
-	if (or (isNil port) (not (isOpenSerialPort port))) {
+	if (not (portIsOpen this)) {
 		clearRunningHighlights this
 		closePort this
 		if (isWebSerial this) { return 'not connected' } // user must initiate connection attempt
@@ -861,18 +924,18 @@ method justConnected SmallRuntime {
 	if readFromBoard {
 		readFromBoard = false
 		readCodeFromBoard this
-	} else {
+	} (isEmpty chunkIDs) {
 		clearBoardIfConnected this true
 		stopAndSyncScripts this true
-// xxx Disable this attempt to reuse scripts already on board for now; it sometimes fails
-// 		if (isEmpty chunkIDs) {
-// 			clearBoardIfConnected this false
-// 			stopAndSyncScripts this true
-// 		} else {
-// 			forceFunctionChecks this
-// 			syncScripts this
-// 			verifyCRCs this
-// 		}
+	} else {
+		// Reuse the scripts already on the board. verifyCRCs sends only the chunks whose
+		// CRCs differ and deletes chunks that are not in the IDE. Variable names are always
+		// resent since the board may have been programmed from another project.
+		softReset this
+		oldVarNames = nil
+		forceFunctionChecks this
+		syncScripts this
+		verifyCRCs this
 	}
 }
 
@@ -929,6 +992,11 @@ method tryToConnect SmallRuntime {
 		return 'not connected'
 	}
 
+	if (isSocketPort this) { // keep trying the VM's socket
+		openPortAndSendPing this
+		return 'not connected'
+	}
+
 	portNames = (portList this)
 	if (isEmpty portNames) { return 'not connected' } // no ports available
 
@@ -951,7 +1019,7 @@ method openPortAndSendPing SmallRuntime {
 	ensurePortOpen this // attempt to reopen the port
 	if (notNil port) {
 		// discard any random bytes in buffer
-		readSerialPort port true
+		readPort this
 	}
 	lastPingRecvMSecs = 0
 	sendMsg this 'pingMsg'
@@ -1036,11 +1104,12 @@ method extractBoardType SmallRuntime versionString {
 	return (joinStrings (copyWithout words (at words 1)) ' ')
 }
 
-method versionReceived SmallRuntime versionString {
+method versionReceived SmallRuntime versionString rcvBufKBytes {
 	if (isNil versionString) { return } // bad version message
 	if (isNil vmVersion) { // first time: record and check the version number
 		vmVersion = (extractVersionNumber this versionString)
 		boardType = (extractBoardType this versionString)
+		boardRcvBufKBytes = rcvBufKBytes // zero if the VM does not report it
 		checkVmVersion this
 		installBoardSpecificBlocks this
 	} else { // not first time: show the version number
@@ -1189,6 +1258,7 @@ method saveAllChunks SmallRuntime {
 	progressInterval = (max 1 (floor (totalScripts / 20)))
 	processedScripts = 0
 
+	startChunkBatch this
 	skipHiddenFunctions = true
 	if (or (saveVariableNames this) recompileAll) {
 		// Clear the source code field of all chunk entries to force script recompilation
@@ -1225,6 +1295,7 @@ method saveAllChunks SmallRuntime {
 		}
 		processedScripts += 1
 	}
+	endChunkBatch this
 	if (scriptsSaved > 0) { print 'Downloaded' scriptsSaved 'scripts to board' (join '(' (msecSplit t) ' msecs)') }
 
 	recompileAll = false
@@ -1304,11 +1375,12 @@ method saveChunk SmallRuntime aBlockOrFunction skipHiddenFunctions {
 		return false
 	}
 	if ((at entry 2) == (computeCRC this chunkBytes)) { return false }
-	sendMsgSync this 'chunkCodeMsg' chunkID data
+	sendChunkRecord this 'chunkCodeMsg' chunkID data
 	atPut entry 2 (computeCRC this chunkBytes) // remember the CRC of the code we just saved
 
 	// restart the chunk if it is a Block and is running
 	if (and (isClass aBlockOrFunction 'Block') (isRunning this aBlockOrFunction)) {
+		flushChunkBatch this // make sure the board has the new code before restarting
 		stopRunningChunk this chunkID
 		waitForResponse this
 		runChunk this chunkID
@@ -1329,16 +1401,83 @@ method computeCRC SmallRuntime chunkData {
 }
 
 
+// Batched chunk transfer
+
+method startChunkBatch SmallRuntime {
+	// Start collecting chunk, attribute, and variable name records into a chunkBatchMsg.
+	// Older VMs do not support batches, so records are sent as individual messages.
+
+	if (and (notNil vmVersion) (vmVersion >= 171)) {
+		chunkBatch = (list)
+	} else {
+		chunkBatch = nil
+	}
+}
+
+method maxChunkBatchBytes SmallRuntime {
+	// Return the maximum number of record bytes in a chunkBatchMsg. The entire message,
+	// including the CRC and terminator byte, must fit in the board's receive buffer.
+	// The VM reports its buffer size in the ID field of its version message.
+
+	if (or (isNil boardRcvBufKBytes) (boardRcvBufKBytes < 1)) {
+		return 1004 // VM did not report; assume the smallest (1024 byte) buffer
+	}
+	return (min ((boardRcvBufKBytes * 1024) - 20) 65000) // leave room for the message header, CRC, and terminator
+}
+
+method sendChunkRecord SmallRuntime msgName chunkID byteList {
+	// Add a record to the current batch or, if not batching, send it as a message.
+
+	if (isNil chunkBatch) {
+		sendMsgSync this msgName chunkID byteList
+		return
+	}
+	byteCount = (count byteList)
+	if (((count chunkBatch) + 4 + byteCount) > (maxChunkBatchBytes this)) {
+		flushChunkBatch this
+	}
+	addAll chunkBatch (list (msgNameToID this msgName) chunkID (byteCount & 255) ((byteCount >> 8) & 255))
+	addAll chunkBatch byteList
+}
+
+method flushChunkBatch SmallRuntime {
+	// Send the records collected so far, followed by their CRC, as a single message.
+
+	if (or (isNil chunkBatch) (isEmpty chunkBatch)) { return }
+	crc = (crc (toBinaryData (toArray chunkBatch)))
+	for i 4 { add chunkBatch (digitAt crc i) }
+	sendMsgSync this 'chunkBatchMsg' 0 chunkBatch
+	chunkBatch = (list)
+}
+
+method endChunkBatch SmallRuntime {
+	flushChunkBatch this
+	chunkBatch = nil
+}
+
 method verifyCRCs SmallRuntime {
 	// Check that the CRCs of the chunks on the board match the ones in the IDE.
-	// Resend the code of any chunks whose CRC's do not match.
+	// Resend the code of any chunks whose CRC's do not match and delete any chunks
+	// on the board that are not in the IDE.
 
 	if (isNil port) { return }
 
 	// collect CRCs from the board
 	crcDict = (dictionary)
 	if (and (notNil vmVersion) (vmVersion >= 159)) {
-		collectCRCsBulk this
+		if (not (collectCRCsBulk this)) {
+			// without the board's CRCs, chunks not in the IDE cannot be found; replace them all
+			print 'No CRCs from board; resending all chunks'
+			sendMsgSync this 'deleteAllCodeMsg'
+			oldVarNames = nil
+			for entry (values chunkIDs) {
+				atPut entry 2 nil // clear the CRC and source to force re-save
+				atPut entry 4 ''
+			}
+			forceFunctionChecks this
+			saveAllChunks this
+			return
+		}
 	} else {
 		collectCRCsIndividually this
 	}
@@ -1362,11 +1501,19 @@ method verifyCRCs SmallRuntime {
 	editor = (findMicroBlocksEditor)
 	totalCount = ((count crcDict) + (count ideChunks))
 	processedCount = 0
+	startChunkBatch this // send only the changed and missing chunks, batched if the board supports it
 
 	// process CRCs
 	for chunkID (keys crcDict) {
 		sourceItem = (at ideChunks chunkID)
-		if (and (notNil sourceItem) ((at crcDict chunkID) != (at crcForChunkID chunkID))) {
+		if (isNil sourceItem) {
+			print 'Deleting chunk not in IDE:' chunkID
+			if (isNil chunkBatch) {
+				sendMsgSync this 'deleteChunkMsg' chunkID
+			} else {
+				sendChunkRecord this 'deleteChunkMsg' chunkID (list)
+			}
+		} ((at crcDict chunkID) != (at crcForChunkID chunkID)) {
 			print 'CRC mismatch; resaving chunk:' chunkID
 			forceSaveChunk this sourceItem
 			showDownloadProgress editor 3 (processedCount / totalCount)
@@ -1384,6 +1531,7 @@ method verifyCRCs SmallRuntime {
 		}
 		processedCount += 1
 	}
+	endChunkBatch this
 	showDownloadProgress editor 3 1
 }
 
@@ -1420,6 +1568,7 @@ method crcReceived SmallRuntime chunkID chunkCRC {
 
 method collectCRCsBulk SmallRuntime {
 	// Collect the CRC's from all chunks on the board via a bulk CRC request.
+	// Return false if the board did not reply.
 
 	crcDict = nil
 
@@ -1432,7 +1581,11 @@ method collectCRCsBulk SmallRuntime {
 		processMessages this
 		waitMSecs 5
 	}
-	if (isNil crcDict) { crcDict = (dictionary) } // timeout
+	if (isNil crcDict) { // timeout
+		crcDict = (dictionary)
+		return false
+	}
+	return true
 }
 
 method allCRCsReceived SmallRuntime data {
@@ -1466,7 +1619,7 @@ method saveVariableNames SmallRuntime {
 	varID = 0
 	for varName newVarNames {
 		if (notNil port) {
-			sendMsgSync this 'varNameMsg' varID (toArray (toBinaryData varName))
+			sendChunkRecord this 'varNameMsg' varID (toArray (toBinaryData varName))
 		}
 		varID += 1
 		if (0 == (varID % progressInterval)) {
@@ -1494,6 +1647,34 @@ method getVar SmallRuntime varID {
 	sendMsg this 'getVarMsg' varID
 }
 
+method supportsVarWatch SmallRuntime {
+	return (and (notNil vmVersion) (vmVersion >= 172))
+}
+
+method watchVariables SmallRuntime varIDs interval {
+	// Subscribe to changes in the given variables (zero-based IDs). The board sends
+	// varValuesMsg updates at most every (interval * 10) msecs. An empty list cancels.
+
+	if (isNil interval) { interval = 10 }
+	sendMsg this 'watchVarsMsg' interval (toArray varIDs)
+}
+
+method varValuesReceived SmallRuntime msg {
+	// Received the values of watched variables that have changed.
+	// Each record is: <varID> <size LSB> <size MSB> <value (as in varValueMsg)>
+
+	server = (httpServer scripter)
+	end = (byteCount msg)
+	i = 6
+	while ((i + 2) <= end) {
+		varID = (byteAt msg i)
+		size = (((byteAt msg (i + 2)) << 8) | (byteAt msg (i + 1)))
+		valueMsg = (join (newBinaryData 5) (copyFromTo msg (i + 3) (i + 2 + size)))
+		varValueReceived server varID (returnedValue this valueMsg)
+		i += (3 + size)
+	}
+}
+
 method getVarNamed SmallRuntime varName {
 	sendMsg this 'getVarMsg' 255 (toArray (toBinaryData varName))
 }
@@ -1590,6 +1771,10 @@ method msgNameToID SmallRuntime msgName {
 		atPut msgDict 'chunkAttributeMsg' 28
 		atPut msgDict 'varNameMsg' 29
 		atPut msgDict 'extendedMsg' 30
+		atPut msgDict 'chunkBatchMsg' 31
+		atPut msgDict 'watchVarsMsg' 32
+		atPut msgDict 'varValuesMsg' 33
+		atPut msgDict 'telemetryMsg' 34
 		atPut msgDict 'getAllCRCsMsg' 38
 		atPut msgDict 'allCRCsMsg' 39
 		atPut msgDict 'deleteFile' 200
@@ -1678,8 +1863,8 @@ method sendMsg SmallRuntime msgName chunkID byteList {
 		// written in one call to writeSerialPort, so send smaller chunks
 		byteCount = (min 50 (byteCount dataToSend))
 		chunk = (copyFromTo dataToSend 1 byteCount)
-		bytesSent = (writeSerialPort port chunk)
-		if (not (isOpenSerialPort port)) {
+		bytesSent = (writePort this chunk)
+		if (not (portIsOpen this)) {
 			closePort this
 			return
 		}
@@ -1709,7 +1894,7 @@ method readAvailableSerialData SmallRuntime {
 	if (isNil port) { return }
 	waitMSecs 20 // leave some time for queued data to arrive
 	if (isNil recvBuf) { recvBuf = (newBinaryData 0) }
-	s = (readSerialPort port true)
+	s = (readPort this)
 	if (notNil s) { recvBuf = (join recvBuf s) }
 }
 
@@ -1722,7 +1907,7 @@ method waitForResponse SmallRuntime {
 	start = (msecsSinceStart)
 	while (((msecsSinceStart) - start) < timeout) {
 		if (isNil port) { return false }
-		s = (readSerialPort port true)
+		s = (readPort this)
 		if (notNil s) {
 			recvBuf = (join recvBuf s)
 			return true
@@ -1736,12 +1921,12 @@ method waitForResponse SmallRuntime {
 method ensurePortOpen SmallRuntime {
 	if (true == disconnected) { return }
 	if (isWebSerial this) { return }
-	if (or (isNil port) (not (isOpenSerialPort port))) {
+	if (not (portIsOpen this)) {
 		if (and (notNil portName)
 				(or (contains (portList this) portName)
-				(notNil (findSubstring 'pts' portName)))) { // support for GnuBlocks
-			port = (safelyRun (action 'openSerialPort' portName 115200))
-			if (not (isClass port 'Integer')) { port = nil } // failed
+				(notNil (findSubstring 'pts' portName)) // support for GnuBlocks
+				(isSocketPort this))) {
+			port = (openPort this)
 			if (isNil port) { return }
 			// connected!
 			disconnected = false
@@ -1760,10 +1945,10 @@ method processMessages SmallRuntime {
 method processNextMessage SmallRuntime {
 	// Process the next message, if any. Return false when there are no more messages.
 
-	if (or (isNil port) (not (isOpenSerialPort port))) { return false }
+	if (not (portIsOpen this)) { return false }
 
 	// Read any available bytes and append to recvBuf
-	s = (readSerialPort port true)
+	s = (readPort this)
 	if (notNil s) { recvBuf = (join recvBuf s) }
 	if ((byteCount recvBuf) < 3) { return false } // not enough bytes for even a short message
 
@@ -1847,8 +2032,12 @@ method handleMessage SmallRuntime msg {
 		}
 	} (op == (msgNameToID this 'varValueMsg')) {
 		varValueReceived (httpServer scripter) (byteAt msg 3) (returnedValue this msg)
+	} (op == (msgNameToID this 'varValuesMsg')) {
+		varValuesReceived this msg
+	} (op == (msgNameToID this 'telemetryMsg')) {
+		telemetryReceived this msg
 	} (op == (msgNameToID this 'versionMsg')) {
-		versionReceived this (returnedValue this msg)
+		versionReceived this (returnedValue this msg) (byteAt msg 3)
 	} (op == (msgNameToID this 'chunkCRCMsg')) {
 		crcReceived this (byteAt msg 3) (copyFromTo (toArray msg) 6)
 	} (op == (msgNameToID this 'allCRCsMsg')) {
@@ -2721,6 +2910,29 @@ method clearLoggedData SmallRuntime {
 	loggedDataCount = 0
 }
 
+method telemetryReceived SmallRuntime msg {
+	// Add the samples in a telemetry frame to the logged data (used by the graph).
+	// Frame body: <dropped count (2 bytes)> then samples of the form:
+	//	<timestamp usecs (4 bytes)> <value count (1 byte)> <values (4 bytes each)>
+
+	end = (byteCount msg)
+	dropped = (((byteAt msg 7) << 8) | (byteAt msg 6))
+	if (dropped > 0) { print 'Telemetry samples dropped:' dropped }
+	i = 8
+	while ((i + 4) <= end) {
+		valueCount = (byteAt msg (i + 4))
+		i += 5
+		if ((i + (4 * valueCount) - 1) > end) { return } // incomplete sample
+		values = (list)
+		repeat valueCount {
+			n = (+ ((byteAt msg (i + 3)) << 24) ((byteAt msg (i + 2)) << 16) ((byteAt msg (i + 1)) << 8) (byteAt msg i))
+			add values (toString n)
+			i += 4
+		}
+		addLoggedData this (joinStrings values ' ')
+	}
+}
+
 method addLoggedData SmallRuntime s {
 	atPut loggedData loggedDataNext s
 	loggedDataNext = ((loggedDataNext % (count loggedData)) + 1)
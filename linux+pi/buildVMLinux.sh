@@ -1,6 +1,7 @@
 #!/bin/sh
 # Build uBlocks for generic GNU/Linux
-# Connect to it via pseudo terminal
+# Connect to it via pseudo terminal (default) or a socket (-unix <path> or -tcp <port>)
+# The code store size can be set with -codesize <KB> (default 1024)
 #
 # Prerequisites to run on 64-bit Linux (tested on Ubuntu 20.04):
 #	sudo apt install gcc-multilib libgl1-mesa-glx:i386
@@ -13,14 +13,27 @@
 
 #define _XOPEN_SOURCE 600
 #define _DEFAULT_SOURCE
+#define _GNU_SOURCE // for ppoll()
 
+#include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h> // still needed?
+#include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/time.h> // still needed?
+#include <sys/un.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <signal.h>
 
@@ -32,48 +45,93 @@
 #include "mem.h"
 #include "interp.h"
 #include "persist.h"
+#include "linux.h"
 
 // Keyboard
 int KEY_SCANCODE[255];
 
 // Timing Functions
 
-static int startSecs = 0;
+// Time is measured with CLOCK_MONOTONIC, which is not affected by NTP adjustments or
+// changes to the wall clock time and is served by the vDSO (no system call) on most
+// kernels. The 64-bit microsecond clock does not wrap; microsecs() and millisecs()
+// return its low 32 bits for use by the scheduler and primitives.
+
+static uint64_t startUSecs = 0;
+
+static uint64_t monotonicMicrosecs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
 
 static void initTimers() {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	startSecs = now.tv_sec;
+	startUSecs = monotonicMicrosecs();
 }
 
-uint32 microsecs() {
-	struct timeval now;
-	gettimeofday(&now, NULL);
+uint64_t totalMicrosecs() {
+	return monotonicMicrosecs() - startUSecs;
+}
 
-	return (1000000 * (now.tv_sec - startSecs)) + now.tv_usec;
+uint32 microsecs() {
+	return (uint32) totalMicrosecs();
 }
 
 uint32 millisecs() {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-
-	return (1000 * (now.tv_sec - startSecs)) + (now.tv_usec / 1000);
+	return (uint32) (totalMicrosecs() / 1000);
 }
 
 #ifndef ARDUINO_RASPBERRY_PI
 void delay(int ms) {
-	clock_t start = millisecs();
-	while (millisecs() < start + ms);
+	if (ms <= 0) return;
+	struct timespec duration = { ms / 1000, (ms % 1000) * 1000000 };
+	while (nanosleep(&duration, &duration) < 0) /* resume if interrupted by a signal */;
 }
 #endif
 
 
 // Communication/System Functions
 
-static int pty; // pseudo terminal used for communication with the IDE
+// By default, the IDE connects through a pseudo terminal whose name is written to
+// /tmp/ublocksptyname. Alternatively, the VM can listen for connections on a Unix
+// domain socket (-unix <path>) or a localhost TCP port (-tcp <port>). Sockets avoid the
+// pty line discipline and allow many VMs to run on one machine. The framed serial
+// protocol is the same for all transports.
+//
+// Up to MAX_CLIENTS socket clients (e.g. the IDE and a dashboard) can be connected at
+// once. Each client has its own receive buffer, which is used to pass only complete
+// messages to the runtime so messages from different clients are never interleaved,
+// and its own output queue, so a slow client does not hold up the others. Each call to
+// recvBytes() passes messages from only one client, and replies to those messages (e.g.
+// the version, CRCs, or file transfer data) go only to that client until the runtime
+// calls endClientReply(). Other output (broadcasts, variable values, say/graph output,
+// and telemetry) goes to every client. A client whose output queue overflows is
+// disconnected.
+
+#define MAX_CLIENTS 4
+#define CLIENT_BUF_SIZE ((64 * 1024) + 16) // room for any message (data size is 16 bits)
+
+typedef struct {
+	int fd;
+	int rcvCount;
+	int outStart;
+	int outEnd;
+	uint8 rcvBuf[CLIENT_BUF_SIZE];
+	uint8 outBuf[CLIENT_BUF_SIZE];
+} Client;
+
+static int pty = -1;			// pseudo terminal used for communication with the IDE
+static int listenSocket = -1;	// socket that accepts client connections (socket transport only)
+static char *unixSocketPath = NULL;
+
+static Client clients[MAX_CLIENTS];
+static int clientCount = 0;
+static int nextClient = 0;		// round-robin index used when receiving messages
+static int replying = false;	// true while processing the messages from one client
+static int replyFD = -1;		// the client being replied to (-1 if it has disconnected)
 
 int serialConnected() {
-	return pty > -1;
+	return (pty >= 0) || (clientCount > 0);
 }
 
 static void makePtyFile() {
@@ -84,8 +142,17 @@ static void makePtyFile() {
 	}
 }
 
+void flushCodeFile();
+static void commitCodeFile();
+static void closeCodeStore();
+
+static int vmCrashed = false;
+
 static void exitGracefully() {
-	remove("/tmp/ublocksptyname");
+	commitCodeFile();
+	if (!vmCrashed) closeCodeStore();
+	if (pty >= 0) remove("/tmp/ublocksptyname");
+	if (unixSocketPath) unlink(unixSocketPath);
 	exit(0);
 }
 
@@ -107,20 +174,301 @@ static void openPseudoTerminal() {
 	makePtyFile();
 }
 
+static void openUnixSocket(char *path) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		exit(-1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	unlink(path); // remove stale socket left by a VM that did not exit cleanly
+	if ((listenSocket < 0) ||
+		(bind(listenSocket, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+		(listen(listenSocket, MAX_CLIENTS) < 0)) {
+			perror("Error opening Unix socket");
+			exit(-1);
+	}
+	unixSocketPath = path;
+}
+
+static void openTCPSocket(int port) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // local connections only
+	addr.sin_port = htons(port);
+
+	listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	int one = 1;
+	if (listenSocket >= 0) setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if ((listenSocket < 0) ||
+		(bind(listenSocket, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+		(listen(listenSocket, MAX_CLIENTS) < 0)) {
+			perror("Error opening TCP port");
+			exit(-1);
+	}
+}
+
+// Socket Clients
+
+static void acceptClients() {
+	// Accept pending client connections while there is room in the client table.
+
+	if (listenSocket < 0) return;
+	while (clientCount < MAX_CLIENTS) {
+		int fd = accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK);
+		if (fd < 0) return;
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on Unix sockets
+		Client *c = &clients[clientCount++];
+		c->fd = fd;
+		c->rcvCount = c->outStart = c->outEnd = 0;
+	}
+}
+
+static void closeClient(int i) {
+	if (clients[i].fd == replyFD) replyFD = -1; // drop any further replies
+	close(clients[i].fd);
+	clientCount--;
+	if (i != clientCount) {
+		// move the last client into the free slot (copying only the buffered bytes)
+		Client *dst = &clients[i];
+		Client *src = &clients[clientCount];
+		dst->fd = src->fd;
+		dst->rcvCount = src->rcvCount;
+		dst->outStart = 0;
+		dst->outEnd = src->outEnd - src->outStart;
+		memcpy(dst->rcvBuf, src->rcvBuf, src->rcvCount);
+		memcpy(dst->outBuf, &src->outBuf[src->outStart], dst->outEnd);
+	}
+	if (nextClient >= clientCount) nextClient = 0;
+}
+
+static int flushClient(int i) {
+	// Write as much of the client's output queue as the socket accepts.
+	// Return false if the client was closed.
+
+	Client *c = &clients[i];
+	while (c->outStart < c->outEnd) {
+		int written = send(c->fd, &c->outBuf[c->outStart], c->outEnd - c->outStart, MSG_NOSIGNAL);
+		if (written < 0) {
+			if ((EAGAIN == errno) || (EINTR == errno)) return true; // socket buffer full
+			closeClient(i);
+			return false;
+		}
+		c->outStart += written;
+	}
+	c->outStart = c->outEnd = 0;
+	return true;
+}
+
+static void flushAllClients() {
+	for (int i = clientCount - 1; i >= 0; i--) flushClient(i);
+}
+
+static int messageSize(uint8 *msg, int byteCount) {
+	// Return the size of the framed message at msg or 0 if it is not yet complete.
+	// Bytes that do not start a message are passed through one at a time; the
+	// runtime discards them when it resynchronizes.
+
+	if (byteCount < 1) return 0;
+	if (0xFA == msg[0]) return (byteCount >= 3) ? 3 : 0;
+	if (0xFB == msg[0]) {
+		if (byteCount < 5) return 0;
+		int size = 5 + ((msg[4] << 8) | msg[3]);
+		return (byteCount >= size) ? size : 0;
+	}
+	return 1;
+}
+
+static int recvFromClients(uint8 *buf, int count) {
+	// Read available data from all clients, then copy complete messages from the next
+	// client (round-robin) that has any into buf and make that client the recipient of
+	// replies. Return the number of bytes copied.
+
+	acceptClients();
+	for (int i = clientCount - 1; i >= 0; i--) {
+		Client *c = &clients[i];
+		if (c->rcvCount == CLIENT_BUF_SIZE) continue; // buffer full; runtime has not caught up
+		int readCount = read(c->fd, &c->rcvBuf[c->rcvCount], CLIENT_BUF_SIZE - c->rcvCount);
+		if ((0 == readCount) || ((readCount < 0) && (EAGAIN != errno) && (EINTR != errno))) {
+			closeClient(i); // client disconnected
+		} else if (readCount > 0) {
+			c->rcvCount += readCount;
+		}
+	}
+
+	replying = false;
+	for (int n = 0; n < clientCount; n++) {
+		int i = (nextClient + n) % clientCount;
+		Client *c = &clients[i];
+		int total = 0;
+		while (true) {
+			int size = messageSize(&c->rcvBuf[total], c->rcvCount - total);
+			if ((0 == size) || ((total + size) > count)) break;
+			total += size;
+		}
+		if (total > 0) {
+			memcpy(buf, c->rcvBuf, total);
+			c->rcvCount -= total;
+			memmove(c->rcvBuf, &c->rcvBuf[total], c->rcvCount);
+			replying = true;
+			replyFD = c->fd;
+			nextClient = (i + 1) % clientCount;
+			return total;
+		}
+	}
+	return 0;
+}
+
+void endClientReply() {
+	// Called by the runtime after it has processed the messages from recvBytes() and
+	// sent its replies. Output after this point goes to every client.
+
+	replying = false;
+}
+
+static void sendToClients(uint8 *buf, int byteCount) {
+	// Append the given bytes to the output queue of the client being replied to or,
+	// if there is none, of every client, then flush.
+
+	for (int i = clientCount - 1; i >= 0; i--) {
+		Client *c = &clients[i];
+		if (replying && (c->fd != replyFD)) continue;
+		if ((c->outEnd + byteCount) > CLIENT_BUF_SIZE) {
+			if (c->outStart > 0) { // compact the queue
+				memmove(c->outBuf, &c->outBuf[c->outStart], c->outEnd - c->outStart);
+				c->outEnd -= c->outStart;
+				c->outStart = 0;
+			}
+			if ((c->outEnd + byteCount) > CLIENT_BUF_SIZE) {
+				closeClient(i); // client is not reading its output
+				continue;
+			}
+		}
+		memcpy(&c->outBuf[c->outEnd], buf, byteCount);
+		c->outEnd += byteCount;
+	}
+	flushAllClients();
+}
+
+// Serial Port Emulation
+
 int recvBytes(uint8 *buf, int count) {
+	if (listenSocket >= 0) return recvFromClients(buf, count);
 	int readCount = read(pty, buf, count);
 	if (readCount < 0) readCount = 0;
 	return readCount;
 }
 
 int canReadByte() {
-	int bytesAvailable;
-	ioctl(pty, FIONREAD, &bytesAvailable);
+	int bytesAvailable = 0;
+	if (pty >= 0) {
+		ioctl(pty, FIONREAD, &bytesAvailable);
+	} else {
+		for (int i = 0; i < clientCount; i++) {
+			if (messageSize(clients[i].rcvBuf, clients[i].rcvCount) > 0) return true;
+		}
+	}
 	return (bytesAvailable > 0);
 }
 
-int sendByte(char aByte) {
-	return write(pty, &aByte, 1);
+int sendBytes(uint8 *buf, int start, int end) {
+	// Write buf[start..end-1] to the IDE with a single system call and return the number
+	// of bytes written. As with the old byte-at-a-time version, data that cannot be
+	// written to the pty (e.g. because no IDE is connected) is dropped. With the socket
+	// transport, the data is added to the output queue of the client being replied to
+	// or of each connected client.
+
+	int byteCount = end - start;
+	if (listenSocket >= 0) {
+		sendToClients(&buf[start], byteCount);
+		return byteCount;
+	}
+	int written = write(pty, &buf[start], byteCount);
+	return (written < 0) ? byteCount : written;
+}
+
+// Idle Support
+
+// When no task is runnable, vmLoop() calls sleepUntilEvent() to block in ppoll() until
+// the IDE sends data, a client connects or can accept queued output, a registered socket
+// becomes readable, or the given timeout (the time until the next task wake) expires.
+// ppoll() has nanosecond timeout resolution, so no separate timer file descriptor is needed.
+//
+// Registered sockets are drained only by primitives, so data that a script never reads
+// would keep such a socket readable and make every idle sleep return at once. To avoid
+// that, a registered file descriptor that wakes the VM is removed from the wakeup set.
+// Its owner adds it again when a primitive services it.
+
+#define MAX_WAKEUP_FDS 16
+#define HUP_RECHECK_USECS 10000 // poll interval while no IDE has the pty open
+
+static int wakeupFDs[MAX_WAKEUP_FDS];
+static int wakeupFDCount = 0;
+
+void addWakeupFD(int fd) {
+	// Wake the VM from an idle sleep once when data arrives on the given file descriptor.
+
+	if (fd < 0) return;
+	for (int i = 0; i < wakeupFDCount; i++) {
+		if (fd == wakeupFDs[i]) return; // already registered
+	}
+	if (wakeupFDCount < MAX_WAKEUP_FDS) wakeupFDs[wakeupFDCount++] = fd;
+}
+
+void removeWakeupFD(int fd) {
+	for (int i = 0; i < wakeupFDCount; i++) {
+		if (fd == wakeupFDs[i]) {
+			wakeupFDs[i] = wakeupFDs[--wakeupFDCount];
+			return;
+		}
+	}
+}
+
+void sleepUntilEvent(int usecs) {
+	struct pollfd fds[1 + MAX_CLIENTS + MAX_WAKEUP_FDS];
+	int count = 0;
+
+	// fds[0] is the pty or, with the socket transport, the listening socket
+	fds[count].fd = (pty >= 0) ? pty : ((clientCount < MAX_CLIENTS) ? listenSocket : -1);
+	fds[count].events = POLLIN;
+	fds[count++].revents = 0;
+	for (int i = 0; i < clientCount; i++) {
+		fds[count].fd = clients[i].fd;
+		fds[count].events = (clients[i].outStart < clients[i].outEnd) ? (POLLIN | POLLOUT) : POLLIN;
+		fds[count++].revents = 0;
+	}
+	int firstWakeupFD = count;
+	for (int i = 0; i < wakeupFDCount; i++) {
+		fds[count].fd = wakeupFDs[i];
+		fds[count].events = POLLIN | POLLRDHUP;
+		fds[count++].revents = 0;
+	}
+
+	struct timespec timeout = { usecs / 1000000, (usecs % 1000000) * 1000 };
+	int readyCount = ppoll(fds, count, &timeout, NULL);
+
+	// Stop watching registered sockets that are ready (including those whose peer has
+	// closed) until their owners service them, so unread data cannot cause spinning.
+	for (int i = count - 1; i >= firstWakeupFD; i--) {
+		if (fds[i].revents) removeWakeupFD(fds[i].fd);
+	}
+
+	if (clientCount > 0) flushAllClients(); // send queued output to clients that can accept it
+
+	if ((readyCount == 1) && (fds[0].revents & POLLHUP) && (pty >= 0)) {
+		// The pty master reports a hangup while no IDE has the slave side open, so
+		// ppoll() returns immediately. Nap instead, but check back periodically.
+		if (usecs > HUP_RECHECK_USECS) usecs = HUP_RECHECK_USECS;
+		timeout.tv_sec = 0;
+		timeout.tv_nsec = usecs * 1000;
+		nanosleep(&timeout, NULL);
+	}
 }
 
 // System Functions
@@ -216,63 +564,439 @@ void stopServos() { }
 
 // Persistence support
 
+// The code file is a journal. It starts with the code store header word ('S' + cycle
+// count) followed by commit groups, each holding a run of persistent store records:
+//
+//	<'J' + version (1 word)> <payload byte count (1 word)> <CRC-32 of payload (1 word)>
+//	<payload: persistent records, exactly as stored in the RAM code store>
+//
+// Records are buffered in memory and committed as a group with a single write() and
+// fdatasync(), either CODE_FILE_COMMIT_MSECS after the first pending record or when the
+// buffer fills. A record is never split between groups. On startup, groups are replayed until the first one that is truncated or
+// fails its CRC check (e.g. after a crash or power loss); the file is then truncated to
+// the last valid group. When the code store is compacted, the compacted records are
+// written to a temporary file that replaces the code file with rename() once committed,
+// so a crash during compaction leaves the previous file intact. The directory is synced
+// after the rename so that the replacement itself survives a power loss.
+
+#define CODE_FILE_GROUP_TAG (('J' << 24) | 1)
+#define CODE_FILE_COMMIT_MSECS 20
+#define CODE_FILE_BUFFER_SIZE (64 * 1024)
+
+uint32_t crc32(uint8_t *buf, int byteCount); // in runtime.c
+
 char *codeFileName = "ublockscode";
-FILE *codeFile;
+static char tmpCodeFileName[1024];
+static int codeFile = -1;
+static int rewritingCodeFile = false; // true after clearCodeFile() until the next commit
+static int codeStoreIsCurrent = false; // true if the mapped code store already matches the code file
+
+static uint8 *pendingRecords = NULL; // grows if a single record exceeds CODE_FILE_BUFFER_SIZE
+static int pendingCapacity = 0;
+static int pendingBytes = 0;
+static int completeBytes = 0; // bytes of complete records at the start of pendingRecords
+static uint32 pendingSinceMSecs = 0;
+static int codeFileWriteFailed = false; // reported the last write failure
+static int codeFileUnreadable = false; // the code file could not be read; leave it untouched
+
+static int writeAll(int fd, uint8 *buf, int byteCount) {
+	while (byteCount > 0) {
+		int n = write(fd, buf, byteCount);
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			return false;
+		}
+		buf += n;
+		byteCount -= n;
+	}
+	return true;
+}
+
+static int writeGroup(uint8 *payload, int payloadBytes) {
+	// Append a commit group with the given payload. If the write fails, truncate the file
+	// to its previous size so that the partial group does not hide later groups from
+	// replayCodeFile(). Return true on success.
+
+	uint32 header[3] = { CODE_FILE_GROUP_TAG, payloadBytes, crc32(payload, payloadBytes) };
+	struct iovec iov[2] = {
+		{ header, sizeof(header) },
+		{ payload, payloadBytes } };
+	int byteCount = sizeof(header) + payloadBytes;
+	off_t oldSize = lseek(codeFile, 0, SEEK_END);
+	int written = writev(codeFile, iov, 2);
+	int ok = (written == byteCount);
+	if ((written >= 0) && (written < byteCount)) { // rare short write; write the rest
+		if (written < (int) sizeof(header)) {
+			ok = writeAll(codeFile, (uint8 *) header + written, sizeof(header) - written) &&
+				writeAll(codeFile, payload, payloadBytes);
+		} else {
+			ok = writeAll(codeFile, payload + (written - sizeof(header)), byteCount - written);
+		}
+	}
+	if (!ok && (oldSize >= 0)) ftruncate(codeFile, oldSize);
+	return ok;
+}
+
+static int writeCompleteRecords() {
+	// Write the complete pending records as a commit group and keep any partial record.
+	// Return false if the write failed.
+
+	if (!completeBytes) return true;
+	if (!writeGroup(pendingRecords, completeBytes)) {
+		if (!codeFileWriteFailed) outputString("Could not write the code file");
+		codeFileWriteFailed = true;
+		return false;
+	}
+	codeFileWriteFailed = false;
+	pendingBytes -= completeBytes;
+	memmove(pendingRecords, &pendingRecords[completeBytes], pendingBytes);
+	completeBytes = 0;
+	return true;
+}
+
+static void syncCodeFileDirectory() {
+	// Sync the directory that holds the code file, making a rename() of the code file durable.
+
+	char dirName[1024];
+	char *slash = strrchr(codeFileName, '/');
+	if (!slash) {
+		strcpy(dirName, ".");
+	} else {
+		int length = (slash == codeFileName) ? 1 : (slash - codeFileName); // keep "/" for the root
+		snprintf(dirName, sizeof(dirName), "%.*s", length, codeFileName);
+	}
+	int dir = open(dirName, O_RDONLY | O_DIRECTORY);
+	if (dir < 0) return;
+	fsync(dir);
+	close(dir);
+}
+
+static void commitCodeFile() {
+	// Write the pending records as a single commit group and sync the file. If the write
+	// fails, the records remain pending and the commit is retried later.
+
+	if ((codeFile < 0) || (!pendingBytes && !rewritingCodeFile)) return;
+
+	if (pendingBytes) {
+		if (!writeCompleteRecords()) {
+			pendingSinceMSecs = millisecs();
+			return;
+		}
+	}
+	fdatasync(codeFile);
+
+	if (rewritingCodeFile) { // atomically replace the old code file with the compacted one
+		if (0 == rename(tmpCodeFileName, codeFileName)) syncCodeFileDirectory();
+		rewritingCodeFile = false;
+	}
+}
+
+void flushCodeFile() {
+	// Called periodically by the VM loop. Commit pending records once they have
+	// waited long enough for other records to join the group.
+
+	if ((pendingBytes || rewritingCodeFile) &&
+		((millisecs() - pendingSinceMSecs) >= CODE_FILE_COMMIT_MSECS)) {
+			commitCodeFile();
+	}
+}
+
+static void findCompleteRecords() {
+	// Advance completeBytes over the persistent records that are fully buffered. Each
+	// record is a header word and a word count followed by that many data words.
+
+	while ((completeBytes + 8) <= pendingBytes) {
+		int wordCount;
+		memcpy(&wordCount, &pendingRecords[completeBytes + 4], 4);
+		int recordBytes = 8 + (4 * wordCount);
+		if ((wordCount < 0) || ((completeBytes + recordBytes) > pendingBytes)) return;
+		completeBytes += recordBytes;
+	}
+}
+
+static void appendToCodeFile(uint8 *data, int byteCount) {
+	// Buffer the given record data. When the buffer fills, commit the complete records;
+	// a record is never split across commit groups.
+
+	if (codeFileUnreadable) return;
+	if (!pendingBytes) pendingSinceMSecs = millisecs();
+	while (byteCount > 0) {
+		if (pendingBytes == pendingCapacity) {
+			if (!completeBytes || !writeCompleteRecords()) { // grow the buffer instead
+				int newCapacity = pendingCapacity ? (2 * pendingCapacity) : CODE_FILE_BUFFER_SIZE;
+				uint8 *newBuffer = realloc(pendingRecords, newCapacity);
+				if (!newBuffer) {
+					outputString("Not enough memory to buffer the code file");
+					return;
+				}
+				pendingRecords = newBuffer;
+				pendingCapacity = newCapacity;
+			}
+		}
+		int n = pendingCapacity - pendingBytes;
+		if (n > byteCount) n = byteCount;
+		memcpy(&pendingRecords[pendingBytes], data, n);
+		pendingBytes += n;
+		data += n;
+		byteCount -= n;
+		findCompleteRecords();
+	}
+}
+
+static int replayCodeFile(uint8 *fileData, int fileSize, uint8 *flash, int flashByteCount) {
+	// Copy the records of all valid commit groups into the RAM code store and return
+	// the file offset following the last valid group.
+
+	memcpy(flash, fileData, 4); // code store header word
+	int dst = 4;
+	int offset = 4;
+	while ((offset + 12) <= fileSize) {
+		uint32 header[3];
+		memcpy(header, &fileData[offset], 12);
+		int byteCount = header[1];
+		if ((CODE_FILE_GROUP_TAG != header[0]) || (byteCount > (fileSize - offset - 12))) break;
+		uint8 *payload = &fileData[offset + 12];
+		if (header[2] != crc32(payload, byteCount)) break;
+		if ((dst + byteCount) > flashByteCount) break; // should not happen
+		memcpy(&flash[dst], payload, byteCount);
+		dst += byteCount;
+		offset += 12 + byteCount;
+	}
+	return offset;
+}
+
+static void writeCodeFileImage(uint8 *flash, int byteCount) {
+	// Replace the code file with a journal containing the given code store image.
+	// Used to convert code files written by earlier versions.
+
+	clearCodeFile(*(int *) flash & 0xFFFFFF);
+	appendToCodeFile(flash + 4, byteCount - 4);
+	commitCodeFile();
+}
 
 void initCodeFile(uint8 *flash, int flashByteCount) {
-	codeFile = fopen(codeFileName, "ab+");
-	fseek(codeFile, 0 , SEEK_END);
-	long fileSize = ftell(codeFile);
+	snprintf(tmpCodeFileName, sizeof(tmpCodeFileName), "%s.tmp", codeFileName);
+	remove(tmpCodeFileName); // left over from an interrupted compaction; the code file is intact
+
+	if (codeStoreIsCurrent) { // the code store was restored by mapCodeStore(); no replay needed
+		codeFile = open(codeFileName, O_WRONLY | O_APPEND);
+		return;
+	}
+
+	uint8 *fileData = NULL;
+	int fileSize = 0;
+	int readOK = true;
+	int fd = open(codeFileName, O_RDONLY);
+	if (fd >= 0) {
+		struct stat info;
+		readOK = (0 == fstat(fd, &info));
+		if (readOK && (info.st_size > 0)) {
+			fileData = malloc(info.st_size);
+			readOK = (fileData != NULL);
+			while (readOK && (fileSize < info.st_size)) {
+				int n = read(fd, &fileData[fileSize], info.st_size - fileSize);
+				if ((n < 0) && (EINTR == errno)) continue;
+				readOK = (n > 0);
+				if (readOK) fileSize += n;
+			}
+		}
+		close(fd);
+	} else if (ENOENT != errno) {
+		readOK = false;
+	}
 
-	// read code file into simulated Flash:
-	fseek(codeFile, 0L, SEEK_SET);
-	long bytesRead = fread((char*) flash, 1, flashByteCount, codeFile);
-	if (bytesRead != fileSize) {
-		outputString("initCodeFile did not read entire file");
+	if (!readOK) {
+		// don't replace a code file that could not be read (e.g. an I/O error)
+		outputString("Could not read the code file; changes will not be saved");
+		codeFileUnreadable = true;
+		free(fileData);
+		return;
 	}
+
+	if ((fileSize < 4) || ('S' != fileData[3])) {
+		// missing, empty, or unrecognized file; start a new one
+		clearCodeFile(*(int *) flash & 0xFFFFFF);
+		commitCodeFile();
+	} else if ((fileSize >= 8) && ('R' == fileData[7])) {
+		// code file written by an earlier version (a plain copy of the code store)
+		int byteCount = (fileSize < flashByteCount) ? fileSize : flashByteCount;
+		memcpy(flash, fileData, byteCount);
+		writeCodeFileImage(flash, byteCount & ~3);
+	} else {
+		int validBytes = replayCodeFile(fileData, fileSize, flash, flashByteCount);
+		codeFile = open(codeFileName, O_WRONLY | O_APPEND);
+		if (validBytes < fileSize) {
+			outputString("Code file was damaged; recovered all complete records");
+			if (codeFile >= 0) ftruncate(codeFile, validBytes);
+		}
+	}
+	free(fileData);
 }
 
 void writeCodeFile(uint8 *code, int byteCount) {
-	fwrite(code, 1, byteCount, codeFile);
-	fflush(codeFile);
+	appendToCodeFile(code, byteCount);
 }
 
 void writeCodeFileWord(int word) {
-	fwrite(&word, 1, 4, codeFile);
-	fflush(codeFile);
+	appendToCodeFile((uint8 *) &word, 4);
+}
+
+void clearCodeFile(int cycleCount) {
+	// Start writing a new code file. Records written before the next commit replace the
+	// contents of the current code file, which remains in place until then.
+
+	if (codeFileUnreadable) return;
+	if (cycleCount < 1) cycleCount = 1; // a zero cycle count would mark the code store as uninitialized
+	if (codeFile >= 0) close(codeFile);
+	codeFile = open(tmpCodeFileName, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	uint32 header = ('S' << 24) | (cycleCount & 0xFFFFFF);
+	if (codeFile >= 0) writeAll(codeFile, (uint8 *) &header, 4);
+	rewritingCodeFile = true;
+	pendingBytes = completeBytes = 0; // records not yet committed are included in the new code store image
+	pendingSinceMSecs = millisecs();
 }
 
-void clearCodeFile(int ignore) {
-	fclose(codeFile);
-	remove(codeFileName);
-	codeFile = fopen(codeFileName, "ab+");
-	uint32 cycleCount = ('S' << 24) | 1; // Header record, version 1
-	fwrite((uint8 *) &cycleCount, 1, 4, codeFile);
+// Code Store
+
+// The persistent code store is a shared memory mapping of the file <code file>.store, so
+// the chunk table points directly into the mapping. The store size is set at startup with
+// the -codesize option. The code file journal remains the durable record of the code
+// store. The first page of the store file is a header that records whether the VM shut
+// down cleanly and the size of the code file at that time. If both still hold on the next
+// startup, the mapped code store is used as is and the code file is not replayed.
+
+#define CODE_STORE_MAGIC (('M' << 24) | ('B' << 16) | ('C' << 8) | 1)
+#define CODE_STORE_HEADER_BYTES 4096
+#define DEFAULT_CODE_STORE_KBYTES 1024
+#define MAX_CODE_STORE_KBYTES (64 * 1024)
+
+typedef struct {
+	uint32 magic;
+	uint32 storeBytes;
+	uint32 clean;
+	uint32 reserved;
+	uint64_t codeFileBytes;
+} CodeStoreHeader;
+
+static int codeStoreKBytes = DEFAULT_CODE_STORE_KBYTES;
+static uint8 *codeStoreMapping = NULL;
+static int codeStoreMappingBytes = 0;
+
+static int64_t codeFileSize() {
+	struct stat info;
+	return (0 == stat(codeFileName, &info)) ? info.st_size : -1;
+}
+
+uint8_t *mapCodeStore(int *byteCount) {
+	// Map the code store file and return the address and size of the code store.
+	// If the store file does not match the code file it is cleared; initCodeFile()
+	// will then rebuild it from the code file.
+
+	char storeFileName[1024];
+	snprintf(storeFileName, sizeof(storeFileName), "%s.store", codeFileName);
+	int storeBytes = codeStoreKBytes * 1024;
+	codeStoreMappingBytes = CODE_STORE_HEADER_BYTES + storeBytes;
+
+	CodeStoreHeader header;
+	memset(&header, 0, sizeof(header));
+	uint8 *mapping = MAP_FAILED;
+	int fd = open(storeFileName, O_RDWR | O_CREAT, 0644);
+	if (fd >= 0) {
+		if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) memset(&header, 0, sizeof(header));
+		codeStoreIsCurrent =
+			(CODE_STORE_MAGIC == header.magic) && (storeBytes == (int) header.storeBytes) &&
+			header.clean && (codeFileSize() == (int64_t) header.codeFileBytes);
+		if (!codeStoreIsCurrent) ftruncate(fd, 0); // discard stale contents
+		if (0 == ftruncate(fd, codeStoreMappingBytes)) {
+			mapping = mmap(NULL, codeStoreMappingBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+	}
+	if (MAP_FAILED == mapping) {
+		// cannot use a store file (e.g. read-only directory); use anonymous memory
+		codeStoreIsCurrent = false;
+		mapping = mmap(NULL, codeStoreMappingBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == mapping) {
+			perror("Could not allocate the code store");
+			exit(1);
+		}
+	}
+	codeStoreMapping = mapping;
+
+	// mark the store as in use; if the VM does not exit cleanly it will be rebuilt
+	CodeStoreHeader *h = (CodeStoreHeader *) mapping;
+	h->magic = CODE_STORE_MAGIC;
+	h->storeBytes = storeBytes;
+	h->clean = false;
+	msync(mapping, CODE_STORE_HEADER_BYTES, MS_SYNC);
+
+	*byteCount = storeBytes;
+	return mapping + CODE_STORE_HEADER_BYTES;
+}
+
+static void closeCodeStore() {
+	// Called on exit after the code file has been committed. Write back the code store
+	// and mark it clean so the next startup can skip replaying the code file.
+
+	if (!codeStoreMapping) return;
+	CodeStoreHeader *h = (CodeStoreHeader *) codeStoreMapping;
+	int64_t fileBytes = codeFileSize();
+	if (fileBytes >= 0) {
+		msync(codeStoreMapping, codeStoreMappingBytes, MS_SYNC);
+		h->codeFileBytes = fileBytes;
+		h->clean = true;
+		msync(codeStoreMapping, CODE_STORE_HEADER_BYTES, MS_SYNC);
+	}
+	munmap(codeStoreMapping, codeStoreMappingBytes);
+	codeStoreMapping = NULL;
 }
 
 // Debug
 
 void segfault() {
 	printf("-- VM crashed --\n");
+	vmCrashed = true; // the code store may be inconsistent; rebuild it from the code file
 	exitGracefully();
 }
 
 // Linux Main
 
 int main(int argc, char *argv[]) {
-	codeFileName = "ublockscode"; // to do: allow code file name from command line
-
-	if (argc > 1) {
-		codeFileName = argv[1];
-		printf("codeFileName: %s\n", codeFileName);
+	// Usage: ublocks-linux [-unix <socket path> | -tcp <port>] [-codesize <KB>] [code file name]
+
+	codeFileName = "ublockscode";
+	char *socketPath = NULL;
+	int tcpPort = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if ((0 == strcmp(argv[i], "-unix")) && (i + 1 < argc)) {
+			socketPath = argv[++i];
+		} else if ((0 == strcmp(argv[i], "-tcp")) && (i + 1 < argc)) {
+			tcpPort = atoi(argv[++i]);
+		} else if ((0 == strcmp(argv[i], "-codesize")) && (i + 1 < argc)) {
+			codeStoreKBytes = atoi(argv[++i]);
+			if (codeStoreKBytes < 16) codeStoreKBytes = 16;
+			if (codeStoreKBytes > MAX_CODE_STORE_KBYTES) codeStoreKBytes = MAX_CODE_STORE_KBYTES;
+		} else {
+			codeFileName = argv[i];
+			printf("codeFileName: %s\n", codeFileName);
+		}
 	}
 	signal(SIGSEGV, segfault);
 	signal(SIGINT, exit);
 	atexit(exitGracefully);
-	openPseudoTerminal();
-	printf(
-		"Starting Linux MicroBlocks... Connect on %s\n",
-		(char*) ptsname(pty));
+	if (socketPath) {
+		openUnixSocket(socketPath);
+		printf("Starting Linux MicroBlocks... Connect on Unix socket %s\n", socketPath);
+	} else if (tcpPort > 0) {
+		openTCPSocket(tcpPort);
+		printf("Starting Linux MicroBlocks... Connect on localhost:%d\n", tcpPort);
+	} else {
+		openPseudoTerminal();
+		printf(
+			"Starting Linux MicroBlocks... Connect on %s\n",
+			(char*) ptsname(pty));
+	}
 #ifdef ARDUINO_RASPBERRY_PI
 	wiringPiSetup();
 	initPins();
@@ -1 +1,22 @@
+#include <stdint.h>
+
 void delay(int ms);
+
+// Timing
+
+uint64_t totalMicrosecs(void);
+
+// Idle support
+
+void addWakeupFD(int fd);
+void removeWakeupFD(int fd);
+void sleepUntilEvent(int usecs);
+
+// Socket clients
+
+void endClientReply(void);
+
+// Code file
+
+void flushCodeFile(void);
+uint8_t *mapCodeStore(int *byteCount);
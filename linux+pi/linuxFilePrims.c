@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <dirent.h>
@@ -21,14 +22,34 @@
 #include "mem.h"
 #include "interp.h"
 
+// Open files use stdio, optionally with a large buffer given when the file is opened. A
+// file can also be opened in mmap mode: reads then copy directly from a read-only mapping
+// of the file, which is remapped if the file has changed size. Reads are limited only
+// by the size of the object heap.
+//
+// The file size is checked before every mapped read, so a file that another process has
+// truncated is read only up to its new end. A truncation during the copy itself would still
+// raise SIGBUS, so mmap mode should not be used for files that other processes may shorten.
+
 typedef struct {
 	char fileName[100];
 	FILE *file;
+	char *buffer;			// stdio buffer, or NULL to use the default buffer
+	int mapped;				// true if reading from a memory mapping of the file
+	int written;			// the file has been appended to since the last read
+	long readPosition;		// read position saved while appending in stdio mode
+	uint8 *map;
+	size_t mapSize;
+	size_t mapPosition;		// read position in mmap mode
 } FileEntry;
 
 #define FILE_ENTRIES 64
+#define MAX_FILE_BUFFER (64 * 1024 * 1024)
 static FileEntry fileEntry[FILE_ENTRIES]; // records open files
 
+static char *lineBuffer = NULL; // used by readLine; grows as needed
+static size_t lineBufferSize = 0;
+
 DIR *directory;
 struct dirent *nextDirEntry;
 struct stat fileStat;
@@ -68,31 +89,132 @@ static int freeEntry() {
 	return -1; // no free entry
 }
 
-static void tryToOpen(int entryIndex, char* fileName) {
+static void unmapFile(FileEntry *entry) {
+	if (entry->map) munmap(entry->map, entry->mapSize);
+	entry->map = NULL;
+	entry->mapSize = 0;
+}
+
+static void updateMap(FileEntry *entry) {
+	// Map the file, or remap it if it has changed size since it was mapped.
+
+	fflush(entry->file);
+	struct stat st;
+	if (fstat(fileno(entry->file), &st) < 0) {
+		unmapFile(entry); // don't read from a mapping that may extend past the end of the file
+		return;
+	}
+	entry->written = false;
+	if (entry->map && ((size_t) st.st_size == entry->mapSize)) return;
+	unmapFile(entry);
+	if (st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(entry->file), 0);
+		if (MAP_FAILED != map) {
+			entry->map = map;
+			entry->mapSize = st.st_size;
+		}
+	}
+}
+
+static void closeEntryFile(int entryIndex) {
+	FileEntry *entry = &fileEntry[entryIndex];
+	unmapFile(entry);
+	entry->mapped = false;
+	entry->written = false;
+	if (entry->file) fclose(entry->file);
+	entry->file = NULL;
+	free(entry->buffer); // after fclose(), which may still use the buffer
+	entry->buffer = NULL;
+}
+
+static void tryToOpen(int entryIndex, char* fileName, int bufferSize, int useMap) {
 	if (entryIndex >= 0) {
-		if (fileEntry[entryIndex].file) fclose(fileEntry[entryIndex].file);
+		FileEntry *entry = &fileEntry[entryIndex];
+		closeEntryFile(entryIndex);
 
-		fileEntry[entryIndex].file = fopen(fileName, "a+");
+		entry->file = fopen(fileName, "a+");
 
-		if (!fileEntry[entryIndex].file) {
-			fileEntry[entryIndex].file = fopen(fileName, "r");
+		if (!entry->file) {
+			entry->file = fopen(fileName, "r");
 		}
 
-		if (fileEntry[entryIndex].file) {
-			fseek(fileEntry[entryIndex].file, 0, SEEK_SET); // read from start of file
+		if (entry->file) {
+			if (bufferSize > 0) { // must be done before any other operation on the file
+				entry->buffer = malloc(bufferSize);
+				if (entry->buffer) setvbuf(entry->file, entry->buffer, _IOFBF, bufferSize);
+			}
+			fseek(entry->file, 0, SEEK_SET); // read from start of file
+			if (useMap) {
+				entry->mapped = true;
+				entry->mapPosition = 0;
+				updateMap(entry);
+			}
 		} else {
-			fileEntry[entryIndex].fileName[0] = '\0';
+			entry->fileName[0] = '\0';
 		}
 	}
 }
 
+static void prepareToWrite(FileEntry *entry) {
+	// Appends always go to the end of the file; remember where reading left off.
+
+	if (!entry->written && !entry->mapped) entry->readPosition = ftell(entry->file);
+	entry->written = true;
+}
+
+static void prepareToRead(FileEntry *entry) {
+	// Return to the read position after appending. In mmap mode, this remaps the file.
+
+	if (entry->mapped) {
+		if (entry->written) updateMap(entry);
+	} else if (entry->written) {
+		fseek(entry->file, entry->readPosition, SEEK_SET); // flushes pending output
+		entry->written = false;
+	}
+}
+
+static size_t bytesAvailable(FileEntry *entry) {
+	// Return the number of bytes between the read position and the end of the file.
+
+	prepareToRead(entry);
+	if (entry->mapped) {
+		updateMap(entry); // the file may have been truncated or extended by another process
+		return (entry->mapPosition < entry->mapSize) ? entry->mapSize - entry->mapPosition : 0;
+	}
+	long position = ftell(entry->file);
+	struct stat st;
+	if ((position < 0) || (fstat(fileno(entry->file), &st) < 0)) return 0;
+	return (st.st_size > position) ? st.st_size - position : 0;
+}
+
+static size_t readFromEntry(FileEntry *entry, uint8 *dst, size_t byteCount) {
+	// Read up to byteCount bytes at the current position and return the number read.
+
+	if (entry->mapped) {
+		size_t available = bytesAvailable(entry);
+		if (byteCount > available) byteCount = available;
+		memcpy(dst, &entry->map[entry->mapPosition], byteCount);
+		entry->mapPosition += byteCount;
+		return byteCount;
+	}
+	return fread(dst, 1, byteCount, entry->file);
+}
+
 static OBJ primOpen(int argCount, OBJ *args) {
+	// Open the given file. The optional second argument is the size of the file's I/O
+	// buffer in bytes (zero for the default). If the optional third argument is true,
+	// reads are done from a memory mapping of the file.
+
 	if (argCount < 1) return fail(notEnoughArguments);
 	char fileName[100];
 	extractFilename(args[0], fileName);
+	int bufferSize = ((argCount > 1) && isInt(args[1])) ? obj2int(args[1]) : 0;
+	if (bufferSize > MAX_FILE_BUFFER) bufferSize = MAX_FILE_BUFFER;
+	int useMap = (argCount > 2) && (trueObj == args[2]);
+
 	int i = entryFor(fileName);
 	if (i >= 0) { // found an existing entry; close and reopen
-		tryToOpen(i, fileName);
+		tryToOpen(i, fileName, bufferSize, useMap);
 		return falseObj;
 	}
 	i = freeEntry();
@@ -100,7 +222,7 @@ static OBJ primOpen(int argCount, OBJ *args) {
 		fileEntry[i].fileName[0] = '\0';
 		strncpy(fileEntry[i].fileName, fileName, 99);
 		fileEntry[i].fileName[99] = '\0'; // ensure null termination
-		tryToOpen(i, fileName);
+		tryToOpen(i, fileName, bufferSize, useMap);
 	}
 	return falseObj;
 }
@@ -112,8 +234,7 @@ static OBJ primClose(int argCount, OBJ *args) {
 	int i = entryFor(fileName);
 	if (i >= 0) {
 		fileEntry[i].fileName[0] = '\0';
-		fclose(fileEntry[i].file);
-		fileEntry[i].file = NULL;
+		closeEntryFile(i);
 		return falseObj;
 	}
 	return falseObj;
@@ -127,7 +248,7 @@ static OBJ primDelete(int argCount, OBJ *args) {
 	int i = entryFor(fileName);
 	if (i >= 0) {
 		fileEntry[i].fileName[0] = '\0';
-		fclose(fileEntry[i].file);
+		closeEntryFile(i);
 	}
 
 	if (fileName[0]) remove(fileName);
@@ -142,55 +263,97 @@ static OBJ primEndOfFile(int argCount, OBJ *args) {
 	int i = entryFor(fileName);
 	if (i < 0) return trueObj;
 
+	prepareToRead(&fileEntry[i]);
+	if (fileEntry[i].mapped) return (0 == bytesAvailable(&fileEntry[i])) ? trueObj : falseObj;
 	return feof(fileEntry[i].file) ? trueObj : falseObj;
 }
 
 static OBJ primReadLine(int argCount, OBJ *args) {
+	// Return the next line of the file, including its newline, or the empty string at
+	// the end of the file.
+
 	if (argCount < 1) return fail(notEnoughArguments);
 	char fileName[100];
 	extractFilename(args[0], fileName);
 
 	int i = entryFor(fileName);
 	if (i < 0) return newString(0);
-
-	char buf[800];
-	uint32 byteCount = 0;
-
-	if (fgets(buf, 800, fileEntry[i].file) != NULL) {
-		byteCount = strlen(buf);
-		OBJ result = newString(byteCount);
-		if (result) {
-			memcpy(obj2str(result), buf, byteCount);
-			return result;
-		}
+	FileEntry *entry = &fileEntry[i];
+
+	if (entry->mapped) {
+		size_t available = bytesAvailable(entry);
+		uint8 *start = &entry->map[entry->mapPosition];
+		uint8 *newline = available ? memchr(start, '\n', available) : NULL;
+		size_t byteCount = newline ? (newline - start) + 1 : available;
+		OBJ result = newStringFromBytes((char *) start, byteCount);
+		if (result) entry->mapPosition += byteCount;
+		return result;
 	}
-	return newString(0);
+
+	prepareToRead(entry);
+	ssize_t byteCount = getline(&lineBuffer, &lineBufferSize, entry->file);
+	if (byteCount <= 0) return newString(0);
+	return newStringFromBytes(lineBuffer, byteCount);
 }
 
 static OBJ primReadBytes(int argCount, OBJ *args) {
+	// Read up to the given number of bytes, starting at the optional byte offset.
+
 	if (argCount < 2) return fail(notEnoughArguments);
 	if (!isInt(args[0])) return fail(needsIntegerError);
-	uint32 byteCount = obj2int(args[0]);
+	int requested = obj2int(args[0]);
 	char fileName[100];
 	extractFilename(args[1], fileName);
 
 	int i = entryFor(fileName);
-	if (i >= 0) {
-		uint8 buf[800];
-		if (byteCount > sizeof(buf)) byteCount = sizeof(buf);
-		if ((argCount > 2) && isInt(args[2])) {
-			fseek(fileEntry[i].file, obj2int(args[2]), SEEK_SET);
-		}
-		byteCount = fread(buf, 1, byteCount, fileEntry[i].file);
-		int wordCount = (byteCount + 3) / 4;
-		OBJ result = newObj(ByteArrayType, wordCount, falseObj);
-		if (result) {
-			setByteCountAdjust(result, byteCount);
-			memcpy(&FIELD(result, 0), buf, byteCount);
-			return result;
+	if ((i < 0) || (requested <= 0)) return newObj(ByteArrayType, 0, falseObj);
+	FileEntry *entry = &fileEntry[i];
+	if ((argCount > 2) && isInt(args[2])) {
+		if (entry->mapped) {
+			entry->mapPosition = obj2int(args[2]);
+		} else {
+			fseek(entry->file, obj2int(args[2]), SEEK_SET);
+			entry->written = false;
 		}
 	}
-	return newObj(ByteArrayType, 0 ,falseObj);
+
+	size_t byteCount = bytesAvailable(entry);
+	if (byteCount > (size_t) requested) byteCount = requested;
+	OBJ result = newObj(ByteArrayType, (byteCount + 3) / 4, falseObj);
+	if (!result) return result; // insufficient memory
+	size_t bytesRead = readFromEntry(entry, (uint8 *) &FIELD(result, 0), byteCount);
+	if (bytesRead < byteCount) result = resizeObj(result, (bytesRead + 3) / 4); // short read
+	setByteCountAdjust(result, bytesRead);
+	return result;
+}
+
+static OBJ primReadInto(int argCount, OBJ *args) {
+	// Read into the given ByteArray, filling as much of it as possible. Return the number
+	// of bytes read.
+
+	if (argCount < 2) return fail(notEnoughArguments);
+	OBJ buf = args[0];
+	char fileName[100];
+	extractFilename(args[1], fileName);
+	if (ByteArrayType != objType(buf)) return fail(needsByteArray);
+
+	int i = entryFor(fileName);
+	if (i < 0) return zeroObj; // file not found
+
+	size_t byteCount = BYTES(buf);
+	size_t available = bytesAvailable(&fileEntry[i]);
+	if (byteCount > available) byteCount = available;
+	return int2obj(readFromEntry(&fileEntry[i], (uint8 *) &FIELD(buf, 0), byteCount));
+}
+
+static void printItem(FILE *file, OBJ item) {
+	if (IS_TYPE(item, StringType)) {
+		fputs(obj2str(item), file);
+	} else if (isInt(item)) {
+		fprintf(file, "%i", obj2int(item));
+	} else if (isBoolean(item)) {
+		fputs((trueObj == item) ? "true" : "false", file);
+	}
 }
 
 static OBJ primAppendLine(int argCount, OBJ *args) {
@@ -202,32 +365,20 @@ static OBJ primAppendLine(int argCount, OBJ *args) {
 
 	int i = entryFor(fileName);
 	if (i >= 0) {
-		if (IS_TYPE(arg, StringType)) {
-			fprintf(fileEntry[i].file, "%s", obj2str(arg));
-		} else if (isInt(arg)) {
-			fprintf(fileEntry[i].file, "%i", obj2int(arg));
-		} else if (isBoolean(arg)) {
-			fprintf(fileEntry[i].file, "%s", (trueObj == arg) ?
-					"true" : "false");
-		} else if (IS_TYPE(arg, ListType)) {
+		prepareToWrite(&fileEntry[i]);
+		FILE *file = fileEntry[i].file;
+		if (IS_TYPE(arg, ListType)) {
 			// print list items separated by spaces
 			int count = obj2int(FIELD(arg, 0));
 			for (int j = 1; j <= count; j++) {
-				OBJ item = FIELD(arg, j);
-				if (IS_TYPE(item, StringType)) {
-					fprintf(fileEntry[i].file, "%s", obj2str(item));
-				} else if (isInt(item)) {
-					fprintf(fileEntry[i].file, "%i", obj2int(item));
-				} else if (isBoolean(item)) {
-					fprintf(fileEntry[i].file, "%s", (trueObj == item) ?
-							"true" : "false");
-				}
-				if (j < count) fprintf(fileEntry[i].file, " ");
+				printItem(file, FIELD(arg, j));
+				if (j < count) fputc(' ', file);
 			}
+		} else {
+			printItem(file, arg);
 		}
-		fprintf(fileEntry[i].file, "\n");
+		fputc('\n', file);
 	}
-	processMessage();
 	return falseObj;
 }
 
@@ -240,16 +391,56 @@ static OBJ primAppendBytes(int argCount, OBJ *args) {
 	int i = entryFor(fileName);
 	if (i < 0) return falseObj;
 
+	prepareToWrite(&fileEntry[i]);
 	if (IS_TYPE(data, ByteArrayType)) {
 		fwrite((uint8 *) &FIELD(data, 0), 1, BYTES(data), fileEntry[i].file);
 	} else if (IS_TYPE(data, StringType)) {
 		char *s = obj2str(data);
 		fwrite((uint8 *) s, 1, strlen(s), fileEntry[i].file);
 	}
-	processMessage();
 	return falseObj;
 }
 
+// Data logger file operations (called from dataLogPrims.c)
+
+static FILE *logFile = NULL;
+
+int logFileOpen(const char *fileName) {
+	int i = entryFor((char *) fileName);
+	if (i >= 0) { // the log file must not also be open through the file primitives
+		fileEntry[i].fileName[0] = '\0';
+		closeEntryFile(i);
+	}
+	logFile = fopen(fileName, "a");
+	if (logFile) fseek(logFile, 0, SEEK_END); // so ftell() reports the file size
+	return logFile != NULL;
+}
+
+int logFileWrite(uint8 *data, int byteCount) {
+	return logFile ? fwrite(data, 1, byteCount, logFile) : 0;
+}
+
+int logFileSize() {
+	return logFile ? ftell(logFile) : 0;
+}
+
+void logFileFlush() {
+	if (logFile) fflush(logFile);
+}
+
+void logFileClose() {
+	if (logFile) fclose(logFile);
+	logFile = NULL;
+}
+
+void logFileRename(const char *oldName, const char *newName) {
+	rename(oldName, newName);
+}
+
+void logFileRemove(const char *fileName) {
+	remove(fileName);
+}
+
 static OBJ primFileSize(int argCount, OBJ *args) {
 	if (argCount < 1) return fail(notEnoughArguments);
 	char fileName[100];
@@ -308,6 +499,7 @@ static PrimEntry entries[] = {
 	{"endOfFile", primEndOfFile},
 	{"readLine", primReadLine},
 	{"readBytes", primReadBytes},
+	{"readInto", primReadInto},
 
 	{"appendLine", primAppendLine},
 	{"appendBytes", primAppendBytes},
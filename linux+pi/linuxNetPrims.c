@@ -13,6 +13,7 @@
 #define _XOPEN_SOURCE 500
 #define _POSIX_C_SOURCE 200112L
 #define _DEFAULT_SOURCE
+#define _GNU_SOURCE // for recvmmsg() and sendmmsg()
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,6 +23,7 @@
 #include "mem.h"
 #include "tinyJSON.h"
 #include "interp.h"
+#include "linux.h"
 
 #include <ifaddrs.h>
 #include <net/if.h>
@@ -32,9 +34,12 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/errno.h>
 #include <time.h>
 
@@ -48,7 +53,7 @@ static char serverStarted = false;
 
 int clientSocket = -1;
 int serverSocket = -1;
-int serverRequestSocket = -1; // Client currently connected to the server.
+int serverRequestSocket = -1; // HTTP server connection being answered (see HTTP Server)
 int serverPort = 8080; // Default port. Can be changed on a request basis.
 
 static OBJ primHasWiFi(int argCount, OBJ *args) { return trueObj; }
@@ -162,14 +167,78 @@ char socketConnected(int socket) {
 
 // HTTP Server
 
+// The server tracks up to MAX_HTTP_CONNECTIONS client connections using epoll. The epoll
+// file descriptor is registered as a wakeup FD, so an idle VM wakes when any connection
+// has activity. Connections are serviced each time httpServerGetRequest is called.
+//
+// Incoming bytes are buffered per connection. A request is complete once its headers and
+// Content-Length bytes of body have arrived, so a client may pipeline several requests.
+// httpServerGetRequest returns one complete request at a time, visiting connections in
+// round-robin order, and makes that connection the current one; respondToHttpRequest
+// replies to the current connection. A connection gets no new request until it has been
+// answered, so pipelined responses stay in order. Requests too large for the request
+// buffer are returned in pieces: the headers and as much of the body as fits, then the
+// rest of the body in later calls.
+//
+// Responses are HTTP/1.1 and sent with writev(). Output that the socket cannot accept
+// immediately is queued and sent as the socket drains. A response with a
+// "Transfer-Encoding: chunked" header starts a chunked response; httpServerSendChunk
+// sends further chunks and an empty chunk ends it.
+
+#define MAX_HTTP_CONNECTIONS 64
+#define HTTP_REQUEST_BUFFER_SIZE 16384
+#define HTTP_MAX_QUEUED_OUTPUT (4 * 1024 * 1024)
+#define HTTP_IDLE_MSECS 30000
+#define HTTP_LISTENER MAX_HTTP_CONNECTIONS // epoll data for the server socket
+
+typedef struct {
+	int fd;
+	uint8 in[HTTP_REQUEST_BUFFER_SIZE];	// received bytes not yet returned to the script
+	int inCount;
+	int bodyRemaining;		// body bytes of a large request still to be returned
+	int awaitingResponse;	// a request was returned and has not yet been answered
+	int clientKeepAlive;	// the last request returned allows a persistent connection
+	int readable;			// there may be unread input (epoll is edge-triggered)
+	int writable;			// the socket can accept output
+	int peerClosed;
+	int closeWhenSent;
+	uint8 *out;				// queued output
+	int outCount;
+	int outSize;
+	uint32 lastActivity;
+} HttpConnection;
+
+static HttpConnection *httpConnections[MAX_HTTP_CONNECTIONS];
+static int epollFD = -1;
+static int nextConnection = 0;			// round-robin index for returning requests
+static int chunkedConnection = -1;		// connection receiving a chunked response
+
+static void closeConnection(int i) {
+	HttpConnection *c = httpConnections[i];
+	if (!c) return;
+	epoll_ctl(epollFD, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->out);
+	free(c);
+	httpConnections[i] = NULL;
+	if (serverRequestSocket == i) serverRequestSocket = -1;
+	if (chunkedConnection == i) chunkedConnection = -1;
+}
+
 static void closeServerSocket() {
+	for (int i = 0; i < MAX_HTTP_CONNECTIONS; i++) closeConnection(i);
+	if (epollFD >= 0) {
+		removeWakeupFD(epollFD);
+		close(epollFD);
+		epollFD = -1;
+	}
 	shutdown(serverSocket, SHUT_RDWR);
 	close(serverSocket);
 	serverSocket = -1;
 	serverStarted = false;
 }
 
-static int openServerSocket() {
+static int openServerSocket(int port) {
 	// Return a non-blocking server socket on the given port, or -1 if failed.
 
 	int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
@@ -187,13 +256,14 @@ static int openServerSocket() {
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET; // IPv4
-	addr.sin_port = htons(serverPort);
+	addr.sin_port = htons(port);
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
 	if (bind(serverSocket, (struct sockaddr*) &addr, sizeof(addr)) >= 0) {
-		listen(serverSocket, 10); // queue length = 10 (probably overkill)
+		listen(serverSocket, 64);
 	} else {
-		closeServerSocket();
+		close(serverSocket);
+		serverSocket = -1;
 	}
 	return serverSocket;
 }
@@ -203,46 +273,207 @@ static void startHttpServer() {
 	// port changes
 	if (!serverStarted) {
 		// Start the server
-		serverSocket = openServerSocket();
-		serverStarted = (serverSocket > -1);
+		serverSocket = openServerSocket(serverPort);
+		if (serverSocket < 0) return;
+		epollFD = epoll_create1(EPOLL_CLOEXEC);
+		if (epollFD < 0) {
+			close(serverSocket);
+			serverSocket = -1;
+			return;
+		}
+		struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.u32 = HTTP_LISTENER };
+		epoll_ctl(epollFD, EPOLL_CTL_ADD, serverSocket, &event);
+		addWakeupFD(epollFD); // wake an idle VM on any server or connection activity
+		serverStarted = true;
+	}
+}
+
+static void acceptConnections() {
+	while (true) {
+		int fd = accept(serverSocket, NULL, NULL);
+		if (fd < 0) return; // no more pending connections
+
+		int i = 0;
+		while ((i < MAX_HTTP_CONNECTIONS) && httpConnections[i]) i++;
+		HttpConnection *c = (i < MAX_HTTP_CONNECTIONS) ? calloc(1, sizeof(HttpConnection)) : NULL;
+		if (!c) { // too many connections
+			close(fd);
+			continue;
+		}
+		setNonBlocking(fd);
+		// transmit data immediately (i.e. don't use the Nagle algorithm)
+		int flag = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &flag, sizeof(flag));
+
+		c->fd = fd;
+		c->readable = true;
+		c->writable = true;
+		c->lastActivity = millisecs();
+		httpConnections[i] = c;
+		struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.u32 = i };
+		epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event);
+	}
+}
+
+static void readConnection(HttpConnection *c) {
+	// Read available input until the socket would block or the request buffer is full.
+
+	while (c->inCount < HTTP_REQUEST_BUFFER_SIZE) {
+		int n = recv(c->fd, &c->in[c->inCount], HTTP_REQUEST_BUFFER_SIZE - c->inCount, 0);
+		if (n > 0) {
+			c->inCount += n;
+			c->lastActivity = millisecs();
+		} else if ((n < 0) && (EINTR == errno)) {
+			continue;
+		} else {
+			if ((0 == n) || ((EAGAIN != errno) && (EWOULDBLOCK != errno))) c->peerClosed = true;
+			c->readable = false;
+			return;
+		}
+	}
+}
+
+static int flushConnection(HttpConnection *c) {
+	// Send queued output. Return false if the connection failed.
+
+	while (c->outCount > 0) {
+		int n = send(c->fd, c->out, c->outCount, MSG_NOSIGNAL);
+		if (n > 0) {
+			memmove(c->out, &c->out[n], c->outCount - n);
+			c->outCount -= n;
+			c->lastActivity = millisecs();
+		} else if ((n < 0) && (EINTR == errno)) {
+			continue;
+		} else if ((n < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno))) {
+			c->writable = false;
+			return true;
+		} else {
+			return false;
+		}
 	}
+	return true;
 }
 
-static void acceptConnection() {
-	// Attempt to accept an incoming connection on the given server socket.
-	// If successful, return the socket for the new connect, otherwise return -1.
+static int headerLength(HttpConnection *c) {
+	// Return the length of the request headers, including the blank line that ends them,
+	// or -1 if the headers are not yet complete.
 
-	if (serverSocket > -1) {
-		struct sockaddr_in clientAddr;
-		socklen_t size = sizeof(clientAddr);
+	for (int i = 3; i < c->inCount; i++) {
+		if (('\n' == c->in[i]) && ('\n' == c->in[i - 2]) && ('\r' == c->in[i - 1])) return i + 1;
+	}
+	return -1;
+}
 
-		serverRequestSocket = accept(serverSocket, (void *) &clientAddr, &size);
-		if (serverRequestSocket >= 0) {
-			setNonBlocking(serverRequestSocket);
-			// transmit data immediately (i.e. don't use the Nagle algorithm)
-			int flag = 1;
-			setsockopt(serverRequestSocket, IPPROTO_TCP, TCP_NODELAY, (void *) &flag, sizeof(flag));
+static int containsIgnoringCase(const char *s, const char *pattern) {
+	int len = strlen(pattern);
+	for ( ; *s; s++) {
+		if (0 == strncasecmp(s, pattern, len)) return true;
+	}
+	return false;
+}
+
+static char * findHeader(HttpConnection *c, int headerBytes, const char *name) {
+	// Return a pointer to the value of the given header (case-insensitive) or NULL.
+
+	int nameLen = strlen(name);
+	for (int i = 0; i < (headerBytes - nameLen); i++) {
+		if ((i > 0) && ('\n' == c->in[i - 1]) && (0 == strncasecmp((char *) &c->in[i], name, nameLen))) {
+			char *value = (char *) &c->in[i + nameLen];
+			while ((' ' == *value) || ('\t' == *value)) value++;
+			return value;
+		}
+	}
+	return NULL;
+}
+
+static int returnableBytes(HttpConnection *c) {
+	// Return the number of bytes at the start of the input buffer that can be returned
+	// as the next request (or request piece), or zero if none. Set the connection state
+	// for a new request.
+
+	if (c->bodyRemaining > 0) return (c->inCount < c->bodyRemaining) ? c->inCount : c->bodyRemaining;
+	if (c->awaitingResponse) return 0;
+
+	int headerBytes = headerLength(c);
+	if (headerBytes < 0) {
+		if (c->inCount == HTTP_REQUEST_BUFFER_SIZE) c->peerClosed = true; // headers too large
+		return 0;
+	}
+	char *value = findHeader(c, headerBytes, "Content-Length:");
+	int bodyBytes = value ? atoi(value) : 0;
+	if (bodyBytes < 0) bodyBytes = 0;
+	int requestBytes = headerBytes + bodyBytes;
+	if ((requestBytes > c->inCount) && (c->inCount < HTTP_REQUEST_BUFFER_SIZE)) return 0; // incomplete
+
+	// HTTP/1.1 connections are persistent unless the client asks to close them
+	value = findHeader(c, headerBytes, "Connection:");
+	uint8 *eol = memchr(c->in, '\n', headerBytes); // end of request line
+	int isHTTP11 = ((eol - c->in) >= 9) && (0 == strncmp((char *) eol - 9, "HTTP/1.1\r", 9));
+	c->clientKeepAlive = value ? (0 == strncasecmp(value, "keep-alive", 10)) : isHTTP11;
+	if (value && (0 == strncasecmp(value, "close", 5))) c->clientKeepAlive = false;
+
+	c->awaitingResponse = true;
+	if (requestBytes > c->inCount) { // large request; return it in pieces
+		c->bodyRemaining = requestBytes - c->inCount;
+		return c->inCount;
+	}
+	return requestBytes;
+}
+
+static void serviceHttpConnections() {
+	if (epollFD < 0) return;
+	addWakeupFD(epollFD); // re-arm idle wakeups (see sleepUntilEvent() in linux.c)
+
+	struct epoll_event events[32];
+	int n;
+	while ((n = epoll_wait(epollFD, events, 32, 0)) > 0) {
+		for (int i = 0; i < n; i++) {
+			int id = events[i].data.u32;
+			if (HTTP_LISTENER == id) {
+				acceptConnections();
+			} else if ((id < MAX_HTTP_CONNECTIONS) && httpConnections[id]) {
+				if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) httpConnections[id]->readable = true;
+				if (events[i].events & EPOLLOUT) httpConnections[id]->writable = true;
+			}
+		}
+		if (n < 32) break;
+	}
+
+	uint32 now = millisecs();
+	for (int i = 0; i < MAX_HTTP_CONNECTIONS; i++) {
+		HttpConnection *c = httpConnections[i];
+		if (!c) continue;
+		if (c->readable) readConnection(c);
+		if (c->writable && !flushConnection(c)) {
+			closeConnection(i);
+			continue;
+		}
+		int done = (0 == c->outCount) && !c->awaitingResponse && (chunkedConnection != i);
+		if (done && (c->closeWhenSent || (c->peerClosed && !returnableBytes(c)))) {
+			closeConnection(i);
+		} else if ((now - c->lastActivity) > HTTP_IDLE_MSECS) {
+			closeConnection(i);
 		}
 	}
 }
 
 static int serverHasClient() {
 	// Return true when the HTTP server has a client and the client is connected.
-	// Continue to return true if any data is available from the client even if the client
-	// has closed the connection. Start the HTTP server the first time this is called.
+	// Start the HTTP server the first time this is called.
 
 	if (!serverStarted) startHttpServer();
-	if (-1 == serverRequestSocket) acceptConnection();
-
-	return (serverRequestSocket > -1);
+	serviceHttpConnections();
+	for (int i = 0; i < MAX_HTTP_CONNECTIONS; i++) {
+		if (httpConnections[i]) return true;
+	}
+	return false;
 }
 
 static OBJ primHttpServerGetRequest(int argCount, OBJ *args) {
-	// Return some data from the current HTTP request. Return the empty string if no
-	// data is available. If there isn't currently a client connection, and a client
-	// is waiting, accept the new connection. If the optional first argument is true,
-	// return a ByteArray (binary data) instead of a string. The optional second arg
-	// can specify a port. Changing ports stops and restarts the server.
+	// Return the next HTTP request from any client, or a further piece of a large request.
+	// Return the empty string if no request is available. If the optional first argument
+	// is true, return a ByteArray (binary data) instead of a string. The optional second
+	// arg can specify a port. Changing ports stops and restarts the server.
 	// Fail if there isn't enough memory to allocate the result object.
 
 	int useBinary = ((argCount > 0) && (trueObj == args[0]));
@@ -256,98 +487,195 @@ static OBJ primHttpServerGetRequest(int argCount, OBJ *args) {
 		}
 	}
 
-	OBJ result = useBinary ? newObj(ByteArrayType, 0, falseObj) : newString(0);
+	if (!serverHasClient()) return useBinary ? newObj(ByteArrayType, 0, falseObj) : newString(0);
 
-	if (serverHasClient() && socketConnected(serverRequestSocket)) {
-		char buf[800];
-		int byteCount = recv(serverRequestSocket, buf, 800, 0);
-		if (byteCount > 0) {
-			if (useBinary) {
-				result = newObj(ByteArrayType, (byteCount + 3) / 4, falseObj);
-				memcpy(&FIELD(result, 0), buf, byteCount);
-			} else {
-				result = newString(byteCount);
-				memcpy(obj2str(result), buf, byteCount);
-			}
+	// continue returning a large request from the current connection
+	HttpConnection *c = (serverRequestSocket >= 0) ? httpConnections[serverRequestSocket] : NULL;
+	int byteCount = (c && (c->bodyRemaining > 0)) ? returnableBytes(c) : 0;
+
+	// otherwise, return a request from the next connection that has one
+	for (int i = 0; (0 == byteCount) && (i < MAX_HTTP_CONNECTIONS); i++) {
+		int id = (nextConnection + i) % MAX_HTTP_CONNECTIONS;
+		c = httpConnections[id];
+		if (c && (c->bodyRemaining == 0)) byteCount = returnableBytes(c);
+		if (byteCount) {
+			serverRequestSocket = id;
+			nextConnection = (id + 1) % MAX_HTTP_CONNECTIONS;
+		}
+	}
+	if (0 == byteCount) return useBinary ? newObj(ByteArrayType, 0, falseObj) : newString(0);
+
+	OBJ result;
+	if (useBinary) {
+		result = newObj(ByteArrayType, (byteCount + 3) / 4, falseObj);
+		if (result) {
+			setByteCountAdjust(result, byteCount);
+			memcpy(&FIELD(result, 0), c->in, byteCount);
 		}
+	} else {
+		result = newStringFromBytes((char *) c->in, byteCount);
 	}
+	if (!result) return result; // insufficient memory; the request will be returned later
 
+	if (c->bodyRemaining > 0) c->bodyRemaining -= (c->bodyRemaining < byteCount) ? c->bodyRemaining : byteCount;
+	memmove(c->in, &c->in[byteCount], c->inCount - byteCount);
+	c->inCount -= byteCount;
+	if (c->readable) readConnection(c); // the buffer may have been full
 	return result;
 }
 
+static int sendToConnection(HttpConnection *c, struct iovec *iov, int iovCount) {
+	// Send the given data, queueing whatever the socket does not accept immediately.
+	// Return false if the connection failed or too much output is queued.
+
+	int total = 0;
+	for (int i = 0; i < iovCount; i++) total += iov[i].iov_len;
+
+	int sent = 0;
+	if ((0 == c->outCount) && c->writable) {
+		sent = writev(c->fd, iov, iovCount);
+		if (sent < 0) {
+			if ((EAGAIN != errno) && (EWOULDBLOCK != errno) && (EINTR != errno)) return false;
+			sent = 0;
+		}
+		if (sent < total) c->writable = false;
+		c->lastActivity = millisecs();
+	}
+	if (sent == total) return true;
+
+	// queue the unsent output
+	int needed = c->outCount + (total - sent);
+	if (needed > HTTP_MAX_QUEUED_OUTPUT) return false;
+	if (needed > c->outSize) {
+		uint8 *out = realloc(c->out, needed);
+		if (!out) return false;
+		c->out = out;
+		c->outSize = needed;
+	}
+	for (int i = 0; i < iovCount; i++) {
+		int skip = (sent < (int) iov[i].iov_len) ? sent : iov[i].iov_len;
+		sent -= skip;
+		memcpy(&c->out[c->outCount], (uint8 *) iov[i].iov_base + skip, iov[i].iov_len - skip);
+		c->outCount += iov[i].iov_len - skip;
+	}
+	return true;
+}
+
+static void bodyOf(OBJ obj, uint8 **body, int *byteCount) {
+	*body = NULL;
+	*byteCount = -1; // no body
+	if (IS_TYPE(obj, StringType)) {
+		*body = (uint8 *) obj2str(obj);
+		*byteCount = strlen(obj2str(obj));
+	} else if (IS_TYPE(obj, ByteArrayType)) {
+		*body = (uint8 *) &FIELD(obj, 0);
+		*byteCount = BYTES(obj);
+	}
+}
+
+static void finishResponse(int id) {
+	HttpConnection *c = httpConnections[id];
+	c->awaitingResponse = false;
+	if (chunkedConnection == id) chunkedConnection = -1;
+	if (c->closeWhenSent && (0 == c->outCount)) closeConnection(id);
+}
+
 static OBJ primRespondToHttpRequest(int argCount, OBJ *args) {
 	// Send a response to the client with the status. optional extra headers, and optional body.
-	char response[8096];
+	// The optional fourth argument says whether to keep the connection open; if omitted,
+	// the connection is kept open if the client allows it.
 
-	if (serverRequestSocket < 0) return falseObj;
+	int id = serverRequestSocket;
+	if ((id < 0) || !httpConnections[id]) return falseObj;
+	HttpConnection *c = httpConnections[id];
+	if (!c->awaitingResponse) return falseObj;
+	if (c->bodyRemaining > 0) c->closeWhenSent = true; // rest of request body was not read
 
 	// status
 	char *status = (char *) "200 OK";
 	if ((argCount > 0) && IS_TYPE(args[0], StringType)) status = obj2str(args[0]);
 
 	// body
-	int contentLength = -1; // no body
-	if (argCount > 1) {
-		if (IS_TYPE(args[1], StringType)) {
-			contentLength = strlen(obj2str(args[1]));
-		} else if (IS_TYPE(args[1], ByteArrayType)) {
-			contentLength = BYTES(args[1]);
-		}
-	}
+	uint8 *body = NULL;
+	int contentLength = -1;
+	if (argCount > 1) bodyOf(args[1], &body, &contentLength);
 
 	// additional headers
-	char *extraHeaders = NULL;
-	if ((argCount > 2) && IS_TYPE(args[2], StringType)) {
-		extraHeaders = obj2str(args[2]);
-		if (0 == strlen(extraHeaders)) extraHeaders = NULL; // empty string
-	}
+	char *extraHeaders = "";
+	if ((argCount > 2) && IS_TYPE(args[2], StringType)) extraHeaders = obj2str(args[2]);
+	int extraLength = strlen(extraHeaders);
+	int chunked = containsIgnoringCase(extraHeaders, "Transfer-Encoding: chunked");
 
 	// keep alive flag
-	int keepAlive = ((argCount > 3) && (trueObj == args[3]));
-
-	// send headers
-	sprintf(response, "HTTP/1.0 %s\r\n", status);
-	strcat(response, "Access-Control-Allow-Origin: *\r\n");
-	strcat(response, "Access-Control-Allow-Methods: *\r\n");
-	if (keepAlive) strcat(response, "Connection: keep-alive\r\n");
-	if (extraHeaders) {
-		strcat(response, extraHeaders);
-		if (10 != extraHeaders[strlen(extraHeaders) - 1]) {
-			strcat(response, "\r\n");
-		}
+	int keepAlive = (argCount > 3) ? (trueObj == args[3]) : c->clientKeepAlive;
+	if (!c->clientKeepAlive) keepAlive = false;
+	if (!keepAlive) c->closeWhenSent = true;
+
+	char head[300];
+	int headLength = snprintf(head, sizeof(head),
+		"HTTP/1.1 %s\r\n"
+		"Access-Control-Allow-Origin: *\r\n"
+		"Access-Control-Allow-Methods: *\r\n"
+		"Connection: %s\r\n",
+		status, keepAlive ? "keep-alive" : "close");
+	if (headLength >= (int) sizeof(head)) headLength = sizeof(head) - 1;
+
+	char tail[100];
+	int tailLength = 0;
+	if (extraLength && ('\n' != extraHeaders[extraLength - 1])) {
+		tailLength += sprintf(&tail[tailLength], "\r\n");
 	}
-	if (contentLength >= 0) {
-		char contentLenghtHeader[100];
-		sprintf(contentLenghtHeader, "Content-Length: %d", contentLength);
-		strcat(response, contentLenghtHeader);
+	if (chunked) {
+		tailLength += sprintf(&tail[tailLength], "\r\n");
+		if (contentLength > 0) tailLength += sprintf(&tail[tailLength], "%x\r\n", contentLength);
+	} else {
+		tailLength += sprintf(&tail[tailLength], "Content-Length: %d\r\n\r\n", (contentLength > 0) ? contentLength : 0);
 	}
-	strcat(response, "\r\n\r\n"); // end of headers
 
-	int byteCount = strlen(response);
-
-	// send body, if any
-	if (argCount > 1) {
-		if (IS_TYPE(args[1], StringType)) {
-			char *body = obj2str(args[1]);
-			strcat(response, body);
-			byteCount += strlen(body);
-		} else if (IS_TYPE(args[1], ByteArrayType)) {
-			uint8 *body = (uint8 *) &FIELD(args[1], 0);
-			memcpy(&response[strlen(response)], body, BYTES(args[1]));
-			byteCount += BYTES(args[1]);
-		}
+	struct iovec iov[5] = {
+		{ head, headLength },
+		{ extraHeaders, extraLength },
+		{ tail, tailLength },
+		{ body, (contentLength > 0) ? contentLength : 0 },
+		{ "\r\n", (chunked && (contentLength > 0)) ? 2 : 0 } };
+	if (!sendToConnection(c, iov, 5)) {
+		closeConnection(id);
+		return falseObj;
 	}
 
-	send(serverRequestSocket, response, byteCount, 0);
-
-	if (!keepAlive) {
-		close(serverRequestSocket);
-		serverRequestSocket = -1;
+	if (chunked) {
+		chunkedConnection = id; // response continues with httpServerSendChunk
+	} else {
+		finishResponse(id);
 	}
-
 	return falseObj;
 }
 
+static OBJ primHttpServerSendChunk(int argCount, OBJ *args) {
+	// Send a chunk of a chunked response. An empty chunk ends the response.
+
+	int id = chunkedConnection;
+	if ((id < 0) || !httpConnections[id] || (argCount < 1)) return falseObj;
+	HttpConnection *c = httpConnections[id];
+
+	uint8 *data;
+	int byteCount;
+	bodyOf(args[0], &data, &byteCount);
+	if (byteCount < 0) return falseObj;
+
+	char size[20];
+	struct iovec iov[3] = {
+		{ size, sprintf(size, "%x\r\n", byteCount) },
+		{ data, byteCount },
+		{ "\r\n", 2 } };
+	if (!sendToConnection(c, iov, 3)) {
+		closeConnection(id);
+		return falseObj;
+	}
+	if (0 == byteCount) finishResponse(id);
+	return trueObj;
+}
+
 // HTTP Client
 
 static int lookupHost(char *hostName, struct sockaddr_in *result) {
@@ -365,7 +693,10 @@ static OBJ primHttpConnect(int argCount, OBJ *args) {
 	char* host = obj2str(args[0]);
 	int port = ((argCount > 1) && isInt(args[1])) ? obj2int(args[1]) : 80;
 
-	if (clientSocket > -1) shutdown(clientSocket, 2);
+	if (clientSocket > -1) {
+		removeWakeupFD(clientSocket);
+		shutdown(clientSocket, 2);
+	}
 
 	struct sockaddr_in remoteAddress;
 
@@ -395,6 +726,7 @@ static OBJ primHttpConnect(int argCount, OBJ *args) {
 
 	int flag = 1;
 	setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (void *) &flag, sizeof(flag));
+	if (connectResult >= 0) addWakeupFD(clientSocket);
 
 	processMessage(); // process messages now
 	return falseObj;
@@ -447,6 +779,7 @@ static OBJ primHttpResponse(int argCount, OBJ *args) {
 	char buffer[800];
 	int n, byteCount = 0;
 
+	if (clientSocket > 0) addWakeupFD(clientSocket); // re-arm idle wakeups
 	while ((byteCount < (799 - 64)) && (n = (read(clientSocket, &buffer[byteCount], 64))) > 0) {
 		byteCount += n;
 		processMessage(); // process messages now
@@ -457,13 +790,1661 @@ static OBJ primHttpResponse(int argCount, OBJ *args) {
 	return response;
 }
 
+// Asynchronous HTTP Client
+
+// httpStartRequest starts a request and returns a handle without waiting for the server.
+// The script then polls httpRequestStatus and reads the response with httpRequestChunk
+// while other tasks keep running. httpEndRequest cancels the request or, once the response
+// has been read, frees its handle. A handle combines the request's slot with a generation
+// count, so a stale handle does not refer to a later request that reuses the slot.
+//
+// Each request is an HttpConnection with its own buffers and inactivity timeout. Requests
+// are serviced by netStep() from the VM loop, so they connect, send, and receive while the
+// script is busy. The sockets are in an epoll set that is registered as a wakeup FD. A
+// response that is not read fills the request buffer and is then left in the socket, so
+// a slow reader throttles the server.
+//
+// Requests use HTTP/1.0 with "Connection: close", like httpRequest, so the response ends
+// when the server closes the connection. Host name lookup is done synchronously.
+
+#define MAX_HTTP_REQUESTS 8
+#define HTTP_REQUEST_TIMEOUT 10000
+
+// request states (in order)
+#define HTTP_CONNECTING 0
+#define HTTP_SENDING 1
+#define HTTP_RECEIVING 2
+#define HTTP_DONE 3
+#define HTTP_TIMEOUT 4
+#define HTTP_ERROR 5
+
+static const char *httpStateNames[] = { "connecting", "sending", "receiving", "done", "timeout", "error" };
+
+typedef struct {
+	HttpConnection conn;	// conn.fd is -1 once the request has finished
+	int handle;				// slot index plus MAX_HTTP_REQUESTS times a generation count
+	int state;
+	int connected;
+	int received;			// true if any response bytes were received
+	uint32 timeout;
+} HttpRequest;
+
+static HttpRequest *httpRequests[MAX_HTTP_REQUESTS];
+static int httpRequestEpollFD = -1;
+static int httpRequestGeneration = 0;
+
+static void finishHttpRequest(HttpRequest *req, int state) {
+	// Close the socket. Received data remains available until the handle is freed.
+
+	if (req->conn.fd >= 0) {
+		epoll_ctl(httpRequestEpollFD, EPOLL_CTL_DEL, req->conn.fd, NULL);
+		close(req->conn.fd);
+		req->conn.fd = -1;
+	}
+	free(req->conn.out);
+	req->conn.out = NULL;
+	req->conn.outCount = req->conn.outSize = 0;
+	req->state = state;
+}
+
+static void freeHttpRequest(int slot) {
+	HttpRequest *req = httpRequests[slot];
+	if (!req) return;
+	finishHttpRequest(req, HTTP_DONE);
+	free(req);
+	httpRequests[slot] = NULL;
+}
+
+static void serviceHttpRequests() {
+	if (httpRequestEpollFD < 0) return;
+	addWakeupFD(httpRequestEpollFD); // re-arm idle wakeups
+
+	struct epoll_event events[MAX_HTTP_REQUESTS];
+	int n = epoll_wait(httpRequestEpollFD, events, MAX_HTTP_REQUESTS, 0);
+	for (int i = 0; i < n; i++) {
+		HttpRequest *req = httpRequests[events[i].data.u32];
+		if (!req || (req->conn.fd < 0)) continue;
+		if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) req->conn.readable = true;
+		if (events[i].events & EPOLLOUT) {
+			req->conn.writable = true;
+			if (!(events[i].events & EPOLLERR)) req->connected = true;
+		}
+	}
+
+	uint32 now = millisecs();
+	for (int i = 0; i < MAX_HTTP_REQUESTS; i++) {
+		HttpRequest *req = httpRequests[i];
+		if (!req || (req->state >= HTTP_DONE)) continue;
+		HttpConnection *c = &req->conn;
+
+		if (c->readable) {
+			int oldCount = c->inCount;
+			readConnection(c);
+			if (c->inCount > oldCount) req->received = true;
+		}
+		if (c->writable && !flushConnection(c)) {
+			finishHttpRequest(req, HTTP_ERROR);
+			continue;
+		}
+		if (req->connected) req->state = (c->outCount > 0) ? HTTP_SENDING : HTTP_RECEIVING;
+		if (c->peerClosed) {
+			// the server closes the connection at the end of the response
+			finishHttpRequest(req, req->received ? HTTP_DONE : HTTP_ERROR);
+		} else if ((c->inCount < HTTP_REQUEST_BUFFER_SIZE) && ((now - c->lastActivity) > req->timeout)) {
+			finishHttpRequest(req, HTTP_TIMEOUT); // (a full buffer is waiting for the script)
+		}
+	}
+}
+
+static HttpRequest * requestForHandle(OBJ handle) {
+	if (!isInt(handle) || (obj2int(handle) < 0)) return NULL;
+	HttpRequest *req = httpRequests[obj2int(handle) % MAX_HTTP_REQUESTS];
+	return (req && (req->handle == obj2int(handle))) ? req : NULL;
+}
+
+static OBJ primHttpStartRequest(int argCount, OBJ *args) {
+	// Start an HTTP request and return its handle, or -1 if the request could not be
+	// started. Arguments: method, host, path, and optional body, port, extra headers,
+	// and inactivity timeout in milliseconds.
+
+	if (argCount < 3) return fail(notEnoughArguments);
+	if (!IS_TYPE(args[0], StringType) || !IS_TYPE(args[1], StringType) || !IS_TYPE(args[2], StringType)) {
+		return fail(needsStringError);
+	}
+	char *method = obj2str(args[0]);
+	char *host = obj2str(args[1]);
+	char *path = obj2str(args[2]);
+	uint8 *body = NULL;
+	int bodyLength = -1;
+	if (argCount > 3) bodyOf(args[3], &body, &bodyLength);
+	int port = ((argCount > 4) && isInt(args[4])) ? obj2int(args[4]) : 80;
+	char *extraHeaders = ((argCount > 5) && IS_TYPE(args[5], StringType)) ? obj2str(args[5]) : "";
+	int timeout = ((argCount > 6) && isInt(args[6])) ? obj2int(args[6]) : HTTP_REQUEST_TIMEOUT;
+	if (timeout <= 0) timeout = HTTP_REQUEST_TIMEOUT;
+	if (bodyLength == 0) bodyLength = -1; // an empty body is no body
+
+	// find a free slot, reusing one whose response has been completely read if necessary
+	int slot = -1;
+	for (int i = 0; (slot < 0) && (i < MAX_HTTP_REQUESTS); i++) {
+		if (!httpRequests[i]) slot = i;
+	}
+	for (int i = 0; (slot < 0) && (i < MAX_HTTP_REQUESTS); i++) {
+		if ((httpRequests[i]->state >= HTTP_DONE) && (0 == httpRequests[i]->conn.inCount)) {
+			freeHttpRequest(i);
+			slot = i;
+		}
+	}
+	if (slot < 0) return int2obj(-1);
+
+	if (httpRequestEpollFD < 0) {
+		httpRequestEpollFD = epoll_create1(EPOLL_CLOEXEC);
+		if (httpRequestEpollFD < 0) return int2obj(-1);
+		addWakeupFD(httpRequestEpollFD);
+	}
+
+	struct sockaddr_in remoteAddress;
+	memset(&remoteAddress, 0, sizeof(remoteAddress));
+	if (lookupHost(host, &remoteAddress) != 0) return int2obj(-1);
+	remoteAddress.sin_port = htons(port);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return int2obj(-1);
+	setNonBlocking(fd);
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &flag, sizeof(flag));
+	if ((connect(fd, (struct sockaddr *) &remoteAddress, sizeof(remoteAddress)) < 0) && (EINPROGRESS != errno)) {
+		close(fd);
+		return int2obj(-1);
+	}
+
+	HttpRequest *req = calloc(1, sizeof(HttpRequest));
+	if (!req) {
+		close(fd);
+		return int2obj(-1);
+	}
+	req->conn.fd = fd;
+	req->conn.lastActivity = millisecs();
+	req->handle = slot + (MAX_HTTP_REQUESTS * httpRequestGeneration);
+	httpRequestGeneration = (httpRequestGeneration + 1) & 0xFFFF;
+	req->timeout = timeout;
+	req->state = HTTP_CONNECTING;
+	httpRequests[slot] = req;
+
+	// queue the request; it is sent once the connection is established
+	char head[1024];
+	int headLength = snprintf(head, sizeof(head),
+		"%s %s%s HTTP/1.0\r\n"
+		"Host: %s\r\n"
+		"Connection: close\r\n"
+		"User-Agent: MicroBlocks\r\n"
+		"Accept: */*\r\n",
+		method, ('/' == path[0]) ? "" : "/", path, host);
+	if (headLength >= (int) sizeof(head)) headLength = sizeof(head) - 1;
+	int extraLength = strlen(extraHeaders);
+	char tail[100];
+	int tailLength = 0;
+	if (extraLength && ('\n' != extraHeaders[extraLength - 1])) {
+		tailLength += sprintf(&tail[tailLength], "\r\n");
+	}
+	if (bodyLength > 0) {
+		if (!containsIgnoringCase(extraHeaders, "Content-Type:")) {
+			tailLength += sprintf(&tail[tailLength], "Content-Type: text/plain\r\n");
+		}
+		tailLength += sprintf(&tail[tailLength], "Content-Length: %d\r\n", bodyLength);
+	}
+	tailLength += sprintf(&tail[tailLength], "\r\n");
+	struct iovec iov[4] = {
+		{ head, headLength },
+		{ extraHeaders, extraLength },
+		{ tail, tailLength },
+		{ body, (bodyLength > 0) ? bodyLength : 0 } };
+	if (!sendToConnection(&req->conn, iov, 4)) {
+		freeHttpRequest(slot);
+		return int2obj(-1);
+	}
+
+	struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.u32 = slot };
+	epoll_ctl(httpRequestEpollFD, EPOLL_CTL_ADD, fd, &event);
+	return int2obj(req->handle);
+}
+
+static OBJ primHttpRequestStatus(int argCount, OBJ *args) {
+	// Return the state of the given request: connecting, sending, receiving, done,
+	// timeout, or error. Return the empty string if the handle is not valid.
+
+	if (argCount < 1) return fail(notEnoughArguments);
+	serviceHttpRequests();
+	HttpRequest *req = requestForHandle(args[0]);
+	const char *state = req ? httpStateNames[req->state] : "";
+	return newStringFromBytes(state, strlen(state));
+}
+
+static OBJ primHttpRequestChunk(int argCount, OBJ *args) {
+	// Return the next part of the response to the given request, or the empty string if
+	// no data is available. If the optional second argument is true, return a ByteArray.
+
+	if (argCount < 1) return fail(notEnoughArguments);
+	int useBinary = ((argCount > 1) && (trueObj == args[1]));
+	serviceHttpRequests();
+	HttpRequest *req = requestForHandle(args[0]);
+	int byteCount = req ? req->conn.inCount : 0;
+
+	OBJ result;
+	if (useBinary) {
+		result = newObj(ByteArrayType, (byteCount + 3) / 4, falseObj);
+		if (result) setByteCountAdjust(result, byteCount);
+	} else {
+		result = newString(byteCount);
+	}
+	if (!result) return fail(insufficientMemoryError);
+	if (byteCount) {
+		memcpy(&FIELD(result, 0), req->conn.in, byteCount);
+		req->conn.inCount = 0;
+	}
+	return result;
+}
+
+static OBJ primHttpEndRequest(int argCount, OBJ *args) {
+	// Cancel the given request if it is still in progress and free its handle.
+
+	if (argCount < 1) return fail(notEnoughArguments);
+	if (requestForHandle(args[0])) freeHttpRequest(obj2int(args[0]) % MAX_HTTP_REQUESTS);
+	return falseObj;
+}
+
+// UDP
+
+// Incoming datagrams are read in batches with recvmmsg() into a queue of packet buffers,
+// so a burst of packets costs a single system call. The queue size can be set when UDP
+// is started. Passing a list of packets to udpSendPacket sends them all with sendmmsg().
+
+#define UDP_MAX_PACKET 2048
+#define UDP_DEFAULT_QUEUE 64
+#define UDP_MAX_QUEUE 1024
+#define UDP_SEND_BATCH 64
+
+static int udpSocket = -1;
+static int udpQueueSize = 0;
+static uint8 *udpBuffers = NULL;			// udpQueueSize buffers of UDP_MAX_PACKET bytes
+static struct mmsghdr *udpMessages = NULL;
+static struct iovec *udpIOVecs = NULL;
+static struct sockaddr_in *udpSenders = NULL;
+static int udpReceivedCount = 0;			// number of packets in the queue
+static int udpNextPacket = 0;				// index of the next packet to return
+static struct sockaddr_in udpRemoteAddress;	// sender of the last packet returned
+
+static void freeUDPQueue() {
+	free(udpBuffers);
+	free(udpMessages);
+	free(udpIOVecs);
+	free(udpSenders);
+	udpBuffers = NULL;
+	udpMessages = NULL;
+	udpIOVecs = NULL;
+	udpSenders = NULL;
+	udpQueueSize = udpReceivedCount = udpNextPacket = 0;
+}
+
+static int allocateUDPQueue(int packetCount) {
+	udpBuffers = malloc(packetCount * UDP_MAX_PACKET);
+	udpMessages = calloc(packetCount, sizeof(struct mmsghdr));
+	udpIOVecs = calloc(packetCount, sizeof(struct iovec));
+	udpSenders = calloc(packetCount, sizeof(struct sockaddr_in));
+	if (!udpBuffers || !udpMessages || !udpIOVecs || !udpSenders) {
+		freeUDPQueue();
+		return false;
+	}
+	for (int i = 0; i < packetCount; i++) {
+		udpIOVecs[i].iov_base = &udpBuffers[i * UDP_MAX_PACKET];
+		udpIOVecs[i].iov_len = UDP_MAX_PACKET;
+		udpMessages[i].msg_hdr.msg_iov = &udpIOVecs[i];
+		udpMessages[i].msg_hdr.msg_iovlen = 1;
+		udpMessages[i].msg_hdr.msg_name = &udpSenders[i];
+	}
+	udpQueueSize = packetCount;
+	return true;
+}
+
+static void closeUDPSocket() {
+	if (udpSocket >= 0) {
+		if (udpQueueSize) removeWakeupFD(udpSocket);
+		close(udpSocket);
+		udpSocket = -1;
+	}
+	freeUDPQueue();
+}
+
+static int openUDPSocket() {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) return -1;
+	setNonBlocking(fd);
+	int flag = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *) &flag, sizeof(flag));
+	setsockopt(fd, SOL_SOCKET, SO_BROADCAST, (void *) &flag, sizeof(flag));
+	return fd;
+}
+
+static OBJ primUDPStart(int argCount, OBJ *args) {
+	// Start receiving UDP packets on the given port. The optional second argument sets
+	// the number of received packets that can be queued.
+
+	if (argCount < 1) return fail(notEnoughArguments);
+	int port = evalInt(args[0]);
+	int queueSize = ((argCount > 1) && isInt(args[1])) ? obj2int(args[1]) : UDP_DEFAULT_QUEUE;
+	if (queueSize < 1) queueSize = 1;
+	if (queueSize > UDP_MAX_QUEUE) queueSize = UDP_MAX_QUEUE;
+	if (port <= 0) return falseObj;
+
+	closeUDPSocket();
+	udpSocket = openUDPSocket();
+	if (udpSocket < 0) return falseObj;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if ((bind(udpSocket, (struct sockaddr *) &addr, sizeof(addr)) < 0) || !allocateUDPQueue(queueSize)) {
+		closeUDPSocket();
+		return falseObj;
+	}
+	addWakeupFD(udpSocket);
+	return falseObj;
+}
+
+static OBJ primUDPStop(int argCount, OBJ *args) {
+	closeUDPSocket();
+	return falseObj;
+}
+
+static void packetData(OBJ packet, char *numberBuffer, struct iovec *iov) {
+	// Set iov to the contents of the given packet: a string, byte array, integer, or boolean.
+
+	iov->iov_base = numberBuffer;
+	iov->iov_len = 0;
+	if (isInt(packet)) {
+		iov->iov_len = sprintf(numberBuffer, "%d", obj2int(packet));
+	} else if (isBoolean(packet)) {
+		iov->iov_len = sprintf(numberBuffer, "%s", (trueObj == packet) ? "true" : "false");
+	} else if (StringType == TYPE(packet)) {
+		iov->iov_base = obj2str(packet);
+		iov->iov_len = strlen(obj2str(packet));
+	} else if (ByteArrayType == TYPE(packet)) {
+		iov->iov_base = &FIELD(packet, 0);
+		iov->iov_len = BYTES(packet);
+	}
+}
+
+static OBJ primUDPSendPacket(int argCount, OBJ *args) {
+	// Send a packet to the given IP address and port. If the first argument is a list,
+	// send each item of the list as a separate packet.
+
+	if (argCount < 3) return fail(notEnoughArguments);
+	OBJ data = args[0];
+	if (!IS_TYPE(args[1], StringType)) return fail(needsStringError);
+	int port = evalInt(args[2]);
+	if (port <= 0) return falseObj; // bad port number
+
+	struct sockaddr_in remoteAddress;
+	memset(&remoteAddress, 0, sizeof(remoteAddress));
+	remoteAddress.sin_family = AF_INET;
+	if (!inet_aton(obj2str(args[1]), &remoteAddress.sin_addr) &&
+		(lookupHost(obj2str(args[1]), &remoteAddress) != 0)) {
+			return falseObj; // unknown host
+	}
+	remoteAddress.sin_port = htons(port);
+
+	if (udpSocket < 0) udpSocket = openUDPSocket(); // sending only; not yet started
+	if (udpSocket < 0) return falseObj;
+
+	int isList = IS_TYPE(data, ListType);
+	int packetCount = isList ? obj2int(FIELD(data, 0)) : 1;
+	struct mmsghdr msgs[UDP_SEND_BATCH];
+	struct iovec iov[UDP_SEND_BATCH];
+	char numbers[UDP_SEND_BATCH][16];
+	memset(msgs, 0, sizeof(msgs));
+
+	for (int first = 0; first < packetCount; first += UDP_SEND_BATCH) {
+		int batchCount = packetCount - first;
+		if (batchCount > UDP_SEND_BATCH) batchCount = UDP_SEND_BATCH;
+		for (int i = 0; i < batchCount; i++) {
+			packetData(isList ? FIELD(data, first + i + 1) : data, numbers[i], &iov[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &remoteAddress;
+			msgs[i].msg_hdr.msg_namelen = sizeof(remoteAddress);
+		}
+		int sent = 0;
+		while (sent < batchCount) {
+			int n = sendmmsg(udpSocket, &msgs[sent], batchCount - sent, 0);
+			if (n <= 0) break; // socket buffer full or error; drop the remaining packets
+			sent += n;
+		}
+	}
+	return falseObj;
+}
+
+static OBJ primUDPReceivePacket(int argCount, OBJ *args) {
+	// Return the next received packet or the empty string if there are none. If the
+	// optional argument is true, return the packet as a ByteArray. Packets longer than
+	// UDP_MAX_PACKET bytes are truncated.
+
+	int useBinary = ((argCount > 0) && (trueObj == args[0]));
+	if (!udpQueueSize) return newString(0);
+	addWakeupFD(udpSocket); // re-arm idle wakeups
+
+	if (udpNextPacket >= udpReceivedCount) { // queue is empty; refill it
+		for (int i = 0; i < udpQueueSize; i++) {
+			udpMessages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		}
+		int n = recvmmsg(udpSocket, udpMessages, udpQueueSize, MSG_DONTWAIT, NULL);
+		udpReceivedCount = (n > 0) ? n : 0;
+		udpNextPacket = 0;
+		if (!udpReceivedCount) return newString(0);
+	}
+
+	int i = udpNextPacket++;
+	int byteCount = udpMessages[i].msg_len;
+	udpRemoteAddress = udpSenders[i];
+
+	OBJ result = falseObj;
+	if (useBinary) {
+		result = newObj(ByteArrayType, (byteCount + 3) / 4, falseObj);
+		if (result) setByteCountAdjust(result, byteCount);
+	} else {
+		result = newString(byteCount);
+	}
+	if (!result) return newString(0); // allocation failed; packet is discarded
+	memcpy(&FIELD(result, 0), udpIOVecs[i].iov_base, byteCount);
+	return result;
+}
+
+static OBJ primUDPRemoteIPAddress(int argCount, OBJ *args) {
+	char *s = inet_ntoa(udpRemoteAddress.sin_addr);
+	return newStringFromBytes(s, strlen(s));
+}
+
+static OBJ primUDPRemotePort(int argCount, OBJ *args) {
+	return int2obj(ntohs(udpRemoteAddress.sin_port));
+}
+
+// WebSocket
+
+// A native RFC 6455 implementation supporting both a server (on port 81 by default, like
+// the ESP32) and outgoing client connections. Server and client connections share one
+// table, and a connection's index in that table is its client ID. Each connection is an
+// HttpConnection, so it uses the same input buffering and output queueing as the HTTP
+// server. The connections are in a separate epoll set that is also registered as a
+// wakeup FD.
+//
+// The VM loop calls netStep(), which accepts connections, reads input, sends queued
+// output, and pings quiet connections, so a script that only sends keeps its output
+// flowing. Events are reported by webSocketLastEvent as lists of [type, clientID, payload],
+// using the same type numbers as the ESP32 library. Frames are decoded only when the script
+// asks for an event, so unread data stays in the socket buffer and throttles the sender.
+// Fragmented messages are reassembled and reported as a single text or binary message.
+// Pings are answered automatically and quiet connections are pinged periodically.
+
+#define MAX_WEBSOCKETS 32
+#define WEBSOCKET_MAX_MESSAGE (1024 * 1024)
+#define WEBSOCKET_PING_MSECS 20000
+#define WEBSOCKET_LISTENER MAX_WEBSOCKETS // epoll data for the server socket
+
+// event types (as defined by the ESP32 WebSockets library)
+#define WS_ERROR 0
+#define WS_DISCONNECTED 1
+#define WS_CONNECTED 2
+#define WS_TEXT 3
+#define WS_BINARY 4
+#define WS_PING 9
+#define WS_PONG 10
+
+// close status codes
+#define WS_NORMAL_CLOSURE 1000
+#define WS_PROTOCOL_ERROR 1002
+#define WS_MESSAGE_TOO_BIG 1009
+
+typedef struct {
+	HttpConnection conn;	// socket and buffers; conn.fd is -1 once the socket is closed
+	int isClient;			// this end opened the connection (so it masks its frames)
+	int open;				// opening handshake completed
+	int connectReported;
+	int closeSent;
+	char acceptKey[32];		// client: expected Sec-WebSocket-Accept value
+	uint32 lastReceived;
+	uint32 lastPing;
+
+	// frame payload being received
+	int frameRemaining;
+	int frameFin;
+	int masked;
+	uint8 mask[4];
+	int maskOffset;
+
+	// data message being assembled
+	int msgOpcode;			// 0 if no message is in progress
+	uint8 *msg;
+	int msgCount;
+	int msgSize;
+
+	// event waiting to be reported
+	int eventType;			// -1 if none
+	uint8 *eventData;
+	int eventCount;
+	uint8 control[125];		// payload of the last control frame
+} WebSocket;
+
+static WebSocket *webSockets[MAX_WEBSOCKETS];
+static int webSocketServer = -1;
+static int webSocketEpollFD = -1;
+static int nextWebSocket = 0;	// round-robin index for reporting events
+
+// SHA-1 and Base64 (for the opening handshake)
+
+static uint32 rotl(uint32 x, int n) { return (x << n) | (x >> (32 - n)); }
+
+static void sha1(const uint8 *data, int byteCount, uint8 *digest) {
+	uint32 h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	uint8 block[64];
+	int paddedCount = ((byteCount + 8) / 64 + 1) * 64;
+
+	for (int offset = 0; offset < paddedCount; offset += 64) {
+		for (int i = 0; i < 64; i++) {
+			int j = offset + i;
+			if (j < byteCount) block[i] = data[j];
+			else if (j == byteCount) block[i] = 0x80;
+			else if (j >= (paddedCount - 4)) block[i] = ((uint32) byteCount * 8) >> (8 * (paddedCount - 1 - j));
+			else block[i] = 0;
+		}
+		uint32 w[80];
+		for (int i = 0; i < 16; i++) {
+			w[i] = (block[4 * i] << 24) | (block[4 * i + 1] << 16) | (block[4 * i + 2] << 8) | block[4 * i + 3];
+		}
+		for (int i = 16; i < 80; i++) w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+		uint32 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; i++) {
+			uint32 f, k;
+			if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+			else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+			else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+			else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+			uint32 t = rotl(a, 5) + f + e + k + w[i];
+			e = d; d = c; c = rotl(b, 30); b = a; a = t;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+	}
+	for (int i = 0; i < 20; i++) digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static void base64Encode(const uint8 *src, int byteCount, char *dst) {
+	// Write the Base64 encoding of src to dst, followed by a null terminator.
+	const char *digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	for (int i = 0; i < byteCount; i += 3) {
+		uint32 n = (src[i] << 16) | (((i + 1) < byteCount) ? (src[i + 1] << 8) : 0) | (((i + 2) < byteCount) ? src[i + 2] : 0);
+		*dst++ = digits[(n >> 18) & 63];
+		*dst++ = digits[(n >> 12) & 63];
+		*dst++ = ((i + 1) < byteCount) ? digits[(n >> 6) & 63] : '=';
+		*dst++ = ((i + 2) < byteCount) ? digits[n & 63] : '=';
+	}
+	*dst = 0;
+}
+
+static void webSocketAcceptKey(const char *key, int keyLength, char *result) {
+	// Compute the Sec-WebSocket-Accept value for the given Sec-WebSocket-Key.
+	const char *guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	uint8 buf[100];
+	uint8 digest[20];
+	if (keyLength > 60) keyLength = 60;
+	memcpy(buf, key, keyLength);
+	memcpy(&buf[keyLength], guid, 36);
+	sha1(buf, keyLength + 36, digest);
+	base64Encode(digest, 20, result);
+}
+
+static void randomBytes(uint8 *buf, int byteCount) {
+	static int urandom = -2;
+	if (-2 == urandom) urandom = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if ((urandom >= 0) && (read(urandom, buf, byteCount) == byteCount)) return;
+	for (int i = 0; i < byteCount; i++) buf[i] = rand();
+}
+
+static int headerValueIs(HttpConnection *c, int headerBytes, const char *name, const char *value) {
+	// Return true if the given header contains the given value (case-insensitive).
+	char *s = findHeader(c, headerBytes, name);
+	if (!s) return false;
+	int len = strlen(value);
+	for ( ; ('\r' != *s) && ('\n' != *s); s++) {
+		if (0 == strncasecmp(s, value, len)) return true;
+	}
+	return false;
+}
+
+static int headerValueLength(char *value) {
+	int len = 0;
+	while (value[len] && ('\r' != value[len]) && ('\n' != value[len])) len++;
+	while ((len > 0) && (' ' == value[len - 1])) len--;
+	return len;
+}
+
+// Connections
+
+static int initWebSocketPoll() {
+	if (webSocketEpollFD < 0) {
+		webSocketEpollFD = epoll_create1(EPOLL_CLOEXEC);
+		if (webSocketEpollFD >= 0) addWakeupFD(webSocketEpollFD);
+	}
+	return (webSocketEpollFD >= 0);
+}
+
+static int addWebSocket(int fd, int isClient) {
+	// Add a connection for the given socket and return its index, or -1 if failed.
+
+	int i = 0;
+	while ((i < MAX_WEBSOCKETS) && webSockets[i]) i++;
+	WebSocket *ws = (i < MAX_WEBSOCKETS) ? calloc(1, sizeof(WebSocket)) : NULL;
+	if (!ws) return -1;
+
+	setNonBlocking(fd);
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &flag, sizeof(flag));
+
+	ws->conn.fd = fd;
+	ws->conn.readable = true;
+	ws->conn.writable = !isClient; // a client socket is writable once connected
+	ws->isClient = isClient;
+	ws->eventType = -1;
+	ws->lastReceived = ws->lastPing = millisecs();
+	webSockets[i] = ws;
+	struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.u32 = i };
+	epoll_ctl(webSocketEpollFD, EPOLL_CTL_ADD, fd, &event);
+	return i;
+}
+
+static void closeWebSocketSocket(WebSocket *ws) {
+	// Close the socket but keep the entry until its disconnect event has been reported.
+
+	if (ws->conn.fd < 0) return;
+	epoll_ctl(webSocketEpollFD, EPOLL_CTL_DEL, ws->conn.fd, NULL);
+	close(ws->conn.fd);
+	ws->conn.fd = -1;
+	free(ws->conn.out);
+	ws->conn.out = NULL;
+	ws->conn.outCount = ws->conn.outSize = 0;
+}
+
+static void freeWebSocket(int i) {
+	WebSocket *ws = webSockets[i];
+	if (!ws) return;
+	closeWebSocketSocket(ws);
+	free(ws->msg);
+	free(ws);
+	webSockets[i] = NULL;
+}
+
+static int sendFrame(WebSocket *ws, int opcode, uint8 *data, int byteCount) {
+	// Send a single, final frame. Client frames are masked. Return false if failed.
+
+	if ((ws->conn.fd < 0) || ws->closeSent) return false;
+
+	uint8 header[14];
+	int headerBytes = 2;
+	header[0] = 0x80 | opcode;
+	if (byteCount < 126) {
+		header[1] = byteCount;
+	} else if (byteCount < 65536) {
+		header[1] = 126;
+		header[2] = byteCount >> 8;
+		header[3] = byteCount;
+		headerBytes = 4;
+	} else {
+		header[1] = 127;
+		memset(&header[2], 0, 4);
+		for (int i = 0; i < 4; i++) header[6 + i] = byteCount >> (24 - 8 * i);
+		headerBytes = 10;
+	}
+
+	uint8 *payload = data;
+	if (ws->isClient) {
+		header[1] |= 0x80;
+		uint8 *mask = &header[headerBytes];
+		randomBytes(mask, 4);
+		headerBytes += 4;
+		payload = malloc(byteCount ? byteCount : 1);
+		if (!payload) return false;
+		for (int i = 0; i < byteCount; i++) payload[i] = data[i] ^ mask[i & 3];
+	}
+
+	struct iovec iov[2] = { { header, headerBytes }, { payload, byteCount } };
+	int ok = sendToConnection(&ws->conn, iov, 2);
+	if (payload != data) free(payload);
+	if (!ok) closeWebSocketSocket(ws);
+	if (8 == opcode) ws->closeSent = true;
+	return ok;
+}
+
+static void closeWebSocket(WebSocket *ws, int statusCode) {
+	// Start the closing handshake. The socket is closed once the close frame is sent.
+
+	uint8 status[2] = { statusCode >> 8, statusCode & 255 };
+	if (ws->open) sendFrame(ws, 8, status, 2);
+	ws->conn.closeWhenSent = true;
+}
+
+static void consumeInput(HttpConnection *c, int byteCount) {
+	memmove(c->in, &c->in[byteCount], c->inCount - byteCount);
+	c->inCount -= byteCount;
+}
+
+// Opening Handshake
+
+static void sendClientHandshake(WebSocket *ws, char *host, int port, char *path) {
+	uint8 nonce[16];
+	char key[32];
+	randomBytes(nonce, 16);
+	base64Encode(nonce, 16, key);
+	webSocketAcceptKey(key, strlen(key), ws->acceptKey);
+
+	char request[600];
+	int byteCount = snprintf(request, sizeof(request),
+		"GET %s HTTP/1.1\r\n"
+		"Host: %s:%d\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: %s\r\n"
+		"Sec-WebSocket-Version: 13\r\n\r\n",
+		path, host, port, key);
+	if (byteCount >= (int) sizeof(request)) byteCount = sizeof(request) - 1;
+	struct iovec iov[1] = { { request, byteCount } };
+	if (!sendToConnection(&ws->conn, iov, 1)) closeWebSocketSocket(ws);
+}
+
+static void processHandshake(WebSocket *ws) {
+	// Process the opening handshake request (server) or response (client) once its
+	// headers have arrived.
+
+	HttpConnection *c = &ws->conn;
+	int headerBytes = headerLength(c);
+	if (headerBytes < 0) {
+		if (c->inCount == HTTP_REQUEST_BUFFER_SIZE) closeWebSocketSocket(ws); // headers too large
+		return;
+	}
+
+	if (ws->isClient) {
+		char *accept = findHeader(c, headerBytes, "Sec-WebSocket-Accept:");
+		int ok = (0 == strncmp((char *) c->in, "HTTP/1.1 101", 12)) && accept &&
+			(headerValueLength(accept) == (int) strlen(ws->acceptKey)) &&
+			(0 == strncmp(accept, ws->acceptKey, strlen(ws->acceptKey)));
+		if (!ok) {
+			closeWebSocketSocket(ws);
+			return;
+		}
+	} else {
+		char *key = findHeader(c, headerBytes, "Sec-WebSocket-Key:");
+		if (!key || !headerValueIs(c, headerBytes, "Upgrade:", "websocket")) {
+			char *reply = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+			struct iovec iov[1] = { { reply, strlen(reply) } };
+			sendToConnection(c, iov, 1);
+			c->closeWhenSent = true;
+			consumeInput(c, headerBytes);
+			return;
+		}
+		char accept[32];
+		webSocketAcceptKey(key, headerValueLength(key), accept);
+		char reply[200];
+		int byteCount = sprintf(reply,
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+		struct iovec iov[1] = { { reply, byteCount } };
+		if (!sendToConnection(c, iov, 1)) {
+			closeWebSocketSocket(ws);
+			return;
+		}
+	}
+	consumeInput(c, headerBytes);
+	ws->open = true;
+}
+
+// Frames
+
+static void readFrames(WebSocket *ws) {
+	// Decode received frames until there is an event to report or no complete frame.
+
+	HttpConnection *c = &ws->conn;
+	while ((ws->eventType < 0) && !c->closeWhenSent) {
+		uint8 *in = c->in;
+
+		if (ws->frameRemaining > 0) { // receiving the payload of a data frame
+			int n = (c->inCount < ws->frameRemaining) ? c->inCount : ws->frameRemaining;
+			if (0 == n) return;
+			uint8 *dst = &ws->msg[ws->msgCount];
+			for (int i = 0; i < n; i++) {
+				dst[i] = ws->masked ? (in[i] ^ ws->mask[(ws->maskOffset + i) & 3]) : in[i];
+			}
+			ws->maskOffset += n;
+			ws->msgCount += n;
+			ws->frameRemaining -= n;
+			consumeInput(c, n);
+		} else {
+			// decode the frame header
+			if (c->inCount < 2) return;
+			int fin = in[0] & 0x80;
+			int opcode = in[0] & 0x0F;
+			int masked = in[1] & 0x80;
+			uint32 length = in[1] & 0x7F;
+			int headerBytes = 2;
+			if (126 == length) {
+				if (c->inCount < 4) return;
+				length = (in[2] << 8) | in[3];
+				headerBytes = 4;
+			} else if (127 == length) {
+				if (c->inCount < 10) return;
+				if (in[2] | in[3] | in[4] | in[5] | (in[6] & 0x80)) {
+					closeWebSocket(ws, WS_MESSAGE_TOO_BIG);
+					return;
+				}
+				length = (in[6] << 24) | (in[7] << 16) | (in[8] << 8) | in[9];
+				headerBytes = 10;
+			}
+			if (masked) {
+				if (c->inCount < (headerBytes + 4)) return;
+				memcpy(ws->mask, &in[headerBytes], 4);
+				headerBytes += 4;
+			}
+			// reserved bits must be zero; only client frames are masked
+			if ((in[0] & 0x70) || ((0 != masked) == (0 != ws->isClient))) {
+				closeWebSocket(ws, WS_PROTOCOL_ERROR);
+				return;
+			}
+
+			if (opcode & 8) { // control frame
+				if (!fin || (length > 125)) {
+					closeWebSocket(ws, WS_PROTOCOL_ERROR);
+					return;
+				}
+				if (c->inCount < (int) (headerBytes + length)) return;
+				for (int i = 0; i < (int) length; i++) {
+					ws->control[i] = masked ? (in[headerBytes + i] ^ ws->mask[i & 3]) : in[headerBytes + i];
+				}
+				consumeInput(c, headerBytes + length);
+				if (8 == opcode) { // close: echo the status code, then close
+					int statusBytes = (length >= 2) ? 2 : 0;
+					if (!ws->closeSent) sendFrame(ws, 8, ws->control, statusBytes);
+					c->closeWhenSent = true;
+				} else if (9 == opcode) { // ping
+					sendFrame(ws, 10, ws->control, length);
+					ws->eventType = WS_PING;
+				} else if (10 == opcode) { // pong
+					ws->eventType = WS_PONG;
+				} else {
+					closeWebSocket(ws, WS_PROTOCOL_ERROR);
+					return;
+				}
+				ws->eventData = ws->control;
+				ws->eventCount = length;
+				continue;
+			}
+
+			// data frame: text (1), binary (2), or the continuation (0) of a fragmented message
+			if (((0 == opcode) != (0 != ws->msgOpcode)) || (opcode > 2)) {
+				closeWebSocket(ws, WS_PROTOCOL_ERROR);
+				return;
+			}
+			if ((ws->msgCount + length) > WEBSOCKET_MAX_MESSAGE) {
+				closeWebSocket(ws, WS_MESSAGE_TOO_BIG);
+				return;
+			}
+			if ((int) (ws->msgCount + length) > ws->msgSize) {
+				uint8 *msg = realloc(ws->msg, ws->msgCount + length);
+				if (!msg) return; // try again later
+				ws->msg = msg;
+				ws->msgSize = ws->msgCount + length;
+			}
+			if (opcode) ws->msgOpcode = opcode;
+			ws->masked = masked;
+			ws->maskOffset = 0;
+			ws->frameFin = fin;
+			ws->frameRemaining = length;
+			consumeInput(c, headerBytes);
+		}
+		if ((0 == ws->frameRemaining) && ws->frameFin) { // message complete
+			ws->eventType = (1 == ws->msgOpcode) ? WS_TEXT : WS_BINARY;
+			ws->eventData = ws->msg;
+			ws->eventCount = ws->msgCount;
+			ws->frameFin = false;
+		}
+	}
+}
+
+static int nextWebSocketEvent(WebSocket *ws) {
+	// Return the type of the next event for the given connection, or -1 if none.
+
+	if (ws->eventType >= 0) return ws->eventType;
+	if (ws->open && !ws->connectReported) return WS_CONNECTED;
+	if (ws->open && (ws->conn.fd >= 0)) readFrames(ws);
+	if (ws->eventType >= 0) return ws->eventType;
+
+	if ((ws->conn.fd >= 0) && ws->conn.peerClosed && !ws->conn.readable) closeWebSocketSocket(ws);
+	if (ws->conn.fd < 0) {
+		if (ws->connectReported) return WS_DISCONNECTED;
+		if (ws->isClient) return WS_ERROR; // could not connect
+	}
+	return -1;
+}
+
+static void serviceWebSockets() {
+	if (webSocketEpollFD < 0) return;
+	addWakeupFD(webSocketEpollFD); // re-arm idle wakeups
+
+	struct epoll_event events[32];
+	int n;
+	while ((n = epoll_wait(webSocketEpollFD, events, 32, 0)) > 0) {
+		for (int i = 0; i < n; i++) {
+			int id = events[i].data.u32;
+			if (WEBSOCKET_LISTENER == id) {
+				int fd;
+				while ((fd = accept(webSocketServer, NULL, NULL)) >= 0) {
+					if (addWebSocket(fd, false) < 0) close(fd);
+				}
+			} else if ((id < MAX_WEBSOCKETS) && webSockets[id] && (webSockets[id]->conn.fd >= 0)) {
+				if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) webSockets[id]->conn.readable = true;
+				if (events[i].events & EPOLLOUT) webSockets[id]->conn.writable = true;
+			}
+		}
+		if (n < 32) break;
+	}
+
+	uint32 now = millisecs();
+	for (int i = 0; i < MAX_WEBSOCKETS; i++) {
+		WebSocket *ws = webSockets[i];
+		if (!ws) continue;
+		if (ws->conn.fd < 0) {
+			// free a failed incoming connection; others are freed once their event is reported
+			if (!ws->isClient && !ws->connectReported) freeWebSocket(i);
+			continue;
+		}
+		HttpConnection *c = &ws->conn;
+
+		int oldCount = c->inCount;
+		if (c->readable) readConnection(c);
+		if (c->inCount != oldCount) ws->lastReceived = now;
+		if (c->writable && !flushConnection(c)) {
+			closeWebSocketSocket(ws);
+			continue;
+		}
+		if (c->closeWhenSent && (0 == c->outCount)) {
+			closeWebSocketSocket(ws);
+			continue;
+		}
+		if (!ws->open) {
+			if (c->peerClosed) closeWebSocketSocket(ws);
+			else processHandshake(ws);
+			continue;
+		}
+		// ping a quiet connection and drop it if it stays silent
+		if ((now - ws->lastReceived) > (3 * WEBSOCKET_PING_MSECS)) {
+			closeWebSocketSocket(ws);
+		} else if (((now - ws->lastReceived) > WEBSOCKET_PING_MSECS) && ((now - ws->lastPing) > WEBSOCKET_PING_MSECS)) {
+			sendFrame(ws, 9, NULL, 0);
+			ws->lastPing = now;
+		}
+	}
+}
+
+// WebSocket Primitives
+
+static OBJ primWebSocketStart(int argCount, OBJ *args) {
+	// Start the WebSocket server on port 81 or the given port. Fail if it can't be started.
+
+	int port = ((argCount > 0) && isInt(args[0])) ? obj2int(args[0]) : 81;
+	if (webSocketServer >= 0) return falseObj; // already running
+	if (!initWebSocketPoll()) return fail(noWiFi);
+	webSocketServer = openServerSocket(port);
+	if (webSocketServer < 0) return fail(noWiFi);
+	struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.u32 = WEBSOCKET_LISTENER };
+	epoll_ctl(webSocketEpollFD, EPOLL_CTL_ADD, webSocketServer, &event);
+	return falseObj;
+}
+
+static OBJ primWebSocketConnect(int argCount, OBJ *args) {
+	// Open a WebSocket connection to the given ws:// URL. Return the client ID used to send
+	// to and identify events from this connection, or -1 if the connection failed. A
+	// connected (or error) event is reported when the opening handshake completes.
+
+	if ((argCount < 1) || !IS_TYPE(args[0], StringType)) return fail(needsStringError);
+	char *url = obj2str(args[0]);
+	if (0 != strncmp(url, "ws://", 5)) return int2obj(-1); // TLS (wss) is not supported
+	url += 5;
+
+	char host[256];
+	int i = 0;
+	while (*url && (':' != *url) && ('/' != *url) && (i < 255)) host[i++] = *url++;
+	host[i] = 0;
+	int port = 80;
+	if (':' == *url) port = strtol(url + 1, &url, 10);
+	char *path = ('/' == *url) ? url : "/";
+
+	struct sockaddr_in remoteAddress;
+	memset(&remoteAddress, 0, sizeof(remoteAddress));
+	if (!initWebSocketPoll() || (lookupHost(host, &remoteAddress) != 0)) return int2obj(-1);
+	remoteAddress.sin_port = htons(port);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return int2obj(-1);
+	setNonBlocking(fd);
+	if ((connect(fd, (struct sockaddr *) &remoteAddress, sizeof(remoteAddress)) < 0) && (EINPROGRESS != errno)) {
+		close(fd);
+		return int2obj(-1);
+	}
+	int id = addWebSocket(fd, true);
+	if (id < 0) {
+		close(fd);
+		return int2obj(-1);
+	}
+	sendClientHandshake(webSockets[id], host, port, path); // queued until connected
+	return int2obj(id);
+}
+
+static OBJ primWebSocketLastEvent(int argCount, OBJ *args) {
+	// Return the next event from any connection as a list [type, clientID, payload],
+	// or false if there are no events.
+
+	serviceWebSockets();
+	for (int i = 0; i < MAX_WEBSOCKETS; i++) {
+		int id = (nextWebSocket + i) % MAX_WEBSOCKETS;
+		WebSocket *ws = webSockets[id];
+		if (!ws) continue;
+		int type = nextWebSocketEvent(ws);
+		if (type < 0) continue;
+
+		tempGCRoot = newObj(ListType, 4, zeroObj); // use tempGCRoot in case of GC
+		if (!tempGCRoot) return falseObj; // allocation failed; report the event later
+		FIELD(tempGCRoot, 0) = int2obj(3);
+		FIELD(tempGCRoot, 1) = int2obj(type);
+		FIELD(tempGCRoot, 2) = int2obj(id);
+		int byteCount = (ws->eventType >= 0) ? ws->eventCount : 0;
+		if (WS_BINARY == type) {
+			OBJ payload = newObj(ByteArrayType, (byteCount + 3) / 4, falseObj);
+			if (!payload) return fail(insufficientMemoryError);
+			setByteCountAdjust(payload, byteCount);
+			memcpy(&FIELD(payload, 0), ws->eventData, byteCount);
+			FIELD(tempGCRoot, 3) = payload;
+		} else {
+			OBJ payload = newStringFromBytes((char *) ws->eventData, byteCount);
+			if (!payload) return fail(insufficientMemoryError);
+			FIELD(tempGCRoot, 3) = payload;
+		}
+
+		// the event has been reported
+		if ((WS_TEXT == type) || (WS_BINARY == type)) {
+			ws->msgOpcode = 0;
+			ws->msgCount = 0;
+		}
+		ws->eventType = -1;
+		if (WS_CONNECTED == type) ws->connectReported = true;
+		if ((WS_DISCONNECTED == type) || (WS_ERROR == type)) freeWebSocket(id);
+		nextWebSocket = (id + 1) % MAX_WEBSOCKETS;
+		return tempGCRoot;
+	}
+	return falseObj;
+}
+
+static OBJ primWebSocketSendToClient(int argCount, OBJ *args) {
+	// Send a text (string) or binary (byte array) message to the given client.
+
+	if (argCount < 2) return fail(notEnoughArguments);
+	int id = obj2int(args[1]);
+	if ((id < 0) || (id >= MAX_WEBSOCKETS) || !webSockets[id] || !webSockets[id]->open) return falseObj;
+	WebSocket *ws = webSockets[id];
+	if (StringType == objType(args[0])) {
+		char *msg = obj2str(args[0]);
+		sendFrame(ws, 1, (uint8 *) msg, strlen(msg));
+	} else if (ByteArrayType == objType(args[0])) {
+		sendFrame(ws, 2, (uint8 *) &FIELD(args[0], 0), BYTES(args[0]));
+	}
+	return falseObj;
+}
+
+static OBJ primWebSocketClose(int argCount, OBJ *args) {
+	// Close the connection to the given client. A disconnected event follows.
+
+	if (argCount < 1) return fail(notEnoughArguments);
+	int id = obj2int(args[0]);
+	if ((id < 0) || (id >= MAX_WEBSOCKETS) || !webSockets[id]) return falseObj;
+	WebSocket *ws = webSockets[id];
+	if (ws->open) closeWebSocket(ws, WS_NORMAL_CLOSURE);
+	else closeWebSocketSocket(ws);
+	return falseObj;
+}
+
+// MQTT
+
+// A self-contained MQTT 3.1.1 client. The broker connection is an HttpConnection, so it
+// shares the HTTP server's input buffering and output queueing, and its socket is
+// registered as a wakeup FD. Received messages are queued until MQTTLastEvent returns
+// them. When the queue is full, packets are left unread so TCP flow control slows the
+// broker rather than dropping messages.
+//
+// Incoming messages are delivered only if their topic matches an active subscription in
+// the subscription table. Publish and subscribe support QoS 0 and 1; incoming QoS 2
+// messages are acknowledged but may be delivered more than once.
+
+#define MQTT_PORT 1883
+#define MQTT_KEEPALIVE_SECS 60
+#define MQTT_CONNECT_MSECS 5000
+#define MQTT_MAX_SUBSCRIPTIONS 32
+#define MQTT_MAX_QUEUED 256
+
+// packet types
+#define MQTT_CONNECT 1
+#define MQTT_CONNACK 2
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_PUBREC 5
+#define MQTT_PUBREL 6
+#define MQTT_PUBCOMP 7
+#define MQTT_SUBSCRIBE 8
+#define MQTT_UNSUBSCRIBE 10
+#define MQTT_PINGREQ 12
+#define MQTT_PINGRESP 13
+#define MQTT_DISCONNECT 14
+
+typedef struct MQTTMessage {
+	struct MQTTMessage *next;
+	int topicLength;
+	int payloadLength;
+	char data[];			// topic followed by payload
+} MQTTMessage;
+
+static HttpConnection *mqtt = NULL;
+static int mqttConnected = false;		// CONNACK received
+static int mqttMaxPacket = 128;			// larger incoming packets are skipped
+static int mqttSkipBytes = 0;			// bytes remaining of a skipped packet
+static int mqttSkipPosition = 0;		// bytes of the skipped packet discarded so far
+static int mqttSkipAck = 0;				// PUBACK or PUBREC owed for a skipped packet, or zero
+static int mqttSkipIDOffset = 0;		// offset of the skipped packet's ID from the packet start
+static uint8 mqttSkipID[2];
+static int mqttNextPacketID = 1;
+static uint32 mqttLastSent = 0;
+static uint32 mqttPingSent = 0;			// zero if no PINGRESP is outstanding
+static char *mqttSubscriptions[MQTT_MAX_SUBSCRIPTIONS];
+
+static MQTTMessage *mqttFirst = NULL;	// received message queue
+static MQTTMessage *mqttLast = NULL;
+static int mqttQueuedCount = 0;
+
+static void closeMQTT() {
+	if (mqtt) {
+		removeWakeupFD(mqtt->fd);
+		close(mqtt->fd);
+		free(mqtt->out);
+		free(mqtt);
+		mqtt = NULL;
+	}
+	mqttConnected = false;
+	mqttSkipBytes = 0;
+	mqttSkipAck = 0;
+	mqttPingSent = 0;
+	while (mqttFirst) {
+		MQTTMessage *next = mqttFirst->next;
+		free(mqttFirst);
+		mqttFirst = next;
+	}
+	mqttLast = NULL;
+	mqttQueuedCount = 0;
+
+	// the broker forgets subscriptions when a clean session ends
+	for (int i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++) {
+		free(mqttSubscriptions[i]);
+		mqttSubscriptions[i] = NULL;
+	}
+}
+
+static int mqttSend(int type, int flags, struct iovec *iov, int iovCount) {
+	// Send a packet with the given type and flags whose body is given by iov.
+	// Close the connection and return false if failed.
+
+	uint8 header[5];
+	int remaining = 0;
+	for (int i = 0; i < iovCount; i++) remaining += iov[i].iov_len;
+	int headerBytes = 0;
+	header[headerBytes++] = (type << 4) | flags;
+	do {
+		header[headerBytes] = remaining & 0x7F;
+		remaining >>= 7;
+		if (remaining) header[headerBytes] |= 0x80;
+		headerBytes++;
+	} while (remaining);
+
+	struct iovec all[6] = { { header, headerBytes } };
+	for (int i = 0; (i < iovCount) && (i < 5); i++) all[i + 1] = iov[i];
+	if (!mqtt || !sendToConnection(mqtt, all, iovCount + 1)) {
+		closeMQTT();
+		return false;
+	}
+	mqttLastSent = millisecs();
+	return true;
+}
+
+static int mqttSendAck(int type, int flags, uint8 *packetID) {
+	struct iovec iov[1] = { { packetID, 2 } };
+	return mqttSend(type, flags, iov, 1);
+}
+
+static int mqttString(uint8 *dst, const char *s) {
+	// Write the given string with a two-byte length prefix. Return the bytes written.
+	int len = strlen(s);
+	dst[0] = len >> 8;
+	dst[1] = len & 255;
+	memcpy(&dst[2], s, len);
+	return len + 2;
+}
+
+static int nextPacketID() {
+	int id = mqttNextPacketID;
+	mqttNextPacketID = (mqttNextPacketID % 65535) + 1;
+	return id;
+}
+
+// Subscriptions
+
+static int topicMatches(const char *filter, const char *topic, int topicLength) {
+	// Return true if the topic matches the given filter, which may contain the wildcards
+	// '+' (one level) and '#' (all remaining levels).
+
+	const char *end = topic + topicLength;
+	while (*filter) {
+		if ('#' == *filter) return true;
+		if ('+' == *filter) {
+			while ((topic < end) && ('/' != *topic)) topic++;
+			filter++;
+		} else {
+			if ((topic >= end) || (*filter != *topic)) {
+				// "a/#" also matches "a"
+				return (topic >= end) && (0 == strcmp(filter, "/#"));
+			}
+			filter++;
+			topic++;
+		}
+	}
+	return (topic >= end);
+}
+
+static int isSubscribed(const char *topic, int topicLength) {
+	for (int i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++) {
+		if (mqttSubscriptions[i] && topicMatches(mqttSubscriptions[i], topic, topicLength)) return true;
+	}
+	return false;
+}
+
+static int subscriptionIndex(const char *filter) {
+	for (int i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++) {
+		if (mqttSubscriptions[i] && (0 == strcmp(mqttSubscriptions[i], filter))) return i;
+	}
+	return -1;
+}
+
+// Receiving
+
+static void queueMQTTMessage(uint8 *topic, int topicLength, uint8 *payload, int payloadLength) {
+	MQTTMessage *msg = malloc(sizeof(MQTTMessage) + topicLength + payloadLength);
+	if (!msg) return;
+	msg->next = NULL;
+	msg->topicLength = topicLength;
+	msg->payloadLength = payloadLength;
+	memcpy(msg->data, topic, topicLength);
+	memcpy(&msg->data[topicLength], payload, payloadLength);
+	if (mqttLast) mqttLast->next = msg;
+	else mqttFirst = msg;
+	mqttLast = msg;
+	mqttQueuedCount++;
+}
+
+static void handleMQTTPacket(int type, int flags, uint8 *body, int bodyBytes) {
+	if (MQTT_CONNACK == type) {
+		if ((bodyBytes >= 2) && (0 == body[1])) mqttConnected = true;
+		else closeMQTT(); // connection refused
+	} else if (MQTT_PUBLISH == type) {
+		int qos = (flags >> 1) & 3;
+		if (bodyBytes < 2) return;
+		int topicLength = (body[0] << 8) | body[1];
+		int headerBytes = 2 + topicLength + (qos ? 2 : 0);
+		if (headerBytes > bodyBytes) return;
+		if (isSubscribed((char *) &body[2], topicLength)) {
+			queueMQTTMessage(&body[2], topicLength, &body[headerBytes], bodyBytes - headerBytes);
+		}
+		if (1 == qos) mqttSendAck(MQTT_PUBACK, 0, &body[2 + topicLength]);
+		if (2 == qos) mqttSendAck(MQTT_PUBREC, 0, &body[2 + topicLength]);
+	} else if ((MQTT_PUBREC == type) && (bodyBytes >= 2)) {
+		mqttSendAck(MQTT_PUBREL, 2, body);
+	} else if ((MQTT_PUBREL == type) && (bodyBytes >= 2)) {
+		mqttSendAck(MQTT_PUBCOMP, 0, body);
+	} else if (MQTT_PINGRESP == type) {
+		mqttPingSent = 0;
+	}
+	// PUBACK, PUBCOMP, SUBACK, and UNSUBACK need no action
+}
+
+static void serviceMQTT() {
+	if (!mqtt) return;
+	addWakeupFD(mqtt->fd); // re-arm idle wakeups
+
+	// the socket is polled, so always try to read and write
+	mqtt->readable = true;
+	mqtt->writable = true;
+	readConnection(mqtt);
+	if (!flushConnection(mqtt)) {
+		closeMQTT();
+		return;
+	}
+
+	// process complete packets
+	while (mqtt && (mqttQueuedCount < MQTT_MAX_QUEUED)) {
+		uint8 *in = mqtt->in;
+		if (mqttSkipBytes > 0) { // discard the rest of a packet that was too large
+			int n = (mqtt->inCount < mqttSkipBytes) ? mqtt->inCount : mqttSkipBytes;
+			if (0 == n) break;
+			for (int i = 0; i < 2; i++) { // capture the packet ID as it goes by
+				int j = mqttSkipIDOffset + i - mqttSkipPosition;
+				if ((j >= 0) && (j < n)) mqttSkipID[i] = in[j];
+			}
+			consumeInput(mqtt, n);
+			mqttSkipPosition += n;
+			mqttSkipBytes -= n;
+			if ((0 == mqttSkipBytes) && mqttSkipAck) {
+				// acknowledge the skipped message so the broker does not resend it
+				int ackType = mqttSkipAck;
+				mqttSkipAck = 0;
+				mqttSendAck(ackType, 0, mqttSkipID);
+			}
+			continue;
+		}
+		int bodyBytes = 0;
+		int headerBytes = 1;
+		int complete = false;
+		for (int shift = 0; (headerBytes < mqtt->inCount) && (headerBytes <= 4); shift += 7) {
+			uint8 b = in[headerBytes++];
+			bodyBytes |= (b & 0x7F) << shift;
+			if (!(b & 0x80)) { complete = true; break; }
+		}
+		if (!complete) {
+			if (headerBytes > 4) closeMQTT(); // malformed length
+			break;
+		}
+		int packetBytes = headerBytes + bodyBytes;
+		if ((packetBytes > mqttMaxPacket) || (packetBytes > HTTP_REQUEST_BUFFER_SIZE)) {
+			int qos = (in[0] >> 1) & 3;
+			mqttSkipAck = 0;
+			if ((MQTT_PUBLISH == (in[0] >> 4)) && qos) { // find the packet ID to acknowledge
+				if (mqtt->inCount < (headerBytes + 2)) break; // wait for the topic length
+				int topicLength = (in[headerBytes] << 8) | in[headerBytes + 1];
+				mqttSkipIDOffset = headerBytes + 2 + topicLength;
+				if ((mqttSkipIDOffset + 2) <= packetBytes) mqttSkipAck = (1 == qos) ? MQTT_PUBACK : MQTT_PUBREC;
+			}
+			mqttSkipPosition = 0;
+			mqttSkipBytes = packetBytes;
+			continue;
+		}
+		if (mqtt->inCount < packetBytes) break;
+		handleMQTTPacket(in[0] >> 4, in[0] & 15, &in[headerBytes], bodyBytes);
+		if (mqtt) consumeInput(mqtt, packetBytes);
+	}
+	if (!mqtt) return;
+	if (mqtt->peerClosed && (mqtt->inCount == 0)) {
+		closeMQTT();
+		return;
+	}
+
+	// keep the connection alive
+	uint32 now = millisecs();
+	if (mqttConnected && ((now - mqttLastSent) > (MQTT_KEEPALIVE_SECS * 500)) && !mqttPingSent) {
+		if (mqttSend(MQTT_PINGREQ, 0, NULL, 0)) mqttPingSent = now | 1;
+	} else if (mqttPingSent && ((now - mqttPingSent) > (MQTT_KEEPALIVE_SECS * 1000))) {
+		closeMQTT(); // broker is not responding
+	}
+}
+
+// MQTT Primitives
+
+static OBJ primMQTTConnect(int argCount, OBJ *args) {
+	// Connect to the given broker ("host" or "host:port") with the optional buffer size,
+	// client ID, username, and password. Wait (at most MQTT_CONNECT_MSECS) for the broker
+	// to accept the connection.
+
+	if ((argCount < 1) || !IS_TYPE(args[0], StringType)) return fail(needsStringError);
+	char *brokerURI = obj2str(args[0]);
+	int bufferSize = ((argCount > 1) && isInt(args[1])) ? obj2int(args[1]) : 128;
+	char *clientID = ((argCount > 2) && IS_TYPE(args[2], StringType)) ? obj2str(args[2]) : "";
+	char *username = ((argCount > 4) && IS_TYPE(args[3], StringType)) ? obj2str(args[3]) : "";
+	char *password = ((argCount > 4) && IS_TYPE(args[4], StringType)) ? obj2str(args[4]) : "";
+
+	// constrain the buffer size
+	if (bufferSize < 32) bufferSize = 32;
+	if (bufferSize > HTTP_REQUEST_BUFFER_SIZE) bufferSize = HTTP_REQUEST_BUFFER_SIZE;
+	mqttMaxPacket = bufferSize;
+
+	closeMQTT();
+
+	// parse the broker address
+	if (0 == strncmp(brokerURI, "mqtt://", 7)) brokerURI += 7;
+	char host[256];
+	int i = 0;
+	while (brokerURI[i] && (':' != brokerURI[i]) && ('/' != brokerURI[i]) && (i < 255)) {
+		host[i] = brokerURI[i];
+		i++;
+	}
+	host[i] = 0;
+	int port = (':' == brokerURI[i]) ? atoi(&brokerURI[i + 1]) : MQTT_PORT;
+
+	struct sockaddr_in remoteAddress;
+	memset(&remoteAddress, 0, sizeof(remoteAddress));
+	if (lookupHost(host, &remoteAddress) != 0) return falseObj;
+	remoteAddress.sin_port = htons(port);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return falseObj;
+	setNonBlocking(fd);
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &flag, sizeof(flag));
+	if ((connect(fd, (struct sockaddr *) &remoteAddress, sizeof(remoteAddress)) < 0) && (EINPROGRESS != errno)) {
+		close(fd);
+		return falseObj;
+	}
+	mqtt = calloc(1, sizeof(HttpConnection));
+	if (!mqtt) {
+		close(fd);
+		return falseObj;
+	}
+	mqtt->fd = fd;
+	addWakeupFD(fd);
+
+	// send the CONNECT packet
+	uint8 body[1024];
+	int n = mqttString(body, "MQTT");
+	body[n++] = 4; // protocol level (3.1.1)
+	int usernameLength = strlen(username);
+	int passwordLength = strlen(password);
+	if ((usernameLength + passwordLength + strlen(clientID)) > (sizeof(body) - 20)) {
+		closeMQTT();
+		return falseObj;
+	}
+	body[n++] = 0x02 | (usernameLength ? 0x80 : 0) | (passwordLength ? 0x40 : 0); // clean session
+	body[n++] = MQTT_KEEPALIVE_SECS >> 8;
+	body[n++] = MQTT_KEEPALIVE_SECS & 255;
+	n += mqttString(&body[n], clientID);
+	if (usernameLength) n += mqttString(&body[n], username);
+	if (passwordLength) n += mqttString(&body[n], password);
+	struct iovec iov[1] = { { body, n } };
+	if (!mqttSend(MQTT_CONNECT, 0, iov, 1)) return falseObj;
+
+	// wait for CONNACK
+	uint32 start = millisecs();
+	while (mqtt && !mqttConnected && ((millisecs() - start) < MQTT_CONNECT_MSECS)) {
+		struct pollfd pfd = { mqtt->fd, POLLIN | (mqtt->outCount ? POLLOUT : 0), 0 };
+		poll(&pfd, 1, 20);
+		serviceMQTT();
+		processMessage(); // process messages now
+	}
+	if (mqtt && !mqttConnected) closeMQTT();
+	return falseObj;
+}
+
+static OBJ primMQTTIsConnected(int argCount, OBJ *args) {
+	serviceMQTT();
+	return mqttConnected ? trueObj : falseObj;
+}
+
+static OBJ primMQTTDisconnect(int argCount, OBJ *args) {
+	if (!mqtt) return falseObj;
+	if (mqttSend(MQTT_DISCONNECT, 0, NULL, 0)) flushConnection(mqtt);
+	closeMQTT();
+	return trueObj;
+}
+
+static OBJ primMQTTLastEvent(int argCount, OBJ *args) {
+	// Return the next received message as a list [topic, payload], or false if none.
+
+	int useBinary = (argCount > 0) && (trueObj == args[0]);
+	serviceMQTT();
+	MQTTMessage *msg = mqttFirst;
+	if (!msg) return falseObj;
+
+	// allocate a result list (stored in tempGCRoot so it will be processed by the
+	// garbage collector if a GC happens during a later allocation)
+	tempGCRoot = newObj(ListType, 3, zeroObj);
+	if (!tempGCRoot) return tempGCRoot; // allocation failed
+
+	FIELD(tempGCRoot, 0) = int2obj(2); // list size
+	OBJ topic = newStringFromBytes(msg->data, msg->topicLength);
+	if (!topic) return fail(insufficientMemoryError);
+	FIELD(tempGCRoot, 1) = topic;
+
+	char *payloadBytes = &msg->data[msg->topicLength];
+	OBJ payload;
+	if (useBinary) {
+		payload = newObj(ByteArrayType, (msg->payloadLength + 3) / 4, falseObj);
+		if (!payload) return fail(insufficientMemoryError);
+		memcpy(&FIELD(payload, 0), payloadBytes, msg->payloadLength);
+		setByteCountAdjust(payload, msg->payloadLength);
+	} else {
+		payload = newStringFromBytes(payloadBytes, msg->payloadLength);
+		if (!payload) return fail(insufficientMemoryError);
+	}
+	FIELD(tempGCRoot, 2) = payload;
+
+	// remove the message from the queue
+	mqttFirst = msg->next;
+	if (!mqttFirst) mqttLast = NULL;
+	mqttQueuedCount--;
+	free(msg);
+	return tempGCRoot;
+}
+
+static OBJ primMQTTPub(int argCount, OBJ *args) {
+	if (!mqttConnected || (argCount < 2) || !IS_TYPE(args[0], StringType)) return falseObj;
+
+	char *topic = obj2str(args[0]);
+	OBJ payloadObj = args[1];
+	char *payload;
+	int payloadByteCount = 0;
+	char s[20];
+	if (IS_TYPE(payloadObj, StringType)) { // string
+		payload = obj2str(payloadObj);
+		payloadByteCount = strlen(payload);
+	} else if (IS_TYPE(payloadObj, ByteArrayType)) { // byte array
+		payload = (char *) &FIELD(payloadObj, 0);
+		payloadByteCount = BYTES(payloadObj);
+	} else if (isInt(payloadObj)) {
+		sprintf(s, "%d", obj2int(payloadObj));
+		payload = s;
+		payloadByteCount = strlen(payload);
+	} else if (isBoolean(payloadObj)) {
+		payload = (trueObj == payloadObj) ? "true" : "false";
+		payloadByteCount = strlen(payload);
+	} else {
+		return falseObj; // must be string or byte array
+	}
+
+	int retained = (argCount > 2) && (trueObj == args[2]);
+	int qos = ((argCount > 3) && isInt(args[3]) && (obj2int(args[3]) > 0)) ? 1 : 0;
+
+	int topicLength = strlen(topic);
+	uint8 topicLengthBytes[2] = { topicLength >> 8, topicLength & 255 };
+	int id = nextPacketID();
+	uint8 packetID[2] = { id >> 8, id & 255 };
+	struct iovec iov[4] = {
+		{ topicLengthBytes, 2 },
+		{ topic, topicLength },
+		{ packetID, qos ? 2 : 0 },
+		{ payload, payloadByteCount } };
+	int success = mqttSend(MQTT_PUBLISH, (qos << 1) | retained, iov, 4);
+	return success ? trueObj : falseObj;
+}
+
+static OBJ primMQTTSub(int argCount, OBJ *args) {
+	if (!mqttConnected || (argCount < 1) || !IS_TYPE(args[0], StringType)) return falseObj;
+
+	char *topic = obj2str(args[0]);
+	int qos = ((argCount > 1) && isInt(args[1]) && (obj2int(args[1]) > 0)) ? 1 : 0;
+
+	// add the topic to the subscription table
+	if (subscriptionIndex(topic) < 0) {
+		int i;
+		for (i = 0; (i < MQTT_MAX_SUBSCRIPTIONS) && mqttSubscriptions[i]; i++) /* find free entry */;
+		if (i >= MQTT_MAX_SUBSCRIPTIONS) return falseObj; // table full
+		mqttSubscriptions[i] = strdup(topic);
+		if (!mqttSubscriptions[i]) return falseObj;
+	}
+
+	int id = nextPacketID();
+	uint8 packetID[2] = { id >> 8, id & 255 };
+	uint8 topicLengthBytes[2] = { strlen(topic) >> 8, strlen(topic) & 255 };
+	uint8 requestedQoS = qos;
+	struct iovec iov[4] = {
+		{ packetID, 2 },
+		{ topicLengthBytes, 2 },
+		{ topic, strlen(topic) },
+		{ &requestedQoS, 1 } };
+	int success = mqttSend(MQTT_SUBSCRIBE, 2, iov, 4);
+	return success ? trueObj : falseObj;
+}
+
+static OBJ primMQTTUnsub(int argCount, OBJ *args) {
+	if (!mqttConnected || (argCount < 1) || !IS_TYPE(args[0], StringType)) return falseObj;
+
+	char *topic = obj2str(args[0]);
+	int i = subscriptionIndex(topic);
+	if (i >= 0) {
+		free(mqttSubscriptions[i]);
+		mqttSubscriptions[i] = NULL;
+	}
+
+	int id = nextPacketID();
+	uint8 packetID[2] = { id >> 8, id & 255 };
+	uint8 topicLengthBytes[2] = { strlen(topic) >> 8, strlen(topic) & 255 };
+	struct iovec iov[3] = {
+		{ packetID, 2 },
+		{ topicLengthBytes, 2 },
+		{ topic, strlen(topic) } };
+	int success = mqttSend(MQTT_UNSUBSCRIBE, 2, iov, 3);
+	return success ? trueObj : falseObj;
+}
+
+// Network Step
+
+void netStep() {
+	// Called periodically from the VM loop to make progress on network connections.
+
+	serviceHttpRequests();
+	serviceWebSockets();
+}
+
 // Not yet implemented
 
 static OBJ primStartSSIDscan(int argCount, OBJ *args) { return fail(noWiFi); }
 static OBJ primGetSSID(int argCount, OBJ *args) { return fail(noWiFi); }
-static OBJ primWebSocketStart(int argCount, OBJ *args) { return fail(noWiFi); }
-static OBJ primWebSocketLastEvent(int argCount, OBJ *args) { return fail(noWiFi); }
-static OBJ primWebSocketSendToClient(int argCount, OBJ *args) { return fail(noWiFi); }
 
 static PrimEntry entries[] = {
 	{"hasWiFi", primHasWiFi},
@@ -476,13 +2457,33 @@ static PrimEntry entries[] = {
 	{"myMAC", primGetMAC},
 	{"httpServerGetRequest", primHttpServerGetRequest},
 	{"respondToHttpRequest", primRespondToHttpRequest},
+	{"httpServerSendChunk", primHttpServerSendChunk},
 	{"httpConnect", primHttpConnect},
 	{"httpIsConnected", primHttpIsConnected},
 	{"httpRequest", primHttpRequest},
 	{"httpResponse", primHttpResponse},
+	{"httpStartRequest", primHttpStartRequest},
+	{"httpRequestStatus", primHttpRequestStatus},
+	{"httpRequestChunk", primHttpRequestChunk},
+	{"httpEndRequest", primHttpEndRequest},
+	{"udpStart", primUDPStart},
+	{"udpStop", primUDPStop},
+	{"udpSendPacket", primUDPSendPacket},
+	{"udpReceivePacket", primUDPReceivePacket},
+	{"udpRemoteIPAddress", primUDPRemoteIPAddress},
+	{"udpRemotePort", primUDPRemotePort},
 	{"webSocketStart", primWebSocketStart},
 	{"webSocketLastEvent", primWebSocketLastEvent},
 	{"webSocketSendToClient", primWebSocketSendToClient},
+	{"webSocketConnect", primWebSocketConnect},
+	{"webSocketClose", primWebSocketClose},
+	{"MQTTConnect", primMQTTConnect},
+	{"MQTTIsConnected", primMQTTIsConnected},
+	{"MQTTDisconnect", primMQTTDisconnect},
+	{"MQTTLastEvent", primMQTTLastEvent},
+	{"MQTTPub", primMQTTPub},
+	{"MQTTSub", primMQTTSub},
+	{"MQTTUnsub", primMQTTUnsub},
 };
 
 void addNetPrims() {
@@ -0,0 +1,200 @@
+// Tests for code store checkpoints (see "Checkpoints" in vm/persist.c).
+//
+// The code store is simulated in RAM, so a restart is simulated by clearing the chunk table
+// and calling restoreScripts(), which rebuilds it from the latest checkpoint.
+//
+// Build and run from this folder:
+//	gcc -std=gnu99 -I ../../vm checkpointTests.c ../../vm/persist.c ../../vm/mem.c -o checkpointTests
+//	./checkpointTests
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+#include "interp.h"
+#include "persist.h"
+
+// VM state normally provided by interp.c and runtime.c
+
+CodeChunkRecord chunks[MAX_CHUNKS];
+Task tasks[MAX_TASKS];
+int taskCount = 0;
+OBJ vars[MAX_VARS];
+OBJ lastBroadcast = zeroObj;
+
+void outputString(const char *s) { }
+uint32 microsecs() { return 0; }
+void processMessage() { }
+OBJ fail(uint8 errCode) { return falseObj; }
+
+#define CHUNK_COUNT 10
+#define VAR_COUNT 5
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+	if (!ok) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+static void storeChunk(int chunkIndex, int version) {
+	int code[4] = { chunkIndex, version, 0, 0 };
+	chunks[chunkIndex].code = appendPersistentRecord(chunkCode, chunkIndex, functionHat, sizeof(code), (uint8 *) code);
+	chunks[chunkIndex].chunkType = functionHat;
+}
+
+static void storeVarName(int varID, const char *name) {
+	appendPersistentRecord(varName, varID, 0, strlen(name) + 1, (uint8 *) name);
+}
+
+static int * latestCheckpointRecord() {
+	int *result = NULL;
+	for (int *p = recordAfter(NULL); p; p = recordAfter(p)) {
+		if (checkpoint == ((*p >> 16) & 0xFF)) result = p;
+	}
+	return result;
+}
+
+static void restart() {
+	memset(chunks, 0, sizeof(chunks));
+	restoreScripts();
+}
+
+static int chunksMatch(int version) {
+	// Return true if every chunk holds the given version of its code. Chunk 0 was deleted.
+
+	if (chunks[0].code) return false;
+	for (int i = 1; i < CHUNK_COUNT; i++) {
+		int *code = chunks[i].code;
+		if (!code || (functionHat != chunks[i].chunkType)) return false;
+		if ((code[PERSISTENT_HEADER_WORDS] != i) || (code[PERSISTENT_HEADER_WORDS + 1] != version)) return false;
+	}
+	return true;
+}
+
+static int varNamesMatch(const char *renamed) {
+	// Return true if the variable names are v0...v4 except for variable 1, which has the
+	// given name.
+
+	char name[10];
+	for (int i = 0; i < VAR_COUNT; i++) {
+		if (1 == i) {
+			strcpy(name, renamed);
+		} else {
+			sprintf(name, "v%d", i);
+		}
+		if (i != indexOfVarNamed(name)) return false;
+		if (!varNameForIndex(i) || strcmp(name, varNameForIndex(i))) return false;
+	}
+	return NULL == varNameForIndex(VAR_COUNT);
+}
+
+static void testWriteAndReload() {
+	for (int i = 0; i < CHUNK_COUNT; i++) storeChunk(i, 1);
+	for (int i = 0; i < VAR_COUNT; i++) {
+		char name[10];
+		sprintf(name, "v%d", i);
+		storeVarName(i, name);
+	}
+	appendPersistentRecord(chunkDeleted, 0, 0, 0, NULL);
+	chunks[0].code = NULL;
+	chunks[0].chunkType = unusedChunk;
+	check(NULL == latestCheckpointRecord(), "no checkpoint before the interval");
+
+	// storing enough records writes a checkpoint
+	for (int n = 0; n < 7; n++) {
+		for (int i = 1; i < CHUNK_COUNT; i++) storeChunk(i, 2);
+	}
+	int *cp = latestCheckpointRecord();
+	check(NULL != cp, "checkpoint written after the interval");
+	check(cp && (cp[PERSISTENT_HEADER_WORDS] == (CHUNK_COUNT - 1)), "checkpoint holds the current chunks");
+	check(cp && (cp[1] == (1 + (CHUNK_COUNT - 1) + VAR_COUNT)), "checkpoint holds the variable names");
+
+	// records after the checkpoint are applied on top of it
+	storeVarName(1, "renamed");
+	restart();
+	check(chunksMatch(2), "chunk table restored from the checkpoint");
+	check(varNamesMatch("renamed"), "variable names restored from the checkpoint");
+}
+
+static void testCorruptCheckpoint() {
+	// Corrupt checkpoint entries must be ignored, falling back to a full scan.
+
+	int *cp = latestCheckpointRecord();
+	if (!cp) return;
+	int *data = cp + PERSISTENT_HEADER_WORDS;
+	int chunkCount = data[0];
+	int firstVarEntry = data[chunkCount + 1];
+	int *halfSpaceStart = recordAfter(NULL) - 1;
+
+	// a variable entry that points at a chunk record instead of a variable name record
+	data[chunkCount + 1] = (firstVarEntry & 0xFF000000) | (chunks[1].code - halfSpaceStart);
+	restart();
+	check(chunksMatch(2), "chunk table restored despite a bad variable entry");
+	check(varNamesMatch("renamed"), "variable names restored despite a bad variable entry");
+
+	// a variable entry that points past the checkpoint
+	data[chunkCount + 1] = (firstVarEntry & 0xFF000000) | ((cp + 4) - halfSpaceStart);
+	restart();
+	check(varNamesMatch("renamed"), "variable names restored despite an entry after the checkpoint");
+	data[chunkCount + 1] = firstVarEntry;
+
+	// a chunk entry that points at the wrong chunk
+	int firstChunkEntry = data[1];
+	data[1] = (firstChunkEntry & 0xFF000000) | (chunks[2].code - halfSpaceStart);
+	restart();
+	check(chunksMatch(2), "chunk table restored despite a bad chunk entry");
+	check(varNamesMatch("renamed"), "variable names restored despite a bad chunk entry");
+	data[1] = firstChunkEntry;
+
+	// a bad chunk count
+	data[0] = -1;
+	restart();
+	check(chunksMatch(2), "chunk table restored despite a bad chunk count");
+	check(varNamesMatch("renamed"), "variable names restored despite a bad chunk count");
+	data[0] = chunkCount;
+}
+
+static void testCompaction() {
+	// Compaction discards old checkpoints and writes one for the compacted records.
+
+	for (int i = 1; i < CHUNK_COUNT; i++) storeChunk(i, 3);
+	compactCodeStore();
+	int *cp = latestCheckpointRecord();
+	check(NULL != cp, "checkpoint written after compaction");
+	int checkpointCount = 0;
+	for (int *p = recordAfter(NULL); p; p = recordAfter(p)) {
+		if (checkpoint == ((*p >> 16) & 0xFF)) checkpointCount++;
+	}
+	check(1 == checkpointCount, "old checkpoints discarded by compaction");
+
+	restart();
+	check(chunksMatch(3), "chunk table restored after compaction");
+	check(varNamesMatch("renamed"), "variable names restored after compaction");
+
+	storeVarName(1, "again");
+	storeChunk(5, 3);
+	restart();
+	check(chunksMatch(3), "chunk table restored from a compacted store with later records");
+	check(varNamesMatch("again"), "variable names restored from a compacted store with later records");
+}
+
+int main() {
+	memClear();
+	restoreScripts();
+	clearPersistentMemory();
+
+	testWriteAndReload();
+	testCorruptCheckpoint();
+	testCompaction();
+
+	if (failures) {
+		printf("%d test(s) failed\n", failures);
+		return 1;
+	}
+	printf("All checkpoint tests passed\n");
+	return 0;
+}
@@ -0,0 +1,144 @@
+// Tests for compressed chunk storage (see "Compressed Chunks" in vm/persist.c).
+//
+// Build and run from this folder (like the Linux VM, the object store needs -m32):
+//	gcc -m32 -std=gnu99 -D COMPRESS_CHUNKS -D CHUNK_CACHE_BYTES=1024 -I ../../vm
+//		compressedChunkTests.c ../../vm/persist.c ../../vm/mem.c -o compressedChunkTests
+//	./compressedChunkTests
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+#include "interp.h"
+#include "persist.h"
+
+// VM state normally provided by interp.c and runtime.c
+
+CodeChunkRecord chunks[MAX_CHUNKS];
+Task tasks[MAX_TASKS];
+int taskCount = 0;
+OBJ vars[MAX_VARS];
+OBJ lastBroadcast = zeroObj;
+
+void outputString(const char *s) { printf("%s\n", s); }
+uint32 microsecs() { return 0; }
+void processMessage() { }
+OBJ fail(uint8 errCode) { return falseObj; }
+
+#define CODE_WORDS 40 // an expansion is 42 words, so six fit in a 1024 byte chunk cache
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+	if (!ok) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+static void chunkCodeFor(int chunkIndex, int *code) {
+	// Fill code with instruction-like words: small opcodes and args, with some zero words.
+
+	for (int i = 0; i < CODE_WORDS; i++) {
+		code[i] = (i % 5) ? (((i + chunkIndex) % 7) << 8) | (i % 30) : 0;
+	}
+}
+
+static void storeChunk(int chunkIndex) {
+	int code[CODE_WORDS];
+	chunkCodeFor(chunkIndex, code);
+	int recordBytes = compressChunk((uint8 *) code, sizeof(code));
+	check((recordBytes > 0) && (recordBytes < (int) sizeof(code)), "chunk code is compressed");
+	chunks[chunkIndex].code = appendPersistentRecord(chunkCode, chunkIndex, COMPRESSED_CHUNK | functionHat, recordBytes, (uint8 *) code);
+	chunks[chunkIndex].chunkType = functionHat;
+}
+
+static int expansionMatches(int chunkIndex, int *expansion) {
+	int code[CODE_WORDS];
+	chunkCodeFor(chunkIndex, code);
+	return expansion &&
+		(CODE_WORDS == expansion[1]) &&
+		(0 == memcmp(code, expansion + PERSISTENT_HEADER_WORDS, sizeof(code)));
+}
+
+static void testCompression() {
+	int code[CODE_WORDS];
+	for (int i = 0; i < CODE_WORDS; i++) code[i] = 0x01010101 * (i + 1); // no zero bytes
+	check(0 == compressChunk((uint8 *) code, sizeof(code)), "incompressible code is left alone");
+	check(0x01010101 == code[0], "incompressible code is unchanged");
+
+	for (int i = 0; i < 10; i++) storeChunk(i);
+	for (int i = 0; i < 10; i++) {
+		check(expansionMatches(i, expandedChunkCode(i)), "expansion matches the original code");
+	}
+}
+
+static void testEviction() {
+	// Expansions that a task is running or that an object refers to must not be evicted.
+	// Each expansion is put in use before the next one, since expanding may evict.
+
+	int *inTask = expandedChunkCode(0);
+	tasks[0].status = running;
+	tasks[0].code = inTask;
+	taskCount = 1;
+
+	int *inVariable = expandedChunkCode(1);
+	vars[0] = (OBJ) (inVariable + 5); // a string literal stored in a variable
+
+	int *onStack = expandedChunkCode(2);
+	tasks[1].status = waiting_micros;
+	tasks[1].code = inTask;
+	tasks[1].sp = 1;
+	tasks[1].stack[0] = (OBJ) (onStack + 7); // a string literal pushed by pushLiteral_op
+	taskCount = 2;
+
+	for (int i = 3; i < 10; i++) {
+		check(expansionMatches(i, expandedChunkCode(i)), "expansion after eviction matches the original code");
+	}
+	check(inTask == expandedChunkCode(0), "running expansion was kept");
+	check(inVariable == expandedChunkCode(1), "expansion referenced by a variable was kept");
+	check(onStack == expandedChunkCode(2), "expansion referenced from a task stack was kept");
+	check(expansionMatches(0, inTask) && expansionMatches(1, inVariable) && expansionMatches(2, onStack),
+		"kept expansions are intact");
+
+	// with every cache entry in use, expansion fails instead of evicting
+	for (int i = 3; i < 6; i++) vars[i] = (OBJ) (expandedChunkCode(i) + PERSISTENT_HEADER_WORDS);
+	check(NULL == expandedChunkCode(6), "expansion fails when the cache is full of expansions in use");
+
+	// once nothing refers to them, expansions can be evicted
+	memset(tasks, 0, sizeof(tasks));
+	taskCount = 0;
+	for (int i = 0; i < MAX_VARS; i++) vars[i] = zeroObj;
+	check(expansionMatches(6, expandedChunkCode(6)), "expansion succeeds once the cache is no longer in use");
+}
+
+static void testNewVersion() {
+	// Storing a new version of a chunk needs a new expansion. The expansion of the current
+	// version is found again, including after compaction moves its record.
+
+	int *oldVersion = expandedChunkCode(6);
+	storeChunk(6);
+	int *newVersion = expandedChunkCode(6);
+	check((newVersion != oldVersion) && expansionMatches(6, newVersion), "new version of a chunk gets a new expansion");
+	check(newVersion == expandedChunkCode(6), "expansion of the current version is found again");
+	compactCodeStore();
+	check(newVersion == expandedChunkCode(6), "expansion is found again after compaction");
+}
+
+int main() {
+	memClear();
+	restoreScripts();
+	clearPersistentMemory();
+
+	testCompression();
+	testEviction();
+	testNewVersion();
+
+	if (failures) {
+		printf("%d test(s) failed\n", failures);
+		return 1;
+	}
+	printf("All compressed chunk tests passed\n");
+	return 0;
+}
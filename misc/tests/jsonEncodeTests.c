@@ -0,0 +1,146 @@
+// Tests for the jsonEncode primitive (see "JSON Encoding" in vm/miscPrims.c).
+//
+// Build and run from this folder:
+//	gcc -std=gnu99 -I ../../vm jsonEncodeTests.c ../../vm/tinyJSON.c -lm -o jsonEncodeTests
+//	./jsonEncodeTests
+
+#include "../../vm/miscPrims.c"
+
+// VM support normally provided by interp.c, mem.c, and runtime.c. Objects are allocated
+// with malloc and never freed; the test is short.
+
+OBJ vars[MAX_VARS];
+static int lastError = 0;
+
+OBJ fail(uint8 errCode) {
+	lastError = errCode;
+	return falseObj;
+}
+void addPrimitiveSet(const char *setName, int entryCount, PrimEntry *entries) { }
+int addTelemetrySample(int count, int *values) { return true; }
+void outputString(const char *s) { printf("%s\n", s); }
+OBJ primBroadcastToIDEOnly(int argCount, OBJ *args) { return falseObj; }
+
+OBJ newObj(int typeID, int wordCount, OBJ fill) {
+	OBJ obj = calloc(wordCount + HEADER_WORDS + 1, sizeof(OBJ)); // room for a string terminator
+	*obj = HEADER(typeID, wordCount);
+	for (int i = 0; i < wordCount; i++) FIELD(obj, i) = fill;
+	return obj;
+}
+OBJ newString(int byteCount) { return newObj(StringType, (byteCount / 4) + 1, falseObj); }
+OBJ newStringFromBytes(const char *bytes, int byteCount) {
+	OBJ result = newString(byteCount);
+	memcpy(obj2str(result), bytes, byteCount);
+	return result;
+}
+char* obj2str(OBJ obj) { return (char *) &FIELD(obj, 0); }
+
+// Helpers
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+	if (!ok) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+static OBJ newList(int count) {
+	OBJ list = newObj(ListType, count + 1, zeroObj);
+	FIELD(list, 0) = int2obj(count);
+	return list;
+}
+
+static OBJ string(const char *s) { return newStringFromBytes(s, strlen(s)); }
+
+static int encodesAs(OBJ obj, const char *expected) {
+	// Return true if obj encodes as expected and the size pass predicted the exact size.
+
+	OBJ result = primJSONEncode(1, &obj);
+	if (!IS_TYPE(result, StringType)) return false;
+	return (jsonEncodedSize(obj, 0) == (int) strlen(expected)) && (0 == strcmp(obj2str(result), expected));
+}
+
+static OBJ nestedLists(int depth) {
+	// Return a list whose innermost item, an integer, is at the given depth.
+
+	OBJ result = int2obj(42);
+	for (int i = 0; i < depth; i++) {
+		OBJ list = newList(1);
+		FIELD(list, 1) = result;
+		result = list;
+	}
+	return result;
+}
+
+// Tests
+
+static void testValues() {
+	check(encodesAs(int2obj(0), "0"), "zero");
+	check(encodesAs(int2obj(-123456), "-123456"), "negative integer");
+	check(encodesAs(trueObj, "true"), "true");
+	check(encodesAs(falseObj, "false"), "false");
+	check(encodesAs(string(""), "\"\""), "empty string");
+	check(encodesAs(string("hello"), "\"hello\""), "string");
+
+	OBJ bytes = newObj(ByteArrayType, 1, falseObj);
+	setByteCountAdjust(bytes, 3);
+	((uint8 *) &FIELD(bytes, 0))[0] = 7;
+	((uint8 *) &FIELD(bytes, 0))[1] = 42;
+	((uint8 *) &FIELD(bytes, 0))[2] = 255;
+	check(encodesAs(bytes, "[7,42,255]"), "byte array");
+
+	OBJ list = newList(4);
+	FIELD(list, 1) = int2obj(1);
+	FIELD(list, 2) = string("two");
+	FIELD(list, 3) = newList(0);
+	FIELD(list, 4) = newObj(ArrayType, 1, zeroObj); // no JSON equivalent
+	check(encodesAs(list, "[1,\"two\",[],null]"), "list");
+}
+
+static void testEscapes() {
+	check(encodesAs(string("a\"b\\c"), "\"a\\\"b\\\\c\""), "quote and backslash are escaped");
+	check(encodesAs(string("\b\f\n\r\t"), "\"\\b\\f\\n\\r\\t\""), "short escapes");
+	check(encodesAs(string("\x01z\x1f"), "\"\\u0001z\\u001f\""), "other control characters use \\uHHHH");
+	check(encodesAs(string("caf\xc3\xa9"), "\"caf\xc3\xa9\""), "UTF-8 is passed through");
+
+	// the size pass must count every escape; a string of all control characters is 6x longer
+	char controls[32];
+	for (int i = 0; i < 31; i++) controls[i] = i + 1;
+	controls[31] = '\0';
+	OBJ s = string(controls);
+	OBJ result = primJSONEncode(1, &s);
+	check(IS_TYPE(result, StringType) && ((int) strlen(obj2str(result)) == jsonEncodedSize(s, 0)),
+		"size pass matches the encoding of every control character");
+}
+
+static void testNesting() {
+	lastError = 0;
+	OBJ deep = nestedLists(TJR_MAX_DEPTH);
+	check(IS_TYPE(primJSONEncode(1, &deep), StringType), "nesting to the maximum depth is encoded");
+	check(0 == lastError, "no error at the maximum depth");
+
+	OBJ tooDeep = nestedLists(TJR_MAX_DEPTH + 1);
+	check(falseObj == primJSONEncode(1, &tooDeep), "nesting past the maximum depth fails");
+	check(stackOverflow == lastError, "nesting past the maximum depth reports stackOverflow");
+
+	lastError = 0;
+	OBJ loop = newList(1);
+	FIELD(loop, 1) = loop;
+	check(falseObj == primJSONEncode(1, &loop), "a list that contains itself fails");
+	check(stackOverflow == lastError, "a list that contains itself reports stackOverflow");
+}
+
+int main() {
+	testValues();
+	testEscapes();
+	testNesting();
+
+	if (failures) {
+		printf("%d test(s) failed\n", failures);
+		return 1;
+	}
+	printf("All jsonEncode tests passed\n");
+	return 0;
+}
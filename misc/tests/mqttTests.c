@@ -0,0 +1,250 @@
+// Tests for the Linux VM's MQTT client (see "MQTT" in linux+pi/linuxNetPrims.c).
+//
+// The client talks to a minimal loopback broker that runs in a thread of this process,
+// so the test needs no network access or external broker.
+//
+// Build and run from this folder:
+//	gcc -std=gnu99 -D GNUBLOCKS -I ../../vm -I ../../linux+pi mqttTests.c -lpthread -lm -o mqttTests
+//	./mqttTests
+
+#include "../../linux+pi/linuxNetPrims.c"
+
+#include <pthread.h>
+#include <sys/time.h>
+
+// VM support normally provided by interp.c, mem.c, and linux.c. Objects are allocated
+// with malloc and never freed; the test is short.
+
+int taskCount = 0;
+Task tasks[MAX_TASKS];
+OBJ vars[MAX_VARS];
+OBJ lastBroadcast = zeroObj;
+OBJ tempGCRoot = NULL;
+
+uint32 millisecs() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec * 1000) + (now.tv_usec / 1000);
+}
+uint32 microsecs() { return 1000 * millisecs(); }
+void addWakeupFD(int fd) { }
+void removeWakeupFD(int fd) { }
+void addPrimitiveSet(const char *setName, int entryCount, PrimEntry *entries) { }
+void outputString(const char *s) { printf("%s\n", s); }
+void processMessage() { }
+OBJ fail(uint8 errCode) { return falseObj; }
+
+OBJ newObj(int typeID, int wordCount, OBJ fill) {
+	OBJ obj = calloc(wordCount + HEADER_WORDS + 1, sizeof(OBJ)); // room for a string terminator
+	*obj = HEADER(typeID, wordCount);
+	return obj;
+}
+OBJ newString(int byteCount) { return newObj(StringType, (byteCount / 4) + 1, falseObj); }
+OBJ newStringFromBytes(const char *bytes, int byteCount) {
+	OBJ result = newString(byteCount);
+	memcpy(&FIELD(result, 0), bytes, byteCount);
+	return result;
+}
+char* obj2str(OBJ obj) { return (char *) &FIELD(obj, 0); }
+
+// Loopback broker
+
+// The broker accepts one client. When the client subscribes, the broker sends:
+//	1. a small QoS 1 message (packet ID 1), which should be delivered and acknowledged
+//	2. a QoS 1 message too large for the client (packet ID 2), which should be skipped and
+//	   acknowledged; it is larger than the client's input buffer, so it arrives in pieces
+//	3. a QoS 2 message too large for the client (packet ID 3), which should get a PUBREC
+//	4. a message on a topic the client did not subscribe to, which should not be delivered
+//	5. a QoS 0 message, which should be delivered
+// It records the acknowledgements and messages it receives until the client disconnects.
+
+#define LARGE_PAYLOAD_BYTES 40000
+
+static int brokerSocket;
+static int brokerPort;
+static int pubackReceived[4]; // indexed by packet ID
+static int pubrecReceived[4];
+static char publishReceived[100];
+
+static int readFully(int fd, uint8 *buf, int byteCount) {
+	for (int i = 0; i < byteCount; ) {
+		int n = recv(fd, &buf[i], byteCount - i, 0);
+		if (n <= 0) return false;
+		i += n;
+	}
+	return true;
+}
+
+static int readPacket(int fd, int *type, uint8 *body, int maxBytes) {
+	// Read one packet and return its body size or -1 if the connection was closed.
+
+	uint8 b;
+	if (!readFully(fd, &b, 1)) return -1;
+	*type = b >> 4;
+	int bodyBytes = 0;
+	for (int shift = 0; ; shift += 7) {
+		if (!readFully(fd, &b, 1)) return -1;
+		bodyBytes |= (b & 0x7F) << shift;
+		if (!(b & 0x80)) break;
+	}
+	if ((bodyBytes > maxBytes) || !readFully(fd, body, bodyBytes)) return -1;
+	return bodyBytes;
+}
+
+static void sendPacket(int fd, int type, int flags, uint8 *body, int bodyBytes) {
+	uint8 header[5];
+	int n = 0;
+	header[n++] = (type << 4) | flags;
+	int remaining = bodyBytes;
+	do {
+		header[n] = remaining & 0x7F;
+		remaining >>= 7;
+		if (remaining) header[n] |= 0x80;
+		n++;
+	} while (remaining);
+	send(fd, header, n, 0);
+	for (int i = 0; i < bodyBytes; ) {
+		int sent = send(fd, &body[i], bodyBytes - i, 0);
+		if (sent <= 0) return;
+		i += sent;
+	}
+}
+
+static void sendPublish(int fd, int qos, int packetID, char *topic, char *payload, int payloadBytes) {
+	static uint8 body[LARGE_PAYLOAD_BYTES + 100];
+	int topicLength = strlen(topic);
+	int n = 0;
+	body[n++] = topicLength >> 8;
+	body[n++] = topicLength & 255;
+	memcpy(&body[n], topic, topicLength);
+	n += topicLength;
+	if (qos) {
+		body[n++] = packetID >> 8;
+		body[n++] = packetID & 255;
+	}
+	memcpy(&body[n], payload, payloadBytes);
+	n += payloadBytes;
+	sendPacket(fd, MQTT_PUBLISH, qos << 1, body, n);
+}
+
+static void *runBroker(void *arg) {
+	static char largePayload[LARGE_PAYLOAD_BYTES];
+	memset(largePayload, 'x', sizeof(largePayload));
+
+	int fd = accept(brokerSocket, NULL, NULL);
+	if (fd < 0) return NULL;
+	uint8 body[1024];
+	int type, bodyBytes;
+	while ((bodyBytes = readPacket(fd, &type, body, sizeof(body))) >= 0) {
+		if (MQTT_CONNECT == type) {
+			uint8 connack[2] = { 0, 0 };
+			sendPacket(fd, MQTT_CONNACK, 0, connack, 2);
+		} else if (MQTT_SUBSCRIBE == type) {
+			uint8 suback[3] = { body[0], body[1], 1 };
+			sendPacket(fd, 9, 0, suback, 3);
+			sendPublish(fd, 1, 1, "a/b", "small", 5);
+			sendPublish(fd, 1, 2, "a/b", largePayload, sizeof(largePayload));
+			sendPublish(fd, 2, 3, "a/b", largePayload, 200);
+			sendPublish(fd, 0, 0, "other", "filtered", 8);
+			sendPublish(fd, 0, 0, "a/b", "last", 4);
+		} else if ((MQTT_PUBACK == type) && (bodyBytes >= 2) && (body[1] < 4)) {
+			pubackReceived[body[1]]++;
+		} else if ((MQTT_PUBREC == type) && (bodyBytes >= 2) && (body[1] < 4)) {
+			pubrecReceived[body[1]]++;
+		} else if (MQTT_PUBLISH == type) {
+			int topicLength = (body[0] << 8) | body[1];
+			int payloadStart = 2 + topicLength + 2; // the client publishes with QoS 1
+			snprintf(publishReceived, sizeof(publishReceived), "%.*s %.*s",
+				topicLength, &body[2], bodyBytes - payloadStart, &body[payloadStart]);
+			uint8 puback[2] = { body[2 + topicLength], body[3 + topicLength] };
+			sendPacket(fd, MQTT_PUBACK, 0, puback, 2);
+		} else if (MQTT_PINGREQ == type) {
+			sendPacket(fd, MQTT_PINGRESP, 0, NULL, 0);
+		} else if (MQTT_DISCONNECT == type) {
+			break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static void startBroker(pthread_t *thread) {
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0; // any free port
+	socklen_t addressSize = sizeof(address);
+	brokerSocket = socket(AF_INET, SOCK_STREAM, 0);
+	bind(brokerSocket, (struct sockaddr *) &address, sizeof(address));
+	listen(brokerSocket, 1);
+	getsockname(brokerSocket, (struct sockaddr *) &address, &addressSize);
+	brokerPort = ntohs(address.sin_port);
+	pthread_create(thread, NULL, runBroker, NULL);
+}
+
+// Tests
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+	if (!ok) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+int main() {
+	signal(SIGPIPE, SIG_IGN);
+	pthread_t brokerThread;
+	startBroker(&brokerThread);
+
+	char brokerAddress[50];
+	snprintf(brokerAddress, sizeof(brokerAddress), "127.0.0.1:%d", brokerPort);
+	OBJ args[4];
+	args[0] = newStringFromBytes(brokerAddress, strlen(brokerAddress));
+	args[1] = int2obj(128); // buffer size; larger packets are skipped
+	args[2] = newStringFromBytes("test", 4);
+	primMQTTConnect(3, args);
+	check(trueObj == primMQTTIsConnected(0, NULL), "connects to the broker");
+
+	args[0] = newStringFromBytes("a/b", 3);
+	args[1] = int2obj(1);
+	check(trueObj == primMQTTSub(2, args), "subscribes");
+
+	// receive messages until the last one arrives
+	char received[100] = "";
+	uint32 start = millisecs();
+	while ((millisecs() - start) < 5000) {
+		OBJ event = primMQTTLastEvent(0, NULL);
+		if (falseObj == event) {
+			usleep(1000);
+			continue;
+		}
+		char *payload = obj2str(FIELD(event, 2));
+		strncat(received, payload, sizeof(received) - strlen(received) - 2);
+		strcat(received, " ");
+		if (0 == strcmp(payload, "last")) break;
+	}
+	check(0 == strcmp(received, "small last "), "delivers subscribed messages that fit and skips the rest");
+
+	args[0] = newStringFromBytes("a/out", 5);
+	args[1] = newStringFromBytes("hello", 5);
+	args[2] = falseObj;
+	args[3] = int2obj(1);
+	check(trueObj == primMQTTPub(4, args), "publishes");
+	primMQTTDisconnect(0, NULL);
+	pthread_join(brokerThread, NULL);
+
+	check(1 == pubackReceived[1], "acknowledges a delivered QoS 1 message");
+	check(1 == pubackReceived[2], "acknowledges a skipped QoS 1 message");
+	check(1 == pubrecReceived[3], "acknowledges a skipped QoS 2 message with PUBREC");
+	check(0 == strcmp(publishReceived, "a/out hello"), "broker receives the published message");
+
+	if (failures) {
+		printf("%d test(s) failed\n", failures);
+		return 1;
+	}
+	printf("All MQTT tests passed\n");
+	return 0;
+}
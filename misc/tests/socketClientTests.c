@@ -0,0 +1,158 @@
+// Tests for the Linux VM's socket clients (see "Socket Clients" in linux+pi/linux.c).
+//
+// Two clients connect to the VM's Unix socket. Replies to one client's requests must
+// reach only that client, while other output must reach both.
+//
+// Build and run from this folder (both linux.c and runtime.c define serialConnected();
+// as in the VM build, the linux.c version is used):
+//	gcc -std=gnu99 -D GNUBLOCKS -I ../../vm -I ../../linux+pi socketClientTests.c
+//		../../vm/runtime.c ../../vm/persist.c ../../vm/mem.c -lm
+//		-Wl,--allow-multiple-definition -o socketClientTests
+//	./socketClientTests
+
+#define main linuxMain // the test supplies its own main()
+#include "../../linux+pi/linux.c"
+#undef main
+
+// VM support normally provided by interp.c and the primitive files
+
+CodeChunkRecord chunks[MAX_CHUNKS];
+Task tasks[MAX_TASKS];
+int taskCount = 0;
+OBJ vars[MAX_VARS];
+OBJ lastBroadcast = zeroObj;
+int extraByteDelay = 0;
+int useTFT = false;
+
+OBJ fail(uint8 errCode) { return falseObj; }
+void vmLoop() { }
+void addDataLogPrims() { }
+void addDataPrims() { }
+void addDisplayPrims() { }
+void addFilePrims() { }
+void addIOPrims() { }
+void addMiscPrims() { }
+void addNetPrims() { }
+void addRadioPrims() { }
+void addSensorPrims() { }
+void addTFTPrims() { }
+void addVarPrims() { }
+OBJ primButtonA(OBJ *args) { return falseObj; }
+OBJ primButtonB(OBJ *args) { return falseObj; }
+void primSetUserLED(OBJ *args) { }
+OBJ primMBDisplayOff(int argCount, OBJ *args) { return falseObj; }
+void resetRadio() { }
+void stopTone() { }
+void turnOffInternalNeoPixels() { }
+
+// Test clients
+
+static int connectClient(char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	acceptClients();
+	return fd;
+}
+
+static void sendShortMessage(int fd, int msgType) {
+	uint8 msg[3] = { 0xFA, msgType, 0 };
+	write(fd, msg, sizeof(msg));
+}
+
+static int receivedMessageTypes(int fd, uint8 *types, int maxTypes) {
+	// Read all output waiting for the given client and return the types of the messages in it.
+
+	uint8 buf[10000];
+	int byteCount = 0;
+	int n;
+	while ((n = recv(fd, &buf[byteCount], sizeof(buf) - byteCount, MSG_DONTWAIT)) > 0) byteCount += n;
+
+	int count = 0;
+	for (int i = 0; (i < byteCount) && (count < maxTypes); ) {
+		int size = messageSize(&buf[i], byteCount - i);
+		if (!size) break;
+		types[count++] = (0xFA == buf[i]) || (0xFB == buf[i]) ? buf[i + 1] : 0;
+		i += size;
+	}
+	return count;
+}
+
+static void processMessages() {
+	// Process the messages sent by the clients, giving the VM several chances to read them.
+
+	for (int i = 0; i < 10; i++) {
+		usleep(1000);
+		processMessage();
+	}
+}
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+	if (!ok) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+int main() {
+	char path[100], codePath[100];
+	snprintf(path, sizeof(path), "/tmp/mbSocketTest%d", getpid());
+	snprintf(codePath, sizeof(codePath), "/tmp/mbSocketTestCode%d", getpid());
+	codeFileName = codePath;
+	initTimers();
+	memClear(); // memInit() would reject a 64-bit build; the test does not allocate objects
+	restoreScripts();
+	openUnixSocket(path);
+
+	int ide = connectClient(path);
+	int dashboard = connectClient(path);
+	check(2 == clientCount, "accepts two clients");
+
+	uint8 types[20];
+	sendShortMessage(dashboard, getAllCRCsMsg);
+	processMessages();
+	check((1 == receivedMessageTypes(dashboard, types, 20)) && (allCRCsMsg == types[0]),
+		"requesting client receives its reply");
+	check(0 == receivedMessageTypes(ide, types, 20), "other client does not receive the reply");
+
+	// both clients send requests before the VM reads them
+	sendShortMessage(ide, getVersionMsg);
+	sendShortMessage(dashboard, getAllCRCsMsg);
+	processMessages();
+	check((1 == receivedMessageTypes(ide, types, 20)) && (versionMsg == types[0]),
+		"first client receives only its own reply");
+	check((1 == receivedMessageTypes(dashboard, types, 20)) && (allCRCsMsg == types[0]),
+		"second client receives only its own reply");
+
+	// output not caused by a request goes to every client
+	sendShortMessage(ide, pingMsg);
+	processMessage();
+	usleep(1000);
+	processMessage(); // handles the ping
+	outputString("hello");
+	processMessage(); // sends the output
+	check((2 == receivedMessageTypes(ide, types, 20)) && (pingMsg == types[0]) && (outputValueMsg == types[1]),
+		"requesting client receives its reply and other output");
+	check((1 == receivedMessageTypes(dashboard, types, 20)) && (outputValueMsg == types[0]),
+		"other client receives only the other output");
+
+	close(ide);
+	close(dashboard);
+	unlink(path);
+	unlink(codePath);
+
+	if (failures) {
+		printf("%d test(s) failed\n", failures);
+		return 1;
+	}
+	printf("All socket client tests passed\n");
+	return 0;
+}
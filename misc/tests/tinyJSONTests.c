@@ -91,10 +91,41 @@ static void test4() {
 	}
 }
 
+static int printEvent(tjr_event *event, void *context) {
+	printf("  %*s", 2 * event->depth, "");
+	if (event->key) printf("%.*s: ", (int) (strchr(event->key + 1, '"') - event->key) + 1, event->key);
+	if (event->isEnd) {
+		printf("end (%d items, %d bytes)\n", event->count, event->valueLength);
+	} else if ((tjr_Array == event->type) || (tjr_Object == event->type)) {
+		printf("start\n");
+	} else {
+		printf("%.*s\n", event->valueLength, event->value);
+	}
+	return 0;
+}
+
+static void test5() {
+	// test single-pass parsing
+
+	char json[] = " {\"a\": [1, \"two\", {\"b\": null}], \"c\": true } ";
+	printf("\nEvents from tjr_parse():\n");
+	int length = tjr_parse(json, strlen(json), printEvent, NULL);
+	printf("Parsed %d bytes\n", length);
+
+	char badJSON[] = "[1, 2";
+	printf("Unterminated array: %d\n", tjr_parse(badJSON, strlen(badJSON), NULL, NULL));
+
+	char *literals[] = { "[true, false, null]", "[tru]", "[nul]", "[falsey]", "[nullx]", "[True]" };
+	for (int i = 0; i < 6; i++) {
+		printf("Literals %s: %d\n", literals[i], tjr_parse(literals[i], strlen(literals[i]), NULL, NULL));
+	}
+}
+
 int main() {
  	test1();
  	test2();
  	test3();
  	test4();
+ 	test5();
 	return 0;
 }
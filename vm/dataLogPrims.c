@@ -0,0 +1,330 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Copyright 2026 MicroBlocks contributors
+
+// dataLogPrims.c - Data logger primitives
+//
+// The data logger records timestamped samples of integer values to a file without
+// the cost of formatting and writing each sample as it is taken. Samples are added
+// to a RAM ring buffer. In the background, they are formatted as CSV text or binary
+// records and written to the log file in fixed-size blocks. When the file reaches
+// its maximum size it is rotated: "log.csv" becomes "log.csv.1", "log.csv.1" becomes
+// "log.csv.2", and so on, and the oldest file is deleted. If the ring fills up because
+// the file system cannot keep up, new samples are dropped and counted. The ring and
+// block buffers are allocated when logging starts and freed when it stops.
+//
+// CSV line: <msecs>,<value 1>,...,<value N>
+// Binary record: <msecs (4 bytes)> <value count (1 byte)> <values (4 bytes each)>
+// All multi-byte fields are little endian.
+//
+// File operations are provided by filePrims.cpp or linuxFilePrims.c.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+#include "interp.h"
+
+#if (defined(GNUBLOCKS) && !defined(EMSCRIPTEN)) || \
+	defined(ESP8266) || defined(ESP32) || defined(RP2040_PHILHOWER)
+
+#if defined(GNUBLOCKS)
+	#define LOG_RING_BYTES 65536
+	#define LOG_BLOCK_BYTES 4096
+#elif defined(ESP8266)
+	#define LOG_RING_BYTES 4096
+	#define LOG_BLOCK_BYTES 1024
+#else
+	#define LOG_RING_BYTES 16384
+	#define LOG_BLOCK_BYTES 4096
+#endif
+
+#define LOG_MAX_VALUES 16
+#define LOG_FLUSH_MSECS 5000 // write a partial block if data has been waiting this long
+#define LOG_MAX_FILES 10
+
+// Variables
+
+static char logFileName[32];
+static int logActive = false;
+static int logBinary = false;
+static int logMaxFileBytes = 1024 * 1024;
+static int logMaxFiles = 4;
+static int logFileBytes = 0;
+static int logRotateNeeded = false; // the next sample would not fit in the current file
+
+static uint8 *logRing = NULL; // raw samples in binary record format (LOG_RING_BYTES)
+static int logRingHead = 0; // index of next byte to write
+static int logRingCount = 0; // number of bytes in the ring
+
+static uint8 *logBlock = NULL; // formatted data waiting to be written (LOG_BLOCK_BYTES)
+static int logBlockBytes = 0;
+static uint32 logBlockStartMSecs = 0;
+
+static char logPending[LOG_MAX_VALUES * 12 + 16]; // formatted sample that did not fit in the block
+static int logPendingStart = 0;
+static int logPendingEnd = 0;
+
+static int logSampleCount = 0;
+static int logDroppedCount = 0;
+
+// Ring buffer
+
+static void ringRead(uint8 *dst, int byteCount) {
+	int tail = logRingHead - logRingCount;
+	if (tail < 0) tail += LOG_RING_BYTES;
+	for (int i = 0; i < byteCount; i++) {
+		dst[i] = logRing[tail++];
+		if (tail >= LOG_RING_BYTES) tail = 0;
+	}
+	logRingCount -= byteCount;
+}
+
+static void ringWrite(uint8 *src, int byteCount) {
+	for (int i = 0; i < byteCount; i++) {
+		logRing[logRingHead++] = src[i];
+		if (logRingHead >= LOG_RING_BYTES) logRingHead = 0;
+	}
+	logRingCount += byteCount;
+}
+
+// Formatting
+
+static int formatSample(char *dst) {
+	// Remove the oldest sample from the ring and format it into dst. Return its length.
+
+	uint8 header[5];
+	ringRead(header, 5);
+	int valueCount = header[4];
+	int values[LOG_MAX_VALUES];
+	ringRead((uint8 *) values, 4 * valueCount);
+
+	if (logBinary) {
+		memcpy(dst, header, 5);
+		memcpy(&dst[5], values, 4 * valueCount);
+		return 5 + (4 * valueCount);
+	}
+	uint32 msecs;
+	memcpy(&msecs, header, 4);
+	int count = sprintf(dst, "%lu", (unsigned long) msecs);
+	for (int i = 0; i < valueCount; i++) {
+		count += sprintf(&dst[count], ",%d", values[i]);
+	}
+	dst[count++] = '\n';
+	return count;
+}
+
+// File writing
+
+static void rotateLogFile() {
+	// Close the current log file, shift the older log files, and start a new one.
+
+	char oldName[sizeof(logFileName) + 12], newName[sizeof(logFileName) + 12]; // room for ".<n>"
+	logFileClose();
+	snprintf(oldName, sizeof(oldName), "%s.%d", logFileName, logMaxFiles - 1);
+	logFileRemove(oldName);
+	for (int i = logMaxFiles - 2; i >= 0; i--) {
+		if (i > 0) {
+			snprintf(oldName, sizeof(oldName), "%s.%d", logFileName, i);
+		} else {
+			snprintf(oldName, sizeof(oldName), "%s", logFileName);
+		}
+		snprintf(newName, sizeof(newName), "%s.%d", logFileName, i + 1);
+		logFileRename(oldName, newName);
+	}
+	if (logMaxFiles <= 1) logFileRemove(logFileName);
+	logFileBytes = 0;
+	if (!logFileOpen(logFileName)) logActive = false;
+}
+
+static void writeLogBlock() {
+	if (logBlockBytes) {
+		logFileBytes += logFileWrite(logBlock, logBlockBytes);
+		logBlockBytes = 0;
+	}
+	if (logRotateNeeded) {
+		logRotateNeeded = false;
+		rotateLogFile();
+	}
+}
+
+static void fillLogBlock() {
+	// Move formatted samples into the block until it is full or the ring is empty.
+	// A sample that does not fit in the block is continued in the next block, but
+	// samples are never split across files.
+
+	while ((logBlockBytes < LOG_BLOCK_BYTES) && !logRotateNeeded) {
+		if (logPendingStart >= logPendingEnd) {
+			if (!logRingCount) return;
+			logPendingStart = 0;
+			logPendingEnd = formatSample(logPending);
+		}
+		if ((0 == logPendingStart) && ((logFileBytes + logBlockBytes) > 0) &&
+			((logFileBytes + logBlockBytes + logPendingEnd) > logMaxFileBytes)) {
+				logRotateNeeded = true; // write this sample to the next file
+				return;
+		}
+		int byteCount = logPendingEnd - logPendingStart;
+		if (byteCount > (LOG_BLOCK_BYTES - logBlockBytes)) byteCount = LOG_BLOCK_BYTES - logBlockBytes;
+		if (!logBlockBytes) logBlockStartMSecs = millisecs();
+		memcpy(&logBlock[logBlockBytes], &logPending[logPendingStart], byteCount);
+		logBlockBytes += byteCount;
+		logPendingStart += byteCount;
+	}
+}
+
+static void flushDataLog() {
+	// Write all buffered data, including any partial block.
+
+	while (logActive) {
+		fillLogBlock();
+		if (!logBlockBytes && !logRotateNeeded) break;
+		writeLogBlock();
+	}
+	if (logActive) logFileFlush();
+}
+
+void dataLogStep() {
+	// Called periodically from the VM loop. Write at most one block to keep latency low.
+
+	if (!logActive) return;
+	fillLogBlock();
+	if ((logBlockBytes >= LOG_BLOCK_BYTES) || logRotateNeeded) {
+		writeLogBlock();
+	} else if ((logBlockBytes > 0) && ((millisecs() - logBlockStartMSecs) >= LOG_FLUSH_MSECS)) {
+		writeLogBlock();
+		if (logActive) logFileFlush();
+	}
+}
+
+// Primitives
+
+static OBJ primLogStop(int argCount, OBJ *args) {
+	if (logActive) {
+		flushDataLog();
+		logFileClose();
+	}
+	logActive = false;
+	free(logRing);
+	free(logBlock);
+	logRing = logBlock = NULL;
+	logRingCount = 0;
+	logBlockBytes = 0;
+	logPendingStart = logPendingEnd = 0;
+	logRotateNeeded = false;
+	return falseObj;
+}
+
+static OBJ primLogStart(int argCount, OBJ *args) {
+	// Start logging to the given file. Optional arguments: format ("csv" or "binary",
+	// default "csv"), maximum file size in bytes (default 1 MB), and number of files to
+	// keep including the current one (default 4). Return true on success.
+
+	if (argCount < 1) return fail(notEnoughArguments);
+	if (!IS_TYPE(args[0], StringType)) return fail(needsStringError);
+	primLogStop(0, NULL);
+
+	char *fileName = obj2str(args[0]);
+	if (!fileName[0] || (strlen(fileName) > (sizeof(logFileName) - 4))) return falseObj;
+	strcpy(logFileName, fileName);
+	logBinary = (argCount > 1) && IS_TYPE(args[1], StringType) && (0 == strcmp(obj2str(args[1]), "binary"));
+	logMaxFileBytes = ((argCount > 2) && isInt(args[2])) ? obj2int(args[2]) : 1024 * 1024;
+	if (logMaxFileBytes < LOG_BLOCK_BYTES) logMaxFileBytes = LOG_BLOCK_BYTES;
+	logMaxFiles = ((argCount > 3) && isInt(args[3])) ? obj2int(args[3]) : 4;
+	if (logMaxFiles < 1) logMaxFiles = 1;
+	if (logMaxFiles > LOG_MAX_FILES) logMaxFiles = LOG_MAX_FILES;
+
+	logRing = malloc(LOG_RING_BYTES);
+	logBlock = malloc(LOG_BLOCK_BYTES);
+	if (!logRing || !logBlock) {
+		primLogStop(0, NULL);
+		return fail(insufficientMemoryError);
+	}
+	if (!logFileOpen(logFileName)) {
+		primLogStop(0, NULL);
+		return falseObj;
+	}
+	logFileBytes = logFileSize();
+	logSampleCount = logDroppedCount = 0;
+	logActive = true;
+	return trueObj;
+}
+
+static OBJ primLogSample(int argCount, OBJ *args) {
+	// Record a timestamped sample of up to 16 integer values. Return false if the sample
+	// was dropped because the file system could not keep up or logging is not active.
+
+	if (!logActive) return falseObj;
+	if (argCount > LOG_MAX_VALUES) argCount = LOG_MAX_VALUES;
+	int values[LOG_MAX_VALUES];
+	for (int i = 0; i < argCount; i++) {
+		OBJ arg = args[i];
+		if (isInt(arg)) {
+			values[i] = obj2int(arg);
+		} else if (isBoolean(arg)) {
+			values[i] = (trueObj == arg);
+		} else {
+			return fail(needsIntegerError);
+		}
+	}
+	int sampleBytes = 5 + (4 * argCount);
+	if ((logRingCount + sampleBytes) > LOG_RING_BYTES) {
+		logDroppedCount++;
+		return falseObj;
+	}
+	uint8 header[5];
+	uint32 msecs = millisecs();
+	memcpy(header, &msecs, 4);
+	header[4] = argCount;
+	ringWrite(header, 5);
+	ringWrite((uint8 *) values, 4 * argCount);
+	logSampleCount++;
+	return trueObj;
+}
+
+static OBJ primLogFlush(int argCount, OBJ *args) {
+	flushDataLog();
+	return falseObj;
+}
+
+static OBJ primLogStatus(int argCount, OBJ *args) {
+	// Return a list: [active, samples logged, samples dropped, bytes buffered].
+
+	OBJ result = newObj(ListType, 5, zeroObj);
+	if (!result) return result; // insufficient memory
+	FIELD(result, 0) = int2obj(4);
+	FIELD(result, 1) = logActive ? trueObj : falseObj;
+	FIELD(result, 2) = int2obj(logSampleCount);
+	FIELD(result, 3) = int2obj(logDroppedCount);
+	FIELD(result, 4) = int2obj(logRingCount + logBlockBytes);
+	return result;
+}
+
+#else // no file system
+
+void dataLogStep() { }
+
+static OBJ primLogStart(int argCount, OBJ *args) { return falseObj; }
+static OBJ primLogSample(int argCount, OBJ *args) { return falseObj; }
+static OBJ primLogFlush(int argCount, OBJ *args) { return falseObj; }
+static OBJ primLogStop(int argCount, OBJ *args) { return falseObj; }
+static OBJ primLogStatus(int argCount, OBJ *args) { return falseObj; }
+
+#endif
+
+// Primitives
+
+static PrimEntry entries[] = {
+	{"start", primLogStart},
+	{"log", primLogSample},
+	{"flush", primLogFlush},
+	{"stop", primLogStop},
+	{"status", primLogStatus},
+};
+
+void addDataLogPrims() {
+	addPrimitiveSet("dataLog", sizeof(entries) / sizeof(PrimEntry), entries);
+}
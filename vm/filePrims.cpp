@@ -278,6 +278,52 @@ static OBJ primAppendBytes(int argCount, OBJ *args) {
 	return falseObj;
 }
 
+// Data logger file operations (called from dataLogPrims.c)
+
+static File logFile;
+
+static char *logFilePath(const char *fileName) {
+	if ('/' == fileName[0]) return (char *) fileName;
+	snprintf(fullPath, 31, "/%s", fileName);
+	return fullPath;
+}
+
+int logFileOpen(const char *fileName) {
+	char *path = logFilePath(fileName);
+	closeIfOpen(path);
+	logFile = myFS.open(path, "a");
+	return logFile ? true : false;
+}
+
+int logFileWrite(uint8 *data, int byteCount) {
+	return logFile ? logFile.write(data, byteCount) : 0;
+}
+
+int logFileSize() {
+	return logFile ? logFile.size() : 0;
+}
+
+void logFileFlush() {
+	if (logFile) logFile.flush();
+}
+
+void logFileClose() {
+	if (logFile) logFile.close();
+}
+
+void logFileRename(const char *oldName, const char *newName) {
+	char oldPath[32];
+	strncpy(oldPath, logFilePath(oldName), 31);
+	oldPath[31] = '\0';
+	char *newPath = logFilePath(newName);
+	if (myFS.exists(oldPath)) myFS.rename(oldPath, newPath);
+}
+
+void logFileRemove(const char *fileName) {
+	char *path = logFilePath(fileName);
+	if (myFS.exists(path)) myFS.remove(path);
+}
+
 // File list
 
 // Root directory used for listing files
@@ -14,6 +14,10 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef GNUBLOCKS
+#include "../linux+pi/linux.h"
+#endif
+
 #include "mem.h"
 #include "interp.h"
 #include "persist.h"
@@ -140,6 +144,22 @@ OBJ primBroadcastToIDEOnly(int argCount, OBJ *args) {
 
 // Timer
 
+#if defined(GNUBLOCKS) && !defined(EMSCRIPTEN)
+
+// The Linux VM has a 64-bit microsecond clock, so the timer does not wrap.
+
+static uint64_t timerStart = 0;
+
+static void resetTimer() { timerStart = totalMicrosecs(); }
+
+static int timer() {
+	// Return the number of milliseconds since the timer was last reset.
+
+	return (int) ((totalMicrosecs() - timerStart) / 1000);
+}
+
+#else
+
 static uint32 timerStart = 0;
 
 static void resetTimer() { timerStart = millisecs(); }
@@ -160,6 +180,8 @@ static int timer() {
 	return now - timerStart;
 }
 
+#endif
+
 // String Access
 
 static inline char * nextUTF8(char *s) {
@@ -317,8 +339,10 @@ static int functionNameMatches(int chunkIndex, char *functionName) {
 	// by checking the function name in the function's metadata.
 
 	const uint32 META_FLAG = 240;
-	uint32 wordCount = ((uint32 *) chunks[chunkIndex].code)[1];
-	uint32 *code = (uint32 *) chunks[chunkIndex].code + PERSISTENT_HEADER_WORDS;
+	OBJ chunkCode = expandedChunkCode(chunkIndex);
+	if (!chunkCode) return false;
+	uint32 wordCount = ((uint32 *) chunkCode)[1];
+	uint32 *code = (uint32 *) chunkCode + PERSISTENT_HEADER_WORDS;
 	int metaStart = -1;
 	for (int i = 0; i < wordCount; i++) {
 		if (META_FLAG == code[i]) {
@@ -695,13 +719,20 @@ static void runTask(Task *task) {
 			fail(badChunkIndexError);
 			goto error;
 		}
+		#ifdef COMPRESS_CHUNKS
+			task->sp = sp - task->stack; // record the stack pointer so expansion can see literals on the stack
+			if (!expandedChunkCode(tmp)) { // expand callee before changing any state
+				fail(insufficientMemoryError);
+				goto error;
+			}
+		#endif
 		STACK_CHECK(3);
 		*sp++ = int2obj(arg & 0xFF); // # of arguments (low byte of arg)
 		*sp++ = int2obj(((ip - task->code) << 8) | (task->currentChunkIndex & 0xFF)); // return address
 		*sp++ = int2obj(fp - task->stack); // old fp
 		fp = sp;
 		task->currentChunkIndex = tmp; // callee's chunk index (middle byte of arg)
-		task->code = chunks[task->currentChunkIndex].code;
+		task->code = expandedChunkCode(task->currentChunkIndex);
 		ip = task->code + PERSISTENT_HEADER_WORDS; // first instruction in callee
 		DISPATCH();
 	returnResult_op:
@@ -719,7 +750,17 @@ static void runTask(Task *task) {
 		*sp++ = tmpObj; // push return value (no need for a stack check; just recovered at least 3 words from the old call frame)
 		tmp = obj2int(*(fp - 2)); // return address
 		task->currentChunkIndex = tmp & 0xFF;
-		task->code = chunks[task->currentChunkIndex].code;
+		#ifdef COMPRESS_CHUNKS
+			task->sp = sp - task->stack; // record the stack pointer so expansion can see literals on the stack
+		#endif
+		task->code = expandedChunkCode(task->currentChunkIndex);
+		#ifdef COMPRESS_CHUNKS
+			if (!task->code) { // could not expand caller's code
+				task->code = ip;
+				fail(insufficientMemoryError);
+				goto error;
+			}
+		#endif
 		ip = task->code + ((tmp >> 8) & 0x3FFFFF); // restore old ip
 		fp = task->stack + obj2int(*(fp - 1)); // restore the old fp
 		DISPATCH();
@@ -1289,6 +1330,13 @@ void vmLoop() {
 			#endif
 			checkButtons();
 			processMessage();
+			dataLogStep(); // write buffered data logger samples
+			#ifndef EMSCRIPTEN // Boardie has no network primitives
+				netStep(); // service network connections
+			#endif
+			#if defined(GNUBLOCKS) && !defined(EMSCRIPTEN) // Boardie has no code file
+				flushCodeFile(); // commit pending code file records as a group
+			#endif
 			count = 25; // must be under 30 when building on mbed to avoid serial errors
 		}
 		int runCount = 0;
@@ -1313,10 +1361,10 @@ void vmLoop() {
 				break;
 			}
 		}
-#ifdef GNUBLOCKS
-		if (!runCount) { // no active tasks; consider taking a nap
+#if defined(GNUBLOCKS) && !defined(EMSCRIPTEN) // Boardie runs tasks from interpretStep()
+		if (!runCount) { // no active tasks; sleep until the next wake time or an I/O event
 			if (!usecs) usecs = microsecs(); // get usecs
-			int sleepUSecs = 500;
+			int sleepUSecs = 10000; // upper limit keeps SDL events and button polling responsive
 			for (int i = 0; i < taskCount; i++) {
 				Task *task = &tasks[i];
 				if (waiting_micros == task->status) {
@@ -1326,7 +1374,10 @@ void vmLoop() {
 					}
 				}
 			}
-			if (sleepUSecs > 5) usleep(sleepUSecs); // nap a while to relinquish the CPU
+			if (sleepUSecs > 5) {
+				sleepUntilEvent(sleepUSecs); // relinquish the CPU
+				count = -1; // handle messages and background tasks right after waking
+			}
 		}
 #endif
 	}
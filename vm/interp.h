@@ -143,6 +143,10 @@ extern int extraByteDelay;
 #define chunkAttributeMsg		28
 #define varNameMsg				29
 #define extendedMsg				30
+#define chunkBatchMsg			31	// IDE -> Board only
+#define watchVarsMsg			32	// IDE -> Board only
+#define varValuesMsg			33	// Board -> IDE only
+#define telemetryMsg			34	// Board -> IDE only
 
 // Serial Protocol Messages: CRC Exchange
 
@@ -201,6 +205,9 @@ void startReceiversOfBroadcast(char *msg, int byteCount);
 void processMessage(void);
 int hasOutputSpace(int byteCount);
 void logData(char *s);
+int addTelemetrySample(int valueCount, int *values);
+void dataLogStep(void);
+void netStep(void);
 void outputString(const char *s);
 void sendTaskDone(uint8 chunkIndex);
 void sendTaskError(uint8 chunkIndex, uint8 errorCode, int where);
@@ -216,6 +223,7 @@ void processFileMessage(int msgType, int dataSize, char *data);
 void waitAndSendMessage(int msgType, int chunkIndex, int dataSize, char *data);
 void suspendCodeFileUpdates();
 void resumeCodeFileUpdates();
+int codeFileUpdatesSuspended();
 
 // Integer Evaluation
 
@@ -252,7 +260,7 @@ uint32 millisecs(void);
 
 int serialConnected();
 int recvBytes(uint8 *buf, int count);
-int sendByte(char aByte);
+int sendBytes(uint8 *buf, int start, int end);
 void restartSerial();
 
 const char *boardType();
@@ -329,9 +337,20 @@ void tftClear();
 void tftSetHugePixel(int x, int y, int state);
 void tftSetHugePixelBits(int bits);
 
+// Data Logger File Operations (provided by the file primitives)
+
+int logFileOpen(const char *fileName); // open for appending; return true on success
+int logFileWrite(uint8 *data, int byteCount); // return the number of bytes written
+int logFileSize(void);
+void logFileFlush(void);
+void logFileClose(void);
+void logFileRename(const char *oldName, const char *newName);
+void logFileRemove(const char *fileName);
+
 // Primitive Sets
 
 void addDataPrims();
+void addDataLogPrims();
 void addDisplayPrims();
 void addFilePrims();
 void addIOPrims();
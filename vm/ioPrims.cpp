@@ -112,14 +112,14 @@ int recvBytes(uint8 *buf, int count) {
 	return bytesRead;
 }
 
-int sendByte(char aByte) {
+int sendBytes(uint8 *buf, int start, int end) {
 	#ifdef ARDUINO_ARCH_RP2040
 		// Workaround for Pico Arduino bug (both mbed and Philhower):
-		// Serial.write() should return 1 if byte is written but always returns 0 on Pico
-		Serial.write(aByte);
-		return 1; // assume byte was actually written
+		// Serial.write() should return the number of bytes written but always returns 0 on Pico
+		Serial.write(&buf[start], end - start);
+		return end - start; // assume bytes were actually written
 	#else
-		return Serial.write(aByte);
+		return Serial.write(&buf[start], end - start);
 	#endif
 }
 
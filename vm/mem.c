@@ -472,3 +472,41 @@ void gc() {
 	sprintf(s, "GC took %d usecs; free %d words", usecs, WORDS(freeChunk) - 2);
 	outputString(s);
 }
+
+// References to Objects Outside the Object Store
+
+static int inRange(OBJ obj, int *start, int *end) {
+	return !isInt(obj) && (start <= obj) && (obj < end);
+}
+
+int isReferenced(int *start, int *end) {
+	// Return true if a GC root or the field of any object in the object store points into the
+	// given address range. Used to find literal objects in expanded code that are still in use.
+	// The object store is scanned conservatively, so references from garbage objects count.
+
+	for (int i = 0; i < MAX_VARS; i++) {
+		if (inRange(vars[i], start, end)) return true;
+	}
+	if (inRange(lastBroadcast, start, end) || inRange(tempGCRoot, start, end)) return true;
+
+	for (int i = 0; i < taskCount; i++) {
+		Task *task = &tasks[i];
+		if (task->status != unusedTask) {
+			for (int j = task->sp - 1; j >= 0; j--) {
+				if (inRange(task->stack[j], start, end)) return true;
+			}
+		}
+	}
+
+	uint32 *objEnd = (uint32 *) &objstore[OBJSTORE_WORDS];
+	uint32 *next = (uint32 *) objstore + 1;
+	while (next < objEnd) {
+		if (TYPE(next) > BinaryObjectTypes) { // non-free chunk with OBJ fields (not a string)
+			for (int i = WORDS(next); i > 0; i--) {
+				if (inRange((OBJ) next[i], start, end)) return true;
+			}
+		}
+		next += WORDS(next) + 2;
+	}
+	return false;
+}
@@ -131,6 +131,7 @@ void memInit();
 void memClear();
 int wordsFree();
 void gc();
+int isReferenced(int *start, int *end);
 
 OBJ newObj(int typeID, int wordCount, OBJ fill);
 OBJ resizeObj(OBJ obj, int wordCount);
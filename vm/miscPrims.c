@@ -8,6 +8,7 @@
 // John Maloney, May 2019
 
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -47,21 +48,55 @@ static OBJ primSine(int argCount, OBJ *args) {
 	return int2obj((int) round(16384.0 * sin(evalInt(args[0]) * hundrethsToRadians)));
 }
 
-static OBJ jsonValue(char *item) {
-	char buf[1024];
-	char *end;
-	if (!item) return newString(0); // path not found
+static int jsonDecodedChar(char **p, char *end) {
+	// Return the next character of the JSON string at *p and advance *p, or -1 at the
+	// closing quote. Escapes are handled as in tjr_readStringInto().
+
+	if ((*p >= end) || ('"' == **p) || ('\0' == **p)) return -1;
+	int ch = *(*p)++;
+	if (('\\' == ch) && (*p < end)) {
+		ch = *(*p)++;
+		if ('b' == ch) ch = '\b';
+		if ('f' == ch) ch = '\f';
+		if ('n' == ch) ch = '\n';
+		if ('r' == ch) ch = '\r';
+		if ('t' == ch) ch = '\t';
+	}
+	return ch;
+}
+
+static OBJ jsonValueAt(OBJ *jsonArg, int offset, int length) {
+	// Return the value at the given offset in the JSON string or ByteArray *jsonArg.
+	// jsonArg must be a GC root (e.g. a primitive argument) since allocating the result
+	// may move the JSON object.
+
+	OBJ result;
+	char *item = (char *) &FIELD(*jsonArg, 0) + offset;
+	char *end = item + length;
+	char buf[16];
 
 	switch (tjr_type(item)) {
 	case tjr_Array:
 	case tjr_Object:
-		end = tjr_endOfItem(item);
-		return newStringFromBytes(item, (end - item));
+		result = newString(length);
+		if (!result) return result; // insufficient memory
+		memcpy(obj2str(result), (char *) &FIELD(*jsonArg, 0) + offset, length);
+		return result;
 	case tjr_Number:
-		return int2obj(tjr_readInteger(item));
+		if (length >= (int) sizeof(buf)) length = sizeof(buf) - 1;
+		memcpy(buf, item, length);
+		buf[length] = '\0';
+		return int2obj(tjr_readInteger(buf));
 	case tjr_String:
-		tjr_readStringInto(item, buf, sizeof(buf));
-		return newStringFromBytes(buf, strlen(buf));
+		result = newString(length); // decoded string is never longer than the JSON string
+		if (!result) return result; // insufficient memory
+		item = (char *) &FIELD(*jsonArg, 0) + offset + 1; // skip opening quote
+		end = (char *) &FIELD(*jsonArg, 0) + offset + length;
+		char *dst = obj2str(result);
+		int ch;
+		while ((ch = jsonDecodedChar(&item, end)) >= 0) *dst++ = ch;
+		*dst = '\0';
+		return result;
 	case tjr_True:
 		return trueObj;
 	case tjr_False:
@@ -72,6 +107,13 @@ static OBJ jsonValue(char *item) {
 	return newString(0); // json parse error or end
 }
 
+static OBJ jsonValue(OBJ *jsonArg, char *item) {
+	if (!item) return newString(0); // path not found
+	while (*item && (*item <= ' ')) item++; // skip whitespace
+	int length = tjr_endOfItem(item) - item;
+	return jsonValueAt(jsonArg, item - obj2str(*jsonArg), length);
+}
+
 static OBJ primJSONGet(int argCount, OBJ *args) {
 	// Return the value at the given path in a JSON string or the empty string
 	// if the path doesn't refer to anything. The optional third argument returns
@@ -97,7 +139,7 @@ static OBJ primJSONGet(int argCount, OBJ *args) {
 			item = tjr_nextElement(item); // skip value
 		}
 	}
-	return jsonValue(item);
+	return jsonValue(&args[0], item);
 }
 
 static OBJ primJSONCount(int argCount, OBJ *args) {
@@ -125,7 +167,7 @@ static OBJ primJSONValueAt(int argCount, OBJ *args) {
 	int i = obj2int(args[2]);
 
 	char *item = tjr_atPath(json, path);
-	return jsonValue(tjr_valueAt(item, i));
+	return jsonValue(&args[0], tjr_valueAt(item, i));
 }
 
 static OBJ primJSONKeyAt(int argCount, OBJ *args) {
@@ -146,6 +188,394 @@ static OBJ primJSONKeyAt(int argCount, OBJ *args) {
 	return newStringFromBytes(key, strlen(key));
 }
 
+// JSON Index
+
+// jsonIndex walks a JSON document once with tjr_parse() and returns an index: a ByteArray
+// containing a hash table that maps the path of every value (in the form used by jsonGet,
+// e.g. "shape.points.1.x") to its offset and length in the document. After that, values
+// can be looked up with jsonIndexGet in constant time. The index holds offsets, not
+// pointers, so it remains valid when the JSON object is moved by the garbage collector.
+//
+// Index layout (32-bit words):
+//	<entry count> <slot count> <JSON length>
+//	entries of JSON_ENTRY_WORDS words each (see below)
+//	hash table slots, each holding an entry index + 1, or zero if the slot is empty
+//
+// An entry's key is the offset of its property name in the JSON or, for array elements,
+// the negated one-based array index. Entry 0 is the top-level value.
+
+#define JSON_INDEX_HEADER_WORDS 3
+#define JSON_ENTRY_WORDS 6
+enum { entryHash, entryOffset, entryLength, entryKey, entryParent, entryCount };
+
+#define FNV_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+typedef struct {
+	char *json;
+	int *entries; // NULL when just counting entries
+	int entryCount;
+	uint32 hashes[TJR_MAX_DEPTH]; // path hashes of the enclosing arrays and objects
+	int parents[TJR_MAX_DEPTH]; // entry indices of the enclosing arrays and objects
+} JSONIndexBuilder;
+
+static inline uint32 hashByte(uint32 hash, int byte) {
+	return (hash ^ (uint8) byte) * FNV_PRIME;
+}
+
+static int jsonBytes(OBJ obj, char **bytes) {
+	// Set bytes to the contents of a String or ByteArray and return its length.
+	// Return -1 if obj is neither.
+
+	if (IS_TYPE(obj, StringType)) {
+		*bytes = obj2str(obj);
+		return strlen(*bytes);
+	}
+	if (IS_TYPE(obj, ByteArrayType)) {
+		*bytes = (char *) &FIELD(obj, 0);
+		return BYTES(obj);
+	}
+	return -1;
+}
+
+static int indexJSONValue(tjr_event *event, void *context) {
+	// tjr_parse() handler that records an index entry for every value.
+
+	JSONIndexBuilder *builder = (JSONIndexBuilder *) context;
+	int depth = event->depth;
+	if (event->isEnd) {
+		if (builder->entries) {
+			int *entry = &builder->entries[JSON_ENTRY_WORDS * builder->parents[depth]];
+			entry[entryLength] = event->valueLength;
+			entry[entryCount] = event->count;
+		}
+		return false;
+	}
+
+	uint32 hash = FNV_BASIS;
+	if (depth > 0) {
+		hash = hashByte(builder->hashes[depth - 1], '.');
+		if (event->key) {
+			char *p = event->key + 1; // skip opening quote
+			int ch;
+			while ((ch = jsonDecodedChar(&p, event->value)) >= 0) hash = hashByte(hash, ch);
+		} else {
+			char digits[12];
+			sprintf(digits, "%d", event->index);
+			for (char *p = digits; *p; p++) hash = hashByte(hash, *p);
+		}
+	}
+	if (builder->entries) {
+		int *entry = &builder->entries[JSON_ENTRY_WORDS * builder->entryCount];
+		entry[entryHash] = hash;
+		entry[entryOffset] = event->value - builder->json;
+		entry[entryLength] = event->valueLength;
+		entry[entryKey] = event->key ? (event->key - builder->json) : -event->index;
+		entry[entryParent] = (depth > 0) ? builder->parents[depth - 1] : -1;
+		entry[entryCount] = 0;
+	}
+	if ((tjr_Array == event->type) || (tjr_Object == event->type)) {
+		builder->hashes[depth] = hash;
+		builder->parents[depth] = builder->entryCount;
+	}
+	builder->entryCount++;
+	return false;
+}
+
+static int componentMatches(int *entry, char *json, int jsonLength, char *component, int length) {
+	// Return true if the given path component matches the key or array index of entry.
+
+	int key = entry[entryKey];
+	if (key >= jsonLength) return false; // damaged index
+	if (key < 0) { // array element; component must be a decimal index
+		if (length <= 0) return false;
+		int index = 0;
+		for (int i = 0; i < length; i++) {
+			if ((component[i] < '0') || (component[i] > '9')) return false;
+			index = (10 * index) + (component[i] - '0');
+		}
+		return index == -key;
+	}
+	char *p = json + key + 1; // skip opening quote
+	char *end = json + jsonLength;
+	int ch;
+	for (int i = 0; i < length; i++) {
+		ch = jsonDecodedChar(&p, end);
+		if (ch != (uint8) component[i]) return false;
+	}
+	return jsonDecodedChar(&p, end) < 0; // key must end here
+}
+
+static int validJSONIndex(OBJ index, int jsonLength) {
+	// Return true if index has the layout made by jsonIndex for a JSON document of the
+	// given length. An index is an ordinary ByteArray, so check it before probing.
+
+	int words = WORDS(index);
+	if (words < JSON_INDEX_HEADER_WORDS) return false;
+	int *header = (int *) &FIELD(index, 0);
+	int count = header[0];
+	int slotCount = header[1];
+	if ((count < 0) || (count > (words / JSON_ENTRY_WORDS))) return false;
+	if ((slotCount <= count) || (slotCount & (slotCount - 1))) return false; // must be a power of two larger than count
+	if (words != (JSON_INDEX_HEADER_WORDS + (JSON_ENTRY_WORDS * count) + slotCount)) return false;
+	return header[2] == jsonLength;
+}
+
+static int *jsonIndexLookup(OBJ index, char *json, int jsonLength, char *path) {
+	// Return the entry for the given path or NULL if the path does not exist.
+	// Assume the index layout has been checked by validJSONIndex().
+
+	int *header = (int *) &FIELD(index, 0);
+	int *entries = header + JSON_INDEX_HEADER_WORDS;
+	int count = header[0];
+	if (!count) return NULL; // empty index
+	if (!path[0]) return entries; // empty path; top-level value
+
+	uint32 hash = FNV_BASIS;
+	for (char *p = path; *p; p++) {
+		if (p == path) hash = hashByte(hash, '.');
+		hash = hashByte(hash, *p);
+	}
+	int slotCount = header[1];
+	int *slots = entries + (JSON_ENTRY_WORDS * count);
+	int pathLength = strlen(path);
+	int i = hash & (slotCount - 1);
+	for (int probes = 0; (probes < slotCount) && slots[i]; probes++, i = (i + 1) & (slotCount - 1)) {
+		if ((slots[i] < 0) || (slots[i] > count)) return NULL; // damaged index
+		int *entry = &entries[JSON_ENTRY_WORDS * (slots[i] - 1)];
+		if ((uint32) entry[entryHash] != hash) continue;
+
+		// verify the path, comparing components from last to first
+		int *e = entry;
+		int componentEnd = pathLength;
+		while ((e[entryParent] >= 0) && (componentEnd >= 0)) {
+			int componentStart = componentEnd;
+			while ((componentStart > 0) && ('.' != path[componentStart - 1])) componentStart--;
+			if (!componentMatches(e, json, jsonLength, &path[componentStart], componentEnd - componentStart)) break;
+			componentEnd = componentStart - 1;
+			if (e[entryParent] >= count) return NULL; // damaged index
+			e = &entries[JSON_ENTRY_WORDS * e[entryParent]];
+		}
+		if ((e[entryParent] < 0) && (componentEnd < 0)) return entry;
+	}
+	return NULL;
+}
+
+static OBJ primJSONIndex(int argCount, OBJ *args) {
+	// Return an index for the given JSON String or ByteArray, or false if it is not valid JSON.
+
+	if (argCount < 1) return fail(notEnoughArguments);
+	char *json;
+	int jsonLength = jsonBytes(args[0], &json);
+	if (jsonLength < 0) return fail(needsStringError);
+
+	// count the entries
+	JSONIndexBuilder builder;
+	memset(&builder, 0, sizeof(builder));
+	builder.json = json;
+	if (tjr_parse(json, jsonLength, indexJSONValue, &builder) < 0) return falseObj;
+	int count = builder.entryCount;
+	int slotCount = 4;
+	while (slotCount < (2 * count)) slotCount *= 2;
+
+	OBJ result = newObj(ByteArrayType, JSON_INDEX_HEADER_WORDS + (JSON_ENTRY_WORDS * count) + slotCount, zeroObj);
+	if (!result) return result; // insufficient memory
+	jsonBytes(args[0], &json); // allocation may have moved the JSON object
+
+	// record the entries
+	int *header = (int *) &FIELD(result, 0);
+	int *entries = header + JSON_INDEX_HEADER_WORDS;
+	header[0] = count;
+	header[1] = slotCount;
+	header[2] = jsonLength;
+	memset(&builder, 0, sizeof(builder));
+	builder.json = json;
+	builder.entries = entries;
+	tjr_parse(json, jsonLength, indexJSONValue, &builder);
+
+	// build the hash table
+	int *slots = entries + (JSON_ENTRY_WORDS * count);
+	for (int i = 0; i < count; i++) {
+		int slot = entries[(JSON_ENTRY_WORDS * i) + entryHash] & (slotCount - 1);
+		while (slots[slot]) slot = (slot + 1) & (slotCount - 1);
+		slots[slot] = i + 1;
+	}
+	return result;
+}
+
+static int *jsonIndexEntry(OBJ *args, char **json, int *jsonLength) {
+	// Return the index entry for the path in args[2] or NULL if not found.
+	// args[0] is the index and args[1] is the JSON String or ByteArray it was built from.
+
+	if (!IS_TYPE(args[0], ByteArrayType)) { fail(needsByteArray); return NULL; }
+	*jsonLength = jsonBytes(args[1], json);
+	if (*jsonLength < 0) { fail(needsStringError); return NULL; }
+	if (!IS_TYPE(args[2], StringType)) { fail(needsStringError); return NULL; }
+	if (!validJSONIndex(args[0], *jsonLength)) return NULL; // not an index for this JSON
+	int *entry = jsonIndexLookup(args[0], *json, *jsonLength, obj2str(args[2]));
+	if (entry && ((entry[entryOffset] < 0) || (entry[entryLength] < 0) ||
+		(entry[entryOffset] > (*jsonLength - entry[entryLength])))) {
+			return NULL; // damaged index
+	}
+	return entry;
+}
+
+static OBJ primJSONIndexGet(int argCount, OBJ *args) {
+	// Return the value at the given path using an index made by jsonIndex or the empty
+	// string if the path doesn't refer to anything.
+
+	if (argCount < 3) return fail(notEnoughArguments);
+	char *json;
+	int jsonLength;
+	int *entry = jsonIndexEntry(args, &json, &jsonLength);
+	if (!entry) return newString(0);
+	return jsonValueAt(&args[1], entry[entryOffset], entry[entryLength]);
+}
+
+static OBJ primJSONIndexCount(int argCount, OBJ *args) {
+	// Return the number of entries in the array or object at the given path using an
+	// index made by jsonIndex.
+
+	if (argCount < 3) return fail(notEnoughArguments);
+	char *json;
+	int jsonLength;
+	int *entry = jsonIndexEntry(args, &json, &jsonLength);
+	return int2obj(entry ? entry[entryCount] : 0);
+}
+
+// JSON Encoding
+
+// jsonEncode converts a MicroBlocks value to a JSON string. Lists become JSON arrays,
+// ByteArrays become arrays of numbers, and values that have no JSON equivalent become
+// null. The size of the result is computed first so the result string is allocated once.
+
+static int jsonEncodedSize(OBJ obj, int depth) {
+	// Return the number of bytes needed to encode obj or -1 if it is nested too deeply.
+
+	if (depth > TJR_MAX_DEPTH) return -1;
+	if (isInt(obj)) {
+		char digits[12];
+		return sprintf(digits, "%d", obj2int(obj));
+	}
+	if (trueObj == obj) return 4;
+	if (falseObj == obj) return 5;
+	if (IS_TYPE(obj, StringType)) {
+		int size = 2; // quotes
+		for (uint8 *p = (uint8 *) obj2str(obj); *p; p++) {
+			int ch = *p;
+			if (('"' == ch) || ('\\' == ch) || ('\b' == ch) || ('\f' == ch) ||
+				('\n' == ch) || ('\r' == ch) || ('\t' == ch)) {
+					size += 2;
+			} else if (ch < ' ') {
+				size += 6; // \uHHHH
+			} else {
+				size += 1;
+			}
+		}
+		return size;
+	}
+	if (IS_TYPE(obj, ByteArrayType)) {
+		int count = BYTES(obj);
+		uint8 *bytes = (uint8 *) &FIELD(obj, 0);
+		int size = 2 + ((count > 0) ? count - 1 : 0); // brackets and commas
+		for (int i = 0; i < count; i++) size += (bytes[i] < 10) ? 1 : ((bytes[i] < 100) ? 2 : 3);
+		return size;
+	}
+	if (IS_TYPE(obj, ListType)) {
+		int count = obj2int(FIELD(obj, 0));
+		int size = 2 + ((count > 0) ? count - 1 : 0); // brackets and commas
+		for (int i = 1; i <= count; i++) {
+			int itemSize = jsonEncodedSize(FIELD(obj, i), depth + 1);
+			if (itemSize < 0) return -1;
+			size += itemSize;
+		}
+		return size;
+	}
+	return 4; // null
+}
+
+static char * jsonEncode(char *dst, OBJ obj) {
+	// Write the JSON encoding of obj to dst and return a pointer to the following byte.
+
+	if (isInt(obj)) return dst + sprintf(dst, "%d", obj2int(obj));
+	if (trueObj == obj) { memcpy(dst, "true", 4); return dst + 4; }
+	if (falseObj == obj) { memcpy(dst, "false", 5); return dst + 5; }
+	if (IS_TYPE(obj, StringType)) {
+		*dst++ = '"';
+		for (uint8 *p = (uint8 *) obj2str(obj); *p; p++) {
+			int ch = *p;
+			switch (ch) {
+			case '"':
+			case '\\': *dst++ = '\\'; *dst++ = ch; break;
+			case '\b': *dst++ = '\\'; *dst++ = 'b'; break;
+			case '\f': *dst++ = '\\'; *dst++ = 'f'; break;
+			case '\n': *dst++ = '\\'; *dst++ = 'n'; break;
+			case '\r': *dst++ = '\\'; *dst++ = 'r'; break;
+			case '\t': *dst++ = '\\'; *dst++ = 't'; break;
+			default:
+				if (ch < ' ') {
+					dst += sprintf(dst, "\\u%04x", ch);
+				} else {
+					*dst++ = ch;
+				}
+			}
+		}
+		*dst++ = '"';
+		return dst;
+	}
+	if (IS_TYPE(obj, ByteArrayType)) {
+		int count = BYTES(obj);
+		uint8 *bytes = (uint8 *) &FIELD(obj, 0);
+		*dst++ = '[';
+		for (int i = 0; i < count; i++) {
+			if (i > 0) *dst++ = ',';
+			dst += sprintf(dst, "%d", bytes[i]);
+		}
+		*dst++ = ']';
+		return dst;
+	}
+	if (IS_TYPE(obj, ListType)) {
+		int count = obj2int(FIELD(obj, 0));
+		*dst++ = '[';
+		for (int i = 1; i <= count; i++) {
+			if (i > 1) *dst++ = ',';
+			dst = jsonEncode(dst, FIELD(obj, i));
+		}
+		*dst++ = ']';
+		return dst;
+	}
+	memcpy(dst, "null", 4);
+	return dst + 4;
+}
+
+static OBJ primJSONEncode(int argCount, OBJ *args) {
+	// Return the JSON encoding of the given value.
+
+	if (argCount < 1) return fail(notEnoughArguments);
+	int size = jsonEncodedSize(args[0], 0);
+	if (size < 0) return fail(stackOverflow); // nested too deeply (or a list contains itself)
+
+	OBJ result = newString(size);
+	if (!result) return result; // insufficient memory
+	char *end = jsonEncode(obj2str(result), args[0]); // args[0] is updated if GC moved it
+	*end = '\0';
+	return result;
+}
+
+static OBJ primTelemetry(int argCount, OBJ *args) {
+	// Record a timestamped sample of up to 16 integer values for graphing. Unlike the
+	// graph block, this does not wait for the data to be sent. Return false if the sample
+	// was dropped because the serial output could not keep up.
+
+	int values[16];
+	if (argCount > 16) argCount = 16;
+	for (int i = 0; i < argCount; i++) {
+		if (!isInt(args[i])) return fail(needsIntegerError);
+		values[i] = obj2int(args[i]);
+	}
+	return addTelemetrySample(argCount, values) ? trueObj : falseObj;
+}
+
 // Primitives
 
 static PrimEntry entries[] = {
@@ -157,6 +587,11 @@ static PrimEntry entries[] = {
 	{"jsonCount", primJSONCount},
 	{"jsonValueAt", primJSONValueAt},
 	{"jsonKeyAt", primJSONKeyAt},
+	{"jsonIndex", primJSONIndex},
+	{"jsonIndexGet", primJSONIndexGet},
+	{"jsonIndexCount", primJSONIndexCount},
+	{"jsonEncode", primJSONEncode},
+	{"telemetry", primTelemetry},
 };
 
 void addMiscPrims() {
@@ -452,6 +452,295 @@ static OBJ primHttpResponse(int argCount, OBJ *args) {
 	return result;
 }
 
+// Asynchronous HTTP Client for ESP32
+
+// httpStartRequest starts a request and returns a handle without waiting for the server.
+// Requests are serviced by netStep() from the VM loop and when the script polls them with
+// httpRequestStatus or httpRequestChunk, so other tasks keep running. httpEndRequest
+// cancels the request or, once the response has been read, frees its handle. A handle
+// combines the request's slot with a generation count, so a stale handle does not refer
+// to a later request that reuses the slot. Uses non-blocking lwIP sockets. Host name
+// lookup is synchronous. See linuxNetPrims.c for the Linux version.
+
+#ifdef ARDUINO_ARCH_ESP32
+
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+
+#define MAX_HTTP_REQUESTS 4
+#define HTTP_REQUEST_BUFFER_SIZE 1024
+#define HTTP_REQUEST_TIMEOUT 10000
+
+// request states (in order)
+#define HTTP_CONNECTING 0
+#define HTTP_SENDING 1
+#define HTTP_RECEIVING 2
+#define HTTP_DONE 3
+#define HTTP_TIMEOUT 4
+#define HTTP_ERROR 5
+
+static const char *httpStateNames[] = { "connecting", "sending", "receiving", "done", "timeout", "error" };
+
+typedef struct {
+	int fd;					// -1 once the request has finished
+	int handle;				// slot index plus MAX_HTTP_REQUESTS times a generation count
+	int state;
+	int received;			// true if any response bytes were received
+	uint8 *out;				// request not yet sent
+	int outCount;
+	int outSent;
+	uint8 in[HTTP_REQUEST_BUFFER_SIZE];	// response bytes not yet read by the script
+	int inCount;
+	uint32 lastActivity;
+	uint32 timeout;
+} HttpRequest;
+
+static HttpRequest *httpRequests[MAX_HTTP_REQUESTS];
+static int httpRequestGeneration = 0;
+
+static void finishHttpRequest(HttpRequest *req, int state) {
+	// Close the socket. Received data remains available until the handle is freed.
+
+	if (req->fd >= 0) {
+		close(req->fd);
+		req->fd = -1;
+	}
+	free(req->out);
+	req->out = NULL;
+	req->state = state;
+}
+
+static void freeHttpRequest(int slot) {
+	HttpRequest *req = httpRequests[slot];
+	if (!req) return;
+	finishHttpRequest(req, HTTP_DONE);
+	free(req);
+	httpRequests[slot] = NULL;
+}
+
+static void serviceHttpRequest(HttpRequest *req) {
+	if (req->state >= HTTP_DONE) return;
+	uint32 now = millisecs();
+
+	if (HTTP_CONNECTING == req->state) {
+		fd_set writeSet;
+		FD_ZERO(&writeSet);
+		FD_SET(req->fd, &writeSet);
+		struct timeval noWait = { 0, 0 };
+		if (select(req->fd + 1, NULL, &writeSet, NULL, &noWait) > 0) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(req->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (err) {
+				finishHttpRequest(req, HTTP_ERROR);
+				return;
+			}
+			req->state = HTTP_SENDING;
+			req->lastActivity = now;
+		}
+	}
+	if (HTTP_SENDING == req->state) {
+		int n = send(req->fd, &req->out[req->outSent], req->outCount - req->outSent, 0);
+		if (n > 0) {
+			req->outSent += n;
+			req->lastActivity = now;
+		} else if ((n < 0) && (EAGAIN != errno) && (EWOULDBLOCK != errno)) {
+			finishHttpRequest(req, HTTP_ERROR);
+			return;
+		}
+		if (req->outSent == req->outCount) {
+			free(req->out);
+			req->out = NULL;
+			req->state = HTTP_RECEIVING;
+		}
+	}
+	if ((HTTP_RECEIVING == req->state) && (req->inCount < HTTP_REQUEST_BUFFER_SIZE)) {
+		int n = recv(req->fd, &req->in[req->inCount], HTTP_REQUEST_BUFFER_SIZE - req->inCount, 0);
+		if (n > 0) {
+			req->inCount += n;
+			req->received = true;
+			req->lastActivity = now;
+		} else if ((0 == n) || ((EAGAIN != errno) && (EWOULDBLOCK != errno))) {
+			// the server closes the connection at the end of the response
+			finishHttpRequest(req, req->received ? HTTP_DONE : HTTP_ERROR);
+			return;
+		}
+	}
+	// a full buffer is waiting for the script, so it does not time out
+	if ((req->inCount < HTTP_REQUEST_BUFFER_SIZE) && ((now - req->lastActivity) > req->timeout)) {
+		finishHttpRequest(req, HTTP_TIMEOUT);
+	}
+}
+
+static HttpRequest * requestForHandle(OBJ handle) {
+	if (!isInt(handle) || (obj2int(handle) < 0)) return NULL;
+	HttpRequest *req = httpRequests[obj2int(handle) % MAX_HTTP_REQUESTS];
+	return (req && (req->handle == obj2int(handle))) ? req : NULL;
+}
+
+void netStep() {
+	// Called periodically from the VM loop to make progress on HTTP requests.
+
+	for (int i = 0; i < MAX_HTTP_REQUESTS; i++) {
+		if (httpRequests[i]) serviceHttpRequest(httpRequests[i]);
+	}
+}
+
+static OBJ primHttpStartRequest(int argCount, OBJ *args) {
+	// Start an HTTP request and return its handle, or -1 if the request could not be
+	// started. Arguments: method, host, path, and optional body, port, extra headers,
+	// and inactivity timeout in milliseconds.
+
+	if (argCount < 3) return fail(notEnoughArguments);
+	if (!IS_TYPE(args[0], StringType) || !IS_TYPE(args[1], StringType) || !IS_TYPE(args[2], StringType)) {
+		return fail(needsStringError);
+	}
+	char *method = obj2str(args[0]);
+	char *host = obj2str(args[1]);
+	char *path = obj2str(args[2]);
+	uint8 *body = NULL;
+	int bodyLength = 0;
+	if ((argCount > 3) && IS_TYPE(args[3], StringType)) {
+		body = (uint8 *) obj2str(args[3]);
+		bodyLength = strlen(obj2str(args[3]));
+	} else if ((argCount > 3) && IS_TYPE(args[3], ByteArrayType)) {
+		body = (uint8 *) &FIELD(args[3], 0);
+		bodyLength = BYTES(args[3]);
+	}
+	int port = ((argCount > 4) && isInt(args[4])) ? obj2int(args[4]) : 80;
+	char *extraHeaders = ((argCount > 5) && IS_TYPE(args[5], StringType)) ? obj2str(args[5]) : (char *) "";
+	int timeout = ((argCount > 6) && isInt(args[6])) ? obj2int(args[6]) : HTTP_REQUEST_TIMEOUT;
+	if (timeout <= 0) timeout = HTTP_REQUEST_TIMEOUT;
+
+	// find a free slot, reusing one whose response has been completely read if necessary
+	int slot = -1;
+	for (int i = 0; (slot < 0) && (i < MAX_HTTP_REQUESTS); i++) {
+		if (!httpRequests[i]) slot = i;
+	}
+	for (int i = 0; (slot < 0) && (i < MAX_HTTP_REQUESTS); i++) {
+		if ((httpRequests[i]->state >= HTTP_DONE) && (0 == httpRequests[i]->inCount)) {
+			freeHttpRequest(i);
+			slot = i;
+		}
+	}
+	if (slot < 0) return int2obj(-1);
+
+	struct addrinfo hints;
+	struct addrinfo *info;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((0 != getaddrinfo(host, NULL, &hints, &info)) || !info) return int2obj(-1);
+	struct sockaddr_in remoteAddress = *((struct sockaddr_in *) info->ai_addr);
+	freeaddrinfo(info);
+	remoteAddress.sin_port = htons(port);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return int2obj(-1);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &flag, sizeof(flag));
+	if ((connect(fd, (struct sockaddr *) &remoteAddress, sizeof(remoteAddress)) < 0) && (EINPROGRESS != errno)) {
+		close(fd);
+		return int2obj(-1);
+	}
+
+	// build the request; it is sent once the connection is established
+	char head[300];
+	int headLength = snprintf(head, sizeof(head),
+		"%s %s%s HTTP/1.0\r\n"
+		"Host: %s\r\n"
+		"Connection: close\r\n"
+		"User-Agent: MicroBlocks\r\n"
+		"Accept: */*\r\n",
+		method, ('/' == path[0]) ? "" : "/", path, host);
+	if (headLength >= (int) sizeof(head)) headLength = sizeof(head) - 1;
+	int extraLength = strlen(extraHeaders);
+	char tail[100];
+	int tailLength = 0;
+	if (extraLength && ('\n' != extraHeaders[extraLength - 1])) {
+		tailLength += sprintf(&tail[tailLength], "\r\n");
+	}
+	if (bodyLength > 0) {
+		if (!strstr(extraHeaders, "Content-Type:")) {
+			tailLength += sprintf(&tail[tailLength], "Content-Type: text/plain\r\n");
+		}
+		tailLength += sprintf(&tail[tailLength], "Content-Length: %d\r\n", bodyLength);
+	}
+	tailLength += sprintf(&tail[tailLength], "\r\n");
+
+	HttpRequest *req = (HttpRequest *) calloc(1, sizeof(HttpRequest));
+	int outCount = headLength + extraLength + tailLength + bodyLength;
+	uint8 *out = (uint8 *) malloc(outCount);
+	if (!req || !out) {
+		free(req);
+		free(out);
+		close(fd);
+		return int2obj(-1);
+	}
+	memcpy(out, head, headLength);
+	memcpy(&out[headLength], extraHeaders, extraLength);
+	memcpy(&out[headLength + extraLength], tail, tailLength);
+	if (bodyLength > 0) memcpy(&out[headLength + extraLength + tailLength], body, bodyLength);
+
+	req->fd = fd;
+	req->handle = slot + (MAX_HTTP_REQUESTS * httpRequestGeneration);
+	httpRequestGeneration = (httpRequestGeneration + 1) & 0xFFFF;
+	req->state = HTTP_CONNECTING;
+	req->out = out;
+	req->outCount = outCount;
+	req->lastActivity = millisecs();
+	req->timeout = timeout;
+	httpRequests[slot] = req;
+	return int2obj(req->handle);
+}
+
+static OBJ primHttpRequestStatus(int argCount, OBJ *args) {
+	// Return the state of the given request: connecting, sending, receiving, done,
+	// timeout, or error. Return the empty string if the handle is not valid.
+
+	if (argCount < 1) return fail(notEnoughArguments);
+	HttpRequest *req = requestForHandle(args[0]);
+	if (req) serviceHttpRequest(req);
+	const char *state = req ? httpStateNames[req->state] : "";
+	return newStringFromBytes(state, strlen(state));
+}
+
+static OBJ primHttpRequestChunk(int argCount, OBJ *args) {
+	// Return the next part of the response to the given request, or the empty string if
+	// no data is available. If the optional second argument is true, return a ByteArray.
+
+	if (argCount < 1) return fail(notEnoughArguments);
+	int useBinary = ((argCount > 1) && (trueObj == args[1]));
+	HttpRequest *req = requestForHandle(args[0]);
+	if (req) serviceHttpRequest(req);
+	int byteCount = req ? req->inCount : 0;
+
+	OBJ result;
+	if (useBinary) {
+		result = newObj(ByteArrayType, (byteCount + 3) / 4, falseObj);
+		if (result) setByteCountAdjust(result, byteCount);
+	} else {
+		result = newString(byteCount);
+	}
+	if (!result) return fail(insufficientMemoryError);
+	if (byteCount) {
+		memcpy(&FIELD(result, 0), req->in, byteCount);
+		req->inCount = 0;
+	}
+	return result;
+}
+
+static OBJ primHttpEndRequest(int argCount, OBJ *args) {
+	// Cancel the given request if it is still in progress and free its handle.
+
+	if (argCount < 1) return fail(notEnoughArguments);
+	if (requestForHandle(args[0])) freeHttpRequest(obj2int(args[0]) % MAX_HTTP_REQUESTS);
+	return falseObj;
+}
+
+#endif
+
 // UDP
 
 WiFiUDP udp;
@@ -619,6 +908,11 @@ static OBJ primUDPRemotePort(int argCount, OBJ *args) { return fail(noWiFi); }
 
 #ifndef ARDUINO_ARCH_ESP32
 
+static OBJ primHttpStartRequest(int argCount, OBJ *args) { return fail(noWiFi); }
+static OBJ primHttpRequestStatus(int argCount, OBJ *args) { return fail(noWiFi); }
+static OBJ primHttpRequestChunk(int argCount, OBJ *args) { return fail(noWiFi); }
+static OBJ primHttpEndRequest(int argCount, OBJ *args) { return fail(noWiFi); }
+
 static OBJ primWebSocketStart(int argCount, OBJ *args) { return fail(noWiFi); }
 static OBJ primWebSocketLastEvent(int argCount, OBJ *args) { return fail(noWiFi); }
 static OBJ primWebSocketSendToClient(int argCount, OBJ *args) { return fail(noWiFi); }
@@ -1016,6 +1310,17 @@ static OBJ primEspNowBroadcast(int argCount, OBJ *args) {
 
 #endif // ESP_NOW_PRIMS
 
+// Network Step
+
+#ifndef ARDUINO_ARCH_ESP32
+
+void netStep() {
+	// Called periodically from the VM loop. Connections on these boards are serviced by
+	// their primitives or libraries.
+}
+
+#endif
+
 static PrimEntry entries[] = {
 	{"hasWiFi", primHasWiFi},
 	{"startWiFi", primStartWiFi},
@@ -1031,6 +1336,10 @@ static PrimEntry entries[] = {
 	{"httpIsConnected", primHttpIsConnected},
 	{"httpRequest", primHttpRequest},
 	{"httpResponse", primHttpResponse},
+	{"httpStartRequest", primHttpStartRequest},
+	{"httpRequestStatus", primHttpRequestStatus},
+	{"httpRequestChunk", primHttpRequestChunk},
+	{"httpEndRequest", primHttpEndRequest},
 
 	{"udpStart", primUDPStart},
 	{"udpStop", primUDPStop},
@@ -22,6 +22,7 @@
 //		void flashWriteData(int *dst, int wordCount, uint8 *src)
 //		void flashWriteWord(int *addr, int value)
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,6 +31,10 @@
 #include "interp.h"
 #include "persist.h"
 
+#if defined(GNUBLOCKS) && !defined(EMSCRIPTEN)
+#include "../linux+pi/linux.h"
+#endif
+
 // flash operations for supported platforms
 
 #if defined(NRF51) || defined(NRF52) || defined(ARDUINO_NRF52_PRIMO)
@@ -389,9 +394,12 @@ void flashWriteWord(int *addr, int value) {
 	#if defined(ESP8266)
 		#define USE_CODE_FILE true
 		#define HALF_SPACE (18 * 1024) // ESP8266 is unreliable at 24
-	#elif defined(ARDUINO_ARCH_ESP32) || defined(GNUBLOCKS)
+	#elif defined(ARDUINO_ARCH_ESP32) || defined(EMSCRIPTEN)
 		#define USE_CODE_FILE true
 		#define HALF_SPACE (40 * 1024)
+	#elif defined(GNUBLOCKS)
+		#define USE_CODE_FILE true
+		#define HALF_SPACE codeStoreBytes // set at startup; see mapCodeStore() in linux.c
 	#elif defined(ARDUINO_ARCH_RP2040)
 		#define USE_CODE_FILE RP2040_PHILHOWER
 		#define HALF_SPACE (40 * 1024)
@@ -399,8 +407,14 @@ void flashWriteWord(int *addr, int value) {
 		#define HALF_SPACE (10 * 1024)
 	#endif
 
-	#define START (&flash[0])
-	static uint8 flash[HALF_SPACE] __attribute__ ((aligned (32))); // simulated Flash memory
+	#if defined(GNUBLOCKS) && !defined(EMSCRIPTEN)
+		#define START (flash)
+		static uint8 *flash = NULL; // memory-mapped code store
+		static int codeStoreBytes = 0;
+	#else
+		#define START (&flash[0])
+		static uint8 flash[HALF_SPACE] __attribute__ ((aligned (32))); // simulated Flash memory
+	#endif
 
 	static void flashErase(int *startAddr, int *endAddr) {
 		int *dst = (int *) startAddr;
@@ -426,14 +440,21 @@ void flashWriteWord(int *addr, int value) {
 // variables
 
 // persistent memory half-space ranges:
+#if defined(GNUBLOCKS) && !defined(EMSCRIPTEN)
+static int *start0, *end0, *start1, *end1; // set by initPersistentMemory() once mapped
+#else
 static int *start0 = (int *) START;
 static int *end0 = (int *) (START + HALF_SPACE);
 static int *start1 = (int *) (START + HALF_SPACE);
 static int *end1 = (int *) (START + (2 * HALF_SPACE));;
+#endif
 
 static int current;		// current half-space (0 or 1)
 static int *freeStart;	// first free word
 
+static int *latestCheckpoint = NULL;	// most recent usable checkpoint record, if any
+static int recordsSinceCheckpoint = 0;
+
 #ifdef USE_CODE_FILE
 	static int suspendFileUpdates = false;	// suspend slow file updates when loading a project/library
 #endif
@@ -469,10 +490,16 @@ static void initPersistentMemory() {
 	#ifdef RAM_CODE_STORE
 		// Use a single persistent memory; HALF_SPACE is the total amount of RAM to use
 		// Make starts and ends the same to allow the same code to work for either RAM or Flash
+		#if defined(GNUBLOCKS) && !defined(EMSCRIPTEN)
+			if (!flash) flash = mapCodeStore(&codeStoreBytes);
+		#endif
 		start0 = start1 = (int *) START;
 		end0 = end1 = (int *) (START + HALF_SPACE);
 	#endif
 
+	latestCheckpoint = NULL;
+	recordsSinceCheckpoint = 0;
+
 	int c0 = cycleCount(0);
 	int c1 = cycleCount(1);
 
@@ -503,6 +530,14 @@ static void initPersistentMemory() {
 			clearPersistentMemory();
 			return;
 		}
+		int recType = (header >> 16) & 0xFF;
+		if (checkpoint == recType) {
+			latestCheckpoint = freeStart;
+			recordsSinceCheckpoint = 0;
+		} else {
+			if (deleteAll == recType) latestCheckpoint = NULL;
+			recordsSinceCheckpoint++;
+		}
 		freeStart += *(freeStart + 1) + 2; // increment by the record length plus 2-word header
 	}
 	if (freeStart >= end) freeStart = end;
@@ -623,16 +658,216 @@ static int * copyChunk(int *dst, int *src) {
 	return dst + wordCount;
 }
 
+// Compressed Chunks
+
+#ifdef COMPRESS_CHUNKS
+
+// When COMPRESS_CHUNKS is defined, chunk code records are stored compressed if that saves
+// space. Compressed records have the COMPRESSED_CHUNK flag set in their <extra> header field.
+// The encoding suppresses zero bytes, which are common in instructions since most opcode
+// arguments are small. Each pair of code words is encoded as a control byte followed by
+// the non-zero bytes of the pair; bit i of the control byte is set if byte i is non-zero.
+// The encoded stream is padded to a word boundary and followed by the original word count.
+//
+// Compressed chunks are expanded into the chunk cache on first use. An expansion stays
+// in the cache until space is needed, no task is running its code, and no object refers
+// to a string literal in it. Expansions are keyed by the address of their persistent
+// record, so storing a new version of a chunk does not disturb tasks running the old version.
+// chunkExpansion[] locates the expansion of the current record of each chunk without a search.
+
+#ifndef CHUNK_CACHE_BYTES
+	#define CHUNK_CACHE_BYTES 4096
+#endif
+#define CHUNK_CACHE_WORDS (CHUNK_CACHE_BYTES / 4)
+
+typedef struct {
+	int *record;	// compressed persistent record or NULL if no longer current
+	int *code;		// expanded copy of the record in chunkCache
+	int words;		// size of the expanded copy, including the record header
+	int chunkIndex;	// used to follow records moved by compaction
+} ExpandedChunk;
+
+static int chunkCache[CHUNK_CACHE_WORDS];
+static ExpandedChunk expandedChunks[MAX_CHUNKS]; // sorted by address in chunkCache
+static int expandedChunkCount = 0;
+static uint8 chunkExpansion[MAX_CHUNKS]; // expandedChunks index + 1, or zero if not expanded
+
+int compressChunk(uint8 *data, int byteCount) {
+	// Compress the given chunk code in place. Return the size of the compressed record
+	// data or zero if compression would not save space (the data is then unchanged).
+
+	if ((byteCount & 3) || (byteCount < 16)) return 0;
+	int wordCount = byteCount / 4;
+
+	// first pass: find the compressed size and make sure that, when compressing in place,
+	// the output never overwrites input that has not yet been read
+	int outBytes = 0;
+	for (int i = 0; i < byteCount; i += 8) {
+		int end = (i + 8 < byteCount) ? i + 8 : byteCount;
+		outBytes++; // control byte
+		for (int j = i; j < end; j++) {
+			if (data[j]) outBytes++;
+		}
+		if (outBytes > end) return 0;
+	}
+	int recordBytes = ((outBytes + 3) & ~3) + 4; // padded stream plus word count
+	if (recordBytes >= byteCount) return 0;
+
+	// second pass: compress
+	uint8 *dst = data;
+	for (int i = 0; i < byteCount; i += 8) {
+		uint8 pair[8];
+		int n = (i + 8 < byteCount) ? 8 : byteCount - i;
+		memcpy(pair, &data[i], n);
+		uint8 *control = dst++;
+		*control = 0;
+		for (int j = 0; j < n; j++) {
+			if (pair[j]) {
+				*control |= (1 << j);
+				*dst++ = pair[j];
+			}
+		}
+	}
+	while (dst < &data[recordBytes - 4]) *dst++ = 0;
+	memcpy(dst, &wordCount, 4);
+	return recordBytes;
+}
+
+static void expandChunk(uint8 *src, uint8 *dst, int wordCount) {
+	int byteCount = 4 * wordCount;
+	for (int i = 0; i < byteCount; i += 8) {
+		int control = *src++;
+		int n = (i + 8 < byteCount) ? 8 : byteCount - i;
+		for (int j = 0; j < n; j++) {
+			*dst++ = (control & (1 << j)) ? *src++ : 0;
+		}
+	}
+}
+
+static void indexExpansions() {
+	// Update chunkExpansion[]. Called whenever expandedChunks entries are added, moved, or changed.
+
+	memset(chunkExpansion, 0, sizeof(chunkExpansion));
+	for (int i = 0; i < expandedChunkCount; i++) {
+		ExpandedChunk *entry = &expandedChunks[i];
+		if (entry->record && (entry->chunkIndex >= 0) && (entry->record == chunks[entry->chunkIndex].code)) {
+			chunkExpansion[entry->chunkIndex] = i + 1;
+		}
+	}
+}
+
+static int expansionInUse(ExpandedChunk *entry) {
+	// Return true if a task is running the given expansion or any object refers to it.
+	// Objects can refer to string literals in the expansion; see pushLiteral_op.
+
+	int *start = entry->code;
+	int *end = start + entry->words;
+	for (int i = 0; i < MAX_TASKS; i++) {
+		if (tasks[i].status && (start <= tasks[i].code) && (tasks[i].code < end)) return true;
+	}
+	return isReferenced(start, end);
+}
+
+static void evictUnusedExpansions() {
+	int dst = 0;
+	for (int i = 0; i < expandedChunkCount; i++) {
+		if (expansionInUse(&expandedChunks[i])) expandedChunks[dst++] = expandedChunks[i];
+	}
+	expandedChunkCount = dst;
+	indexExpansions();
+}
+
+static ExpandedChunk * allocExpandedChunk(int wordCount) {
+	// Allocate an entry and space for an expanded chunk in the chunk cache.
+	// Return NULL if there is not enough space even after evicting unused expansions.
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		if (attempt) evictUnusedExpansions();
+		if (expandedChunkCount >= MAX_CHUNKS) continue;
+		int *free = chunkCache;
+		for (int i = 0; i <= expandedChunkCount; i++) {
+			int *next = (i < expandedChunkCount) ? expandedChunks[i].code : &chunkCache[CHUNK_CACHE_WORDS];
+			if ((next - free) >= wordCount) { // found a gap
+				memmove(&expandedChunks[i + 1], &expandedChunks[i], (expandedChunkCount - i) * sizeof(ExpandedChunk));
+				expandedChunkCount++;
+				expandedChunks[i].record = NULL;
+				expandedChunks[i].code = free;
+				expandedChunks[i].words = wordCount;
+				return &expandedChunks[i];
+			}
+			if (i < expandedChunkCount) free = next + expandedChunks[i].words;
+		}
+	}
+	return NULL;
+}
+
+OBJ expandedChunkCode(int chunkIndex) {
+	// Return the code for the given chunk, expanding it into the chunk cache if necessary.
+	// Return NULL if there is not enough room in the chunk cache.
+
+	int *rec = chunks[chunkIndex].code;
+	if (!rec || !(*rec & COMPRESSED_CHUNK)) return rec;
+
+	int slot = chunkExpansion[chunkIndex];
+	if (slot && (rec == expandedChunks[slot - 1].record)) return expandedChunks[slot - 1].code;
+
+	int wordCount = rec[PERSISTENT_HEADER_WORDS + rec[1] - 1]; // last word of record
+	ExpandedChunk *entry = allocExpandedChunk(PERSISTENT_HEADER_WORDS + wordCount);
+	if (!entry) return NULL;
+	entry->record = rec;
+	entry->chunkIndex = chunkIndex;
+	entry->code[0] = *rec & ~COMPRESSED_CHUNK;
+	entry->code[1] = wordCount;
+	expandChunk((uint8 *) (rec + PERSISTENT_HEADER_WORDS), (uint8 *) (entry->code + PERSISTENT_HEADER_WORDS), wordCount);
+	indexExpansions();
+	return entry->code;
+}
+
+static void noteCurrentExpansions() {
+	// Called before rebuilding the chunk table. Remember which expansions are for the
+	// current version of their chunk; others will no longer be found by expandedChunkCode().
+
+	for (int i = 0; i < expandedChunkCount; i++) {
+		ExpandedChunk *entry = &expandedChunks[i];
+		if (!entry->record || (entry->record != chunks[entry->chunkIndex].code)) entry->chunkIndex = -1;
+	}
+}
+
+static void updateExpansionRecords() {
+	// Called after rebuilding the chunk table. Compaction may have moved records, but the
+	// current version of each chunk is kept, so its expansion remains valid.
+
+	for (int i = 0; i < expandedChunkCount; i++) {
+		ExpandedChunk *entry = &expandedChunks[i];
+		entry->record = (entry->chunkIndex >= 0) ? chunks[entry->chunkIndex].code : NULL;
+	}
+	indexExpansions();
+}
+
+static void forgetExpansionRecords() {
+	for (int i = 0; i < expandedChunkCount; i++) expandedChunks[i].record = NULL;
+	indexExpansions();
+}
+
+#endif // COMPRESS_CHUNKS
+
+static int * loadCheckpoint();
+static void rebuildVarNameIndex();
+
 static void updateChunkTable() {
+	#ifdef COMPRESS_CHUNKS
+		noteCurrentExpansions();
+	#endif
+
 	memset(chunks, 0, sizeof(chunks)); // clear chunk table
 
-	int *p = compactionStartRecord();
+	int *p = loadCheckpoint(); // only records after the checkpoint need to be scanned
 	while (p) {
 		int recType = (*p >> 16) & 0xFF;
 		if (chunkCode == recType) {
 			int chunkIndex = (*p >> 8) & 0xFF;
 			if (chunkIndex < MAX_CHUNKS) {
-				chunks[chunkIndex].chunkType = *p & 0xFF;
+				chunks[chunkIndex].chunkType = *p & 0xFF & ~COMPRESSED_CHUNK;
 				chunks[chunkIndex].code = p;
 			}
 		}
@@ -646,124 +881,392 @@ static void updateChunkTable() {
 		p = recordAfter(p);
 	}
 
+	#ifdef COMPRESS_CHUNKS
+		updateExpansionRecords();
+	#endif
+
 	// update code pointers for tasks
 	for (int i = 0; i < MAX_TASKS; i++) {
 		if (tasks[i].status) { // task entry is in use
-			tasks[i].code = chunks[tasks[i].taskChunkIndex].code;
+			tasks[i].code = expandedChunkCode(tasks[i].currentChunkIndex);
+			if (!tasks[i].code) tasks[i].status = unusedTask; // could not expand chunk
 		}
 	}
+
+	rebuildVarNameIndex();
 }
 
-// Flash Compaction
+// Latest Record Index
 
-#ifndef RAM_CODE_STORE
+// Compaction keeps only the most recent record for each chunk attribute and variable name.
+// Rather than rescanning the rest of the store for each record (quadratic), compaction
+// first builds an index of the most recent records in a single pass. Each entry is the
+// word offset of a record from the start of the current half-space; zero means none.
+// Chunk code records do not need an index entry since the chunks[] table already points
+// to the most recent code record of each chunk.
+//
+// The attribute index would use most of the free RAM on boards with only 16 KB (micro:bit v1
+// and Calliope), so on those boards keepRecord() instead looks for a newer record among the
+// records that follow each attribute record, as compaction did before the index was added.
+// Those boards also omit the variable name hash table (see "Variable Name Index").
 
-struct {
-	int *chunkCodeRec;
-	int *attributeRecs[CHUNK_ATTRIBUTE_COUNT];
-} chunkData;
+#if defined(NRF51)
+	#define SMALL_RAM true
+#endif
 
-static char chunkProcessed[256];
-static char varProcessed[256];
+#ifdef GNUBLOCKS
+	typedef uint32_t RecordOffset; // the Linux code store may be larger than 256 KB
+#else
+	typedef uint16_t RecordOffset;
+#endif
 
-static int * copyChunkInfo(int id, int *src, int *dst) {
-	// Copy the most recent data about the chunk with the given ID to dst and return
-	// the new dst pointer. If the given chunk id has been processed do nothing.
+#ifndef SMALL_RAM
+	static RecordOffset latestAttributeRec[MAX_CHUNKS][CHUNK_ATTRIBUTE_COUNT];
+#endif
+static RecordOffset latestVarNameRec[256]; // also the variable name index; see below
 
-	if (chunkProcessed[id]) return dst;
+static void buildLatestRecordIndex(int *start) {
+	int *halfSpaceStart = (0 == current) ? start0 : start1;
 
-	// clear chunkData
-	memset(&chunkData, 0, sizeof(chunkData));
+	#ifndef SMALL_RAM
+		memset(latestAttributeRec, 0, sizeof(latestAttributeRec));
+	#endif
+	memset(latestVarNameRec, 0, sizeof(latestVarNameRec));
 
-	// scan rest of the records to get the most recent info about this chunk
-	while (src) {
-		int attributeID;
-		if (id == ((*src >> 8) & 0xFF)) { // id field matches
-			int type = (*src >> 16) & 0xFF;
-			switch (type) {
-			case chunkCode:
-				chunkData.chunkCodeRec = src;
-				break;
-			case chunkAttribute:
-				attributeID = *src & 0xFF;
-				if (attributeID < CHUNK_ATTRIBUTE_COUNT) {
-					chunkData.attributeRecs[attributeID] = src;
-				}
-				break;
-			case chunkDeleted:
-				memset(&chunkData, 0, sizeof(chunkData)); // clear chunkData
-				break;
+	for (int *p = start; p; p = recordAfter(p)) {
+		int type = (*p >> 16) & 0xFF;
+		int id = (*p >> 8) & 0xFF;
+		RecordOffset offset = p - halfSpaceStart;
+		switch (type) {
+		#ifndef SMALL_RAM
+		case chunkAttribute:
+			if ((id < MAX_CHUNKS) && ((*p & 0xFF) < CHUNK_ATTRIBUTE_COUNT)) {
+				latestAttributeRec[id][*p & 0xFF] = offset;
 			}
+			break;
+		case chunkDeleted:
+			if (id < MAX_CHUNKS) memset(latestAttributeRec[id], 0, sizeof(latestAttributeRec[id]));
+			break;
+		#endif
+		case varName:
+			latestVarNameRec[id] = offset;
+			break;
+		case varsClearAll:
+			memset(latestVarNameRec, 0, sizeof(latestVarNameRec));
+			break;
 		}
-		src = recordAfter(src);
 	}
-	if (chunkData.chunkCodeRec) {
-		dst = copyChunk(dst, chunkData.chunkCodeRec);
-		for (int i = 0; i < CHUNK_ATTRIBUTE_COUNT; i++) {
-			if (chunkData.attributeRecs[i]) dst = copyChunk(dst, chunkData.attributeRecs[i]);
+}
+
+#ifdef SMALL_RAM
+
+static int replacedLater(int *attributeRec) {
+	// Return true if a later record replaces the given attribute record or deletes its chunk.
+
+	int chunkIndex = (*attributeRec >> 8) & 0xFF;
+	for (int *p = recordAfter(attributeRec); p; p = recordAfter(p)) {
+		if ((*p & 0xFFFFFF) == (*attributeRec & 0xFFFFFF)) return true; // same chunk and attribute
+		if ((chunkDeleted == ((*p >> 16) & 0xFF)) && (chunkIndex == ((*p >> 8) & 0xFF))) return true;
+	}
+	return false;
+}
+
+#endif
+
+static int keepRecord(int *rec) {
+	// Return true if the given record is the most recent one for its chunk attribute
+	// or variable name, or is the current code for its chunk. Must be called after
+	// buildLatestRecordIndex() and before any records are moved.
+
+	int type = (*rec >> 16) & 0xFF;
+	int id = (*rec >> 8) & 0xFF;
+	RecordOffset offset = rec - ((0 == current) ? start0 : start1);
+	switch (type) {
+	case chunkCode:
+		return (id < MAX_CHUNKS) && (rec == chunks[id].code);
+	case chunkAttribute:
+		if ((id >= MAX_CHUNKS) || (NULL == chunks[id].code)) return false; // chunk was deleted
+		#ifdef SMALL_RAM
+			return ((*rec & 0xFF) < CHUNK_ATTRIBUTE_COUNT) && !replacedLater(rec);
+		#else
+			return ((*rec & 0xFF) < CHUNK_ATTRIBUTE_COUNT) && (offset == latestAttributeRec[id][*rec & 0xFF]);
+		#endif
+	case varName:
+		return offset == latestVarNameRec[id];
+	}
+	return false;
+}
+
+// Checkpoints
+
+// Without a checkpoint, restoring the chunk table at startup requires scanning every record
+// in the code store, so startup time grows with the edit history. A checkpoint record holds
+// the chunk table and the locations of the variable name records at the point where it was
+// written; startup loads the most recent checkpoint and scans only the records after it.
+// A checkpoint is written after each compaction and after every CHECKPOINT_INTERVAL records.
+// Compaction discards old checkpoints. Checkpoint record data is:
+//
+//	<chunk count> <chunk entries...> <variable entries...>
+//
+// where each entry is a word of the form <chunk or variable id (8 bits)><record offset
+// (24 bits)>, and record offsets are in words from the start of the current half-space.
+
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_INTERVAL 64
+
+static int validCheckpointEntry(int entry, int recType) {
+	// Return true if the given checkpoint entry refers to a record of the given type and id
+	// that precedes the latest checkpoint.
+
+	int *halfSpaceStart = (0 == current) ? start0 : start1;
+	int id = (entry >> 24) & 0xFF;
+	int *rec = halfSpaceStart + (entry & 0xFFFFFF);
+	if ((chunkCode == recType) && (id >= MAX_CHUNKS)) return false;
+	return (rec > halfSpaceStart) && (rec < latestCheckpoint) &&
+		((*rec & 0xFFFFFF00) == (('R' << 24) | (recType << 16) | (id << 8)));
+}
+
+static int * loadCheckpoint() {
+	// Fill the chunk table from the latest checkpoint and return the first record after it.
+	// If there is no usable checkpoint, return the first record to scan from the start.
+	// A checkpoint with any bad chunk or variable entry is not used.
+
+	if (!latestCheckpoint) return compactionStartRecord();
+
+	int *halfSpaceStart = (0 == current) ? start0 : start1;
+	int *data = latestCheckpoint + PERSISTENT_HEADER_WORDS;
+	int entryCount = latestCheckpoint[1];
+	int chunkCount = data[0];
+	int ok = ((*latestCheckpoint & 0xFF) == CHECKPOINT_VERSION) && (0 <= chunkCount) && (chunkCount < entryCount);
+	for (int i = 1; ok && (i < entryCount); i++) {
+		ok = validCheckpointEntry(data[i], (i <= chunkCount) ? chunkCode : varName);
+	}
+	if (!ok) { // should not happen; fall back to a full scan
+		latestCheckpoint = NULL;
+		return compactionStartRecord();
+	}
+	for (int i = 1; i <= chunkCount; i++) {
+		int chunkIndex = (data[i] >> 24) & 0xFF;
+		int *rec = halfSpaceStart + (data[i] & 0xFFFFFF);
+		chunks[chunkIndex].chunkType = *rec & 0xFF & ~COMPRESSED_CHUNK;
+		chunks[chunkIndex].code = rec;
+	}
+	return recordAfter(latestCheckpoint);
+}
+
+static void findLatestVarNames() {
+	// Set latestVarNameRec[] to the offsets of the current variable name records.
+	// Must follow loadCheckpoint(), which checks the variable entries of the checkpoint.
+
+	memset(latestVarNameRec, 0, sizeof(latestVarNameRec));
+	int *p = latestCheckpoint;
+	if (p) {
+		int *data = p + PERSISTENT_HEADER_WORDS;
+		for (int i = data[0] + 1; i < p[1]; i++) {
+			latestVarNameRec[(data[i] >> 24) & 0xFF] = data[i] & 0xFFFFFF;
 		}
+		p = recordAfter(p);
+	} else {
+		p = compactionStartRecord();
 	}
-	chunkProcessed[id] = true;
-	return dst;
+
+	int *halfSpaceStart = (0 == current) ? start0 : start1;
+	for ( ; p; p = recordAfter(p)) {
+		int recType = (*p >> 16) & 0xFF;
+		if (varName == recType) {
+			latestVarNameRec[(*p >> 8) & 0xFF] = p - halfSpaceStart;
+		} else if (varsClearAll == recType) {
+			memset(latestVarNameRec, 0, sizeof(latestVarNameRec));
+		}
+	}
+}
+
+static void writeCheckpointWord(int word) {
+	#if USE_CODE_FILE
+		if (!suspendFileUpdates) writeCodeFileWord(word);
+	#endif
+	flashWriteWord(freeStart++, word);
 }
 
-static int * copyVarInfo(int id, int *src, int *dst) {
-	if (varProcessed[id]) return dst;
+static void writeCheckpoint() {
+	// Append a checkpoint record reflecting the current chunk table and variable name index.
+	// Both must be up to date with the records in the code store. Skip writing the checkpoint if
+	// space is short; the next compaction will write one.
 
-	// record info from first reference to this variable
-	int type = (*src >> 16) & 0xFF;
-	int *nameRec = (varName == type) ? src : NULL;
+	int *halfSpaceStart = (0 == current) ? start0 : start1;
+	int *end = (0 == current) ? end0 : end1;
 
-	// scan rest of the records to get the most recent info about this variable
-	while (src) {
-		int type = (*src >> 16) & 0xFF;
-		switch (type) {
-		case varName:
-			if (id == ((*src >> 8) & 0xFF)) nameRec = src;
-			break;
-		case varsClearAll:
-			nameRec = NULL;
-			break;
+	int chunkCount = 0;
+	int varCount = 0;
+	for (int i = 0; i < MAX_CHUNKS; i++) {
+		if (chunks[i].code) chunkCount++;
+	}
+	for (int i = 0; i < 256; i++) {
+		if (latestVarNameRec[i]) varCount++;
+	}
+	int wordCount = 1 + chunkCount + varCount;
+	if ((freeStart + 2 + wordCount) > (end - ((end - halfSpaceStart) / 4))) return;
+
+	int *rec = freeStart;
+	writeCheckpointWord(('R' << 24) | (checkpoint << 16) | CHECKPOINT_VERSION);
+	writeCheckpointWord(wordCount);
+	writeCheckpointWord(chunkCount);
+	for (int i = 0; i < MAX_CHUNKS; i++) {
+		if (chunks[i].code) writeCheckpointWord((i << 24) | (chunks[i].code - halfSpaceStart));
+	}
+	for (int i = 0; i < 256; i++) {
+		if (latestVarNameRec[i]) writeCheckpointWord((i << 24) | latestVarNameRec[i]);
+	}
+	latestCheckpoint = rec;
+	recordsSinceCheckpoint = 0;
+}
+
+// Variable Name Index
+
+// Scripts and the IDE can look up global variables by name. Rather than scanning the
+// variable name records for each lookup, latestVarNameRec[] holds the location of the
+// current name record of each variable and a hash table maps names to variable IDs.
+// Both are rebuilt along with the chunk table and updated as records are appended.
+// SMALL_RAM boards omit the hash table and compare the current name of each variable.
+
+static char * varNameAt(RecordOffset offset) {
+	int *halfSpaceStart = (0 == current) ? start0 : start1;
+	return (char *) (halfSpaceStart + offset + PERSISTENT_HEADER_WORDS);
+}
+
+#ifdef SMALL_RAM
+
+static void rebuildVarNameIndex() {
+	findLatestVarNames();
+}
+
+static void clearVarNameIndex() {
+	memset(latestVarNameRec, 0, sizeof(latestVarNameRec));
+}
+
+static void updateVarNameIndex(int *rec) {
+	// Update the index for a newly appended variable name record.
+
+	latestVarNameRec[(*rec >> 8) & 0xFF] = rec - ((0 == current) ? start0 : start1);
+}
+
+int indexOfVarNamed(const char *varName) {
+	// Return the index of the given variable or -1 if not found. If several variables
+	// have the same name, return the one whose name was recorded most recently.
+
+	int result = -1;
+	RecordOffset resultOffset = 0;
+	for (int varID = 0; varID < 256; varID++) {
+		RecordOffset offset = latestVarNameRec[varID];
+		if ((offset > resultOffset) && (0 == strcmp(varName, varNameAt(offset)))) {
+			result = varID;
+			resultOffset = offset;
 		}
-		src = recordAfter(src);
 	}
-	if (nameRec) dst = copyChunk(dst, nameRec);
-	varProcessed[id] = true;
-	return dst;
+	return result;
 }
 
+#else
+
+#define VAR_HASH_SLOTS 256 // must be a power of two
+
+static uint16_t varNameHash[VAR_HASH_SLOTS]; // variable ID + 1, or zero for an empty slot
+
+static uint32_t hashVarName(const char *s) {
+	uint32_t h = 2166136261; // FNV-1a
+	while (*s) h = (h ^ (uint8) *s++) * 16777619;
+	return h;
+}
+
+static void addToVarNameHash(int varID) {
+	int i = hashVarName(varNameAt(latestVarNameRec[varID])) & (VAR_HASH_SLOTS - 1);
+	while (varNameHash[i]) i = (i + 1) & (VAR_HASH_SLOTS - 1);
+	varNameHash[i] = varID + 1;
+}
+
+static void rebuildVarNameHash() {
+	memset(varNameHash, 0, sizeof(varNameHash));
+	for (int i = 0; i < 256; i++) {
+		if (latestVarNameRec[i]) addToVarNameHash(i);
+	}
+}
+
+static void rebuildVarNameIndex() {
+	findLatestVarNames();
+	rebuildVarNameHash();
+}
+
+static void clearVarNameIndex() {
+	memset(latestVarNameRec, 0, sizeof(latestVarNameRec));
+	memset(varNameHash, 0, sizeof(varNameHash));
+}
+
+static void updateVarNameIndex(int *rec) {
+	// Update the index for a newly appended variable name record.
+
+	int varID = (*rec >> 8) & 0xFF;
+	RecordOffset oldOffset = latestVarNameRec[varID];
+	RecordOffset newOffset = rec - ((0 == current) ? start0 : start1);
+	latestVarNameRec[varID] = newOffset;
+	if (!oldOffset) {
+		addToVarNameHash(varID);
+	} else if (0 != strcmp(varNameAt(oldOffset), varNameAt(newOffset))) {
+		rebuildVarNameHash(); // variable was renamed
+	}
+}
+
+int indexOfVarNamed(const char *varName) {
+	// Return the index of the given variable or -1 if not found. If several variables
+	// have the same name, return the one whose name was recorded most recently.
+
+	int result = -1;
+	RecordOffset resultOffset = 0;
+	int i = hashVarName(varName) & (VAR_HASH_SLOTS - 1);
+	for (int probes = 0; (probes < VAR_HASH_SLOTS) && varNameHash[i]; probes++) {
+		int varID = varNameHash[i] - 1;
+		RecordOffset offset = latestVarNameRec[varID];
+		if ((offset > resultOffset) && (0 == strcmp(varName, varNameAt(offset)))) {
+			result = varID;
+			resultOffset = offset;
+		}
+		i = (i + 1) & (VAR_HASH_SLOTS - 1);
+	}
+	return result;
+}
+
+#endif
+
+char * varNameForIndex(int varIndex) {
+	// Return the name of the given variable or NULL if it does not have one.
+
+	if ((varIndex < 0) || (varIndex > 255) || !latestVarNameRec[varIndex]) return NULL;
+	return varNameAt(latestVarNameRec[varIndex]);
+}
+
+// Flash Compaction
+
+#ifndef RAM_CODE_STORE
+
 static void compactFlash() {
 	// Copy only the most recent chunk and variable records to the other half-space.
 	// Details:
 	//	1. erase the other half-space
-	//	2. clear the chunk and variable processed flags
-	//	3. find the start point for the scan (half space start or after latest 'deleteAll' record)
-	//	4. for each chunk and variable record in the current half-space
-	//		a. if the chunk or variable has been processed, skip it
-	//		b. gather the most recent information about that chunk or variable
-	//		c. copy that information into the other half-space
-	//		d. mark the chunk or variable as processed
+	//	2. find the start point for the scan (half space start or after latest 'deleteAll' record)
+	//	3. build the index of the most recent records
+	//	4. copy each record that is the most recent for its chunk or variable to the other half-space
 	//	5. switch to the other half-space
 	//	6. remember the free pointer for the new half-space
 
-	// clear the processed flags
-	memset(chunkProcessed, 0, sizeof(chunkProcessed));
-	memset(varProcessed, 0, sizeof(varProcessed));
+	latestCheckpoint = NULL; // checkpoints are not copied
 
 	// clear the destination half-space and init dst pointer
 	clearHalfSpace(!current);
 	int *dst = ((0 == !current) ? start0 : start1) + 1;
 
 	int *src = compactionStartRecord(NULL);
+	buildLatestRecordIndex(src);
 	while (src) {
-		int header = *src;
-		int type = (header >> 16) & 0xFF;
-		int id = (header >> 8) & 0xFF;
-		if ((chunkCode <= type) && (type <= chunkDeleted)) {
-			dst = copyChunkInfo(id, src, dst);
-		} else if ((varName <= type) && (type <= varsClearAll)) {
-			dst = copyVarInfo(id, src, dst);
-		}
+		if (keepRecord(src)) dst = copyChunk(dst, src);
 		src = recordAfter(src);
 	}
 
@@ -773,6 +1276,7 @@ static void compactFlash() {
 	freeStart = dst;
 
 	updateChunkTable();
+	writeCheckpoint();
 
 	#if defined(NRF51) || defined(ARDUINO_BBC_MICROBIT_V2)
 		// Compaction messes up the serial port on the micro:bit v1 and v2 and Calliope
@@ -792,20 +1296,6 @@ static void compactFlash() {
 
 #ifdef RAM_CODE_STORE
 
-static int keepCodeChunk(int id, int header, int *start) {
-	// Return true if this code chunk should be kept when compacting RAM.
-
-	if (unusedChunk == chunks[id].chunkType) return false; // code chunk was deleted
-
-	int *rec = start;
-	while (rec) {
-		// superceded only if all fields of header match (i.e. type, id, attributeType)
-		if (*rec == header) return false; // superceded
-		rec = recordAfter(rec);
-	}
-	return true;
-}
-
 static void compactRAM(int printStats) {
 	// Compact a RAM-based code store in place. In-place compaction is possible in RAM since,
 	// unlike Flash memory, RAM can be re-written without first erasing it. This approach
@@ -819,44 +1309,31 @@ static void compactRAM(int printStats) {
 	//
 	// Details:
 	//	1. find the start point for the scan (half space start or after latest 'deleteAll' record)
-	//	2. find the most recent "varsClearAll" record
+	//	2. build the index of the most recent records
 	//	3. for each chunk and variable record in the current half-space
 	//		a. deterimine if the record should be kept or skipped
 	//		b. if kept, copy the record down to the destination pointer
 	//	4. update the free pointer
-	//	5. clear the rest of the code store
+	//	5. clear the space vacated by compaction
 	//	6. update the compaction count
 	//	7. re-write the code file
 
 	int *dst = ((0 == !current) ? start0 : start1) + 1;
 	int *src = compactionStartRecord();
+	int *oldFreeStart = freeStart;
 
 	if (!src) return; // nothing to compact
 
-	// find the most recent varsClearAll record
-	int *varsStart = src;
-	int *rec = src;
-	while (rec) {
-		if (varsClearAll == ((*rec >> 16) & 0xFF)) varsStart = rec;
-		rec = recordAfter(rec);
-	}
-
+	buildLatestRecordIndex(src);
+	latestCheckpoint = NULL; // checkpoints are not copied
 	while (src) {
-		int *next = recordAfter(src);
-		int header = *src;
-		int type = (header >> 16) & 0xFF;
-		int id = (header >> 8) & 0xFF;
-		if ((chunkCode <= type) && (type <= chunkAttribute) && keepCodeChunk(id, header, next)) {
-			dst = copyChunk(dst, src);
-		} else if ((varName == type) && (src >= varsStart)) {
-			dst = copyChunk(dst, src);
-		} else {
-		}
+		int *next = recordAfter(src); // get next record before src is overwritten
+		if (keepRecord(src)) dst = copyChunk(dst, src);
 		src = next;
 	}
 
 	freeStart = dst;
-	memset(freeStart, 0, (4 * (end0 - freeStart))); // clear everything following freeStart
+	flashErase(freeStart, oldFreeStart); // the rest of the store is already erased
 
 	updateChunkTable();
 
@@ -868,6 +1345,8 @@ static void compactRAM(int printStats) {
 		writeCodeFile((uint8 *) codeStart, 4 * (freeStart - codeStart));
 	#endif
 
+	writeCheckpoint();
+
 	if (printStats) {
 		char s[100];
 		int bytesUsed = 4 * (freeStart - ((0 == current) ? start0 : start1));
@@ -889,12 +1368,26 @@ void clearPersistentMemory() {
 	clearHalfSpace(current);
 	freeStart = (0 == current) ? start0 + 1 : start1 + 1;
 	setCycleCount(current, count + 1);
+	latestCheckpoint = NULL;
+	recordsSinceCheckpoint = 0;
+	clearVarNameIndex();
+
+	#ifdef COMPRESS_CHUNKS
+		forgetExpansionRecords(); // record addresses will be reused
+	#endif
+}
+
+int persistentCycleCount() {
+	// Return the cycle count of the current half-space, which a code file header must match.
+
+	return cycleCount(current);
 }
 
 int * appendPersistentRecord(int recordType, int id, int extra, int byteCount, uint8 *data) {
 	// Append the given record at the end of the current half-space and return it's address.
 	// Header word: <tag = 'R'><record type><id of chunk/variable/comment><extra> (8-bits each)
 	// Perform a compaction if necessary.
+	if (recordsSinceCheckpoint >= CHECKPOINT_INTERVAL) writeCheckpoint();
 	int wordCount = (byteCount + 3) / 4;
 	int *end = (0 == current) ? end0 : end1;
 	if ((freeStart + 2 + wordCount) > end) {
@@ -932,6 +1425,15 @@ int * appendPersistentRecord(int recordType, int id, int extra, int byteCount, u
 	flashWriteWord(freeStart++, wordCount);
 	if (wordCount) flashWriteData(freeStart, wordCount, data);
 	freeStart += wordCount;
+	recordsSinceCheckpoint++;
+	if (varName == recordType) {
+		updateVarNameIndex(result);
+	} else if (varsClearAll == recordType) {
+		clearVarNameIndex();
+	} else if (deleteAll == recordType) {
+		latestCheckpoint = NULL;
+		clearVarNameIndex();
+	}
 	return result;
 }
 
@@ -948,9 +1450,11 @@ void restoreScripts() {
 
 	#if USE_CODE_FILE
 		initCodeFile(flash, HALF_SPACE);
+		initPersistentMemory(); // find the end of the records loaded from the code file
 	#endif
 
 	updateChunkTable();
+	if (recordsSinceCheckpoint >= CHECKPOINT_INTERVAL) writeCheckpoint();
 
 	// Give feedback:
 	int chunkCount = 0;
@@ -985,9 +1489,17 @@ void suspendCodeFileUpdates() {
 void resumeCodeFileUpdates() {
 	#ifdef USE_CODE_FILE
 		if (suspendFileUpdates) {
+			suspendFileUpdates = false;
 			compactRAM(false); // also updates code file
 		}
-		suspendFileUpdates = false;
+	#endif
+}
+
+int codeFileUpdatesSuspended() {
+	#ifdef USE_CODE_FILE
+		return suspendFileUpdates;
+	#else
+		return false;
 	#endif
 }
 
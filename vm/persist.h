@@ -18,9 +18,11 @@ extern "C" {
 //	word count (32-bits)
 //	... word count data words ...
 //
-// Not all record types use the <extra> header field.
+// Not all record types use the <extra> header field. For chunkCode records, it holds
+// the chunk type and the COMPRESSED_CHUNK flag.
 
 #define PERSISTENT_HEADER_WORDS 2
+#define COMPRESSED_CHUNK 0x80
 
 typedef enum {
 	chunkCode = 10,
@@ -28,6 +30,7 @@ typedef enum {
 	chunkDeleted = 19,
 	varName = 21,
 	varsClearAll = 29,
+	checkpoint = 40,
 	deleteAll = 218, // 218 in hex is 0xDA, short for "delete all"
 } RecordType_t;
 
@@ -44,9 +47,20 @@ typedef enum {
 
 int * appendPersistentRecord(int recordType, int id, int extra, int byteCount, uint8 *data);
 void clearPersistentMemory();
+int persistentCycleCount();
 int * recordAfter(int *lastRecord);
 void restoreScripts();
 int *scanStart();
+char * varNameForIndex(int varIndex);
+
+// Compressed Chunks (see persist.c)
+
+#ifdef COMPRESS_CHUNKS
+	int compressChunk(uint8 *data, int byteCount);
+	OBJ expandedChunkCode(int chunkIndex);
+#else
+	#define expandedChunkCode(chunkIndex) (chunks[chunkIndex].code)
+#endif
 
 // File-Based Persistent Memory Operations
 
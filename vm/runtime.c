@@ -25,6 +25,7 @@
 // Forward Reference Declarations
 
 static void sendMessage(int msgType, int chunkIndex, int dataSize, char *data);
+static int receiveBufferKBytes();
 
 // Named Primitive Support
 
@@ -124,6 +125,7 @@ void primsInit() {
 	// Note: when adding a new primitive set, increase MAX_PRIM_SETS if necessary.
 
 	addDataPrims();
+	addDataLogPrims();
 	addDisplayPrims();
 	addFilePrims();
 	addIOPrims();
@@ -160,11 +162,17 @@ void startTaskForChunk(uint8 chunkIndex) {
 		return;
 	}
 
+	OBJ code = expandedChunkCode(chunkIndex);
+	if (!code) {
+		outputString("Not enough memory to start task");
+		return;
+	}
+
 	memset(&tasks[i], 0, sizeof(Task));
 	tasks[i].status = running;
 	tasks[i].taskChunkIndex = chunkIndex;
 	tasks[i].currentChunkIndex = chunkIndex;
-	tasks[i].code = chunks[chunkIndex].code;
+	tasks[i].code = code;
 	tasks[i].ip = PERSISTENT_HEADER_WORDS; // relative to start of code
 	tasks[i].sp = 0; // relative to start of stack
 	tasks[i].fp = 0; // 0 means "not in a function call"
@@ -228,7 +236,9 @@ void stopAllTasksButThis(Task *thisTask) {
 #define initLocals 28
 
 int broadcastMatches(uint8 chunkIndex, char *msg, int byteCount) {
-	uint32 *code = (uint32 *) chunks[chunkIndex].code + PERSISTENT_HEADER_WORDS;
+	OBJ chunkCode = expandedChunkCode(chunkIndex);
+	if (!chunkCode) return false;
+	uint32 *code = (uint32 *) chunkCode + PERSISTENT_HEADER_WORDS;
 	// First three instructions of a broadcast hat should be:
 	//	initLocals
 	//	pushLiteral
@@ -377,7 +387,16 @@ static void storeCodeChunk(uint8 chunkIndex, int byteCount, uint8 *data) {
 	if (chunkIndex >= MAX_CHUNKS) return;
 	stopTaskForChunk(chunkIndex);
 	int chunkType = data[0]; // first byte is the chunk type
-	int *persistenChunk = appendPersistentRecord(chunkCode, chunkIndex, chunkType, byteCount - 1, &data[1]);
+	int extra = chunkType;
+	int recordBytes = byteCount - 1;
+	#ifdef COMPRESS_CHUNKS
+		int compressedBytes = compressChunk(&data[1], recordBytes);
+		if (compressedBytes) {
+			extra |= COMPRESSED_CHUNK;
+			recordBytes = compressedBytes;
+		}
+	#endif
+	int *persistenChunk = appendPersistentRecord(chunkCode, chunkIndex, extra, recordBytes, &data[1]);
 	chunks[chunkIndex].code = persistenChunk;
 	chunks[chunkIndex].chunkType = chunkType;
 }
@@ -411,7 +430,7 @@ static void deleteAllChunks() {
 	stopAllTasks();
 	#if defined(ESP8266) || defined(ARDUINO_ARCH_ESP32) || defined(GNUBLOCKS) || defined(RP2040_PHILHOWER)
 		clearPersistentMemory();
-		clearCodeFile(0);
+		clearCodeFile(persistentCycleCount());
 	#else
 		appendPersistentRecord(deleteAll, 0, 0, 0, NULL);
 	#endif
@@ -488,11 +507,18 @@ static int outBufEnd = 0;
 static uint32 lastSendMSecs = 0; // used to detect when serial is connected and accepting data
 
 static inline void sendData() {
+	// Send as much buffered data as the serial port will accept. The buffered data is
+	// sent as at most two contiguous spans, one on each side of the buffer wrap point.
+
 	int someDataSent = false;
 	while (outBufStart != outBufEnd) {
-		if (!sendByte(outBuf[outBufStart])) break;
-		outBufStart = (outBufStart + 1) & OUTBUF_MASK;
+		int spanEnd = (outBufEnd > outBufStart) ? outBufEnd : OUTBUF_SIZE;
+		int spanSize = spanEnd - outBufStart;
+		int sentCount = sendBytes(outBuf, outBufStart, spanEnd);
+		if (sentCount <= 0) break;
+		outBufStart = (outBufStart + sentCount) & OUTBUF_MASK;
 		someDataSent = true;
+		if (sentCount < spanSize) break; // serial port is full
 	}
 	if (someDataSent) lastSendMSecs = millisecs();
 }
@@ -508,6 +534,24 @@ static inline void queueByte(uint8 aByte) {
 	outBufEnd = (outBufEnd + 1) & OUTBUF_MASK;
 }
 
+static void queueBytes(const char *bytes, int byteCount) {
+	// Append byteCount bytes to the output buffer. The caller must ensure there is room.
+
+	int firstPart = OUTBUF_SIZE - outBufEnd; // bytes that fit before the wrap point
+	if (byteCount <= firstPart) {
+		memcpy(&outBuf[outBufEnd], bytes, byteCount);
+	} else {
+		memcpy(&outBuf[outBufEnd], bytes, firstPart);
+		memcpy(&outBuf[0], bytes + firstPart, byteCount - firstPart);
+	}
+	outBufEnd = (outBufEnd + byteCount) & OUTBUF_MASK;
+}
+
+static void queueMessageHeader(int msgType, int chunkIndex, int dataSize) {
+	char header[5] = { (char) 251, msgType, chunkIndex, dataSize & 0xFF, (dataSize >> 8) & 0xFF };
+	queueBytes(header, sizeof(header));
+}
+
 static void sendMessage(int msgType, int chunkIndex, int dataSize, char *data) {
 	if (!data) { // short message
 		if (!hasOutputSpace(3)) return; // no space; drop message
@@ -517,14 +561,8 @@ static void sendMessage(int msgType, int chunkIndex, int dataSize, char *data) {
 	} else {
 		int totalBytes = 5 + dataSize;
 		if (!hasOutputSpace(totalBytes)) return; // no space; drop message
-		queueByte(251);
-		queueByte(msgType);
-		queueByte(chunkIndex);
-		queueByte(dataSize & 0xFF); // low byte of size
-		queueByte((dataSize >> 8) & 0xFF); // high byte of size
-		for (int i = 0; i < dataSize; i++) {
-			queueByte(data[i]);
-		}
+		queueMessageHeader(msgType, chunkIndex, dataSize);
+		queueBytes(data, dataSize);
 	}
 }
 
@@ -545,13 +583,12 @@ void waitAndSendMessage(int msgType, int chunkIndex, int dataSize, char *data) {
 	sendMessage(msgType, chunkIndex, dataSize, data);
 }
 
-static void sendValueMessage(uint8 msgType, uint8 chunkOrVarIndex, OBJ value) {
-	// Send a value message of the given type for the given chunkOrVarIndex.
+static int encodeValue(OBJ value, char *data) {
+	// Encode the given value into data (at least 801 bytes) and return the byte count.
+	// Return zero if the value cannot be encoded.
 	// Data is: <type (1 byte)><...data...>
 	// Types: 1 - integer, 2 - string, 3 - boolean, 4 - list, 5 - bytearray
 
-	char data[801];
-
 	if (isInt(value)) { // 32-bit integer, little endian
 		data[0] = 1;  // data type (1 is integer)
 		int n = obj2int(value);
@@ -559,23 +596,21 @@ static void sendValueMessage(uint8 msgType, uint8 chunkOrVarIndex, OBJ value) {
 		data[2] = ((n >> 8) & 0xFF);
 		data[3] = ((n >> 16) & 0xFF);
 		data[4] = ((n >> 24) & 0xFF);
-		sendMessage(msgType, chunkOrVarIndex, 5, data);
+		return 5;
 	} else if (IS_TYPE(value, StringType)) {
 		data[0] = 2; // data type (2 is string)
 		char *s = obj2str(value);
 		int len = strlen(s);
 		int sendCount = (len > 800) ? 800 : len;
-		for (int i = 0; i < sendCount; i++) {
-			data[i + 1] = s[i];
-		}
+		memcpy(&data[1], s, sendCount);
 		if (len > 800) {
 			memcpy(&data[798], "...", 3); // string was truncated; add ellipses
 		}
-		sendMessage(msgType, chunkOrVarIndex, (sendCount + 1), data);
+		return (sendCount + 1);
 	} else if ((value == trueObj) || (value == falseObj)) {
 		data[0] = 3; // data type (3 is boolean)
 		data[1] = (trueObj == value) ? 1 : 0;
-		sendMessage(msgType, chunkOrVarIndex, 2, data);
+		return 2;
 	} else if (IS_TYPE(value, ListType)) {
 		data[0] = 4; // data type (4 is list)
 		// Note: xxx Does not handle sublists.
@@ -628,7 +663,7 @@ static void sendValueMessage(uint8 msgType, uint8 chunkOrVarIndex, OBJ value) {
 				*dst++ = 0; // item type (0 is unknown)
 			}
 		}
-		sendMessage(msgType, chunkOrVarIndex, (dst - data), data);
+		return (dst - data);
 	} else if (IS_TYPE(value, ByteArrayType)) {
 		data[0] = 5; // data type (5 is bytearray)
 		char *dst = &data[1];
@@ -639,11 +674,18 @@ static void sendValueMessage(uint8 msgType, uint8 chunkOrVarIndex, OBJ value) {
 		uint8 *bytes = (uint8 *) &FIELD(value, 0);
 		int sendCount = (byteCount < 100) ? byteCount : 100; // send up to 100 bytes
 		*dst++ = sendCount;
-		for (int i = 0; i < sendCount; i++) {
-			*dst++ = bytes[i];
-		}
-		sendMessage(msgType, chunkOrVarIndex, (sendCount + 4), data);
+		memcpy(dst, bytes, sendCount);
+		return (sendCount + 4);
 	}
+	return 0; // unsupported type
+}
+
+static void sendValueMessage(uint8 msgType, uint8 chunkOrVarIndex, OBJ value) {
+	// Send a value message of the given type for the given chunkOrVarIndex.
+
+	char data[801];
+	int byteCount = encodeValue(value, data);
+	if (byteCount > 0) sendMessage(msgType, chunkOrVarIndex, byteCount, data);
 }
 
 void logData(char *s) {
@@ -653,9 +695,7 @@ void logData(char *s) {
 	data[0] = 2; // data type (2 is string)
 	int byteCount = strlen(s);
 	if (byteCount > (int) (sizeof(data) - 1)) byteCount = sizeof(data) - 1;
-	for (int i = 0; i < byteCount; i++) {
-		data[i + 1] = s[i];
-	}
+	memcpy(&data[1], s, byteCount);
 	sendMessage(outputValueMsg, 254, (byteCount + 1), data);
 }
 
@@ -668,9 +708,7 @@ void outputString(const char *s) {
 	data[0] = 2; // data type (2 is string)
 	int byteCount = strlen(s);
 	if (byteCount > (int) (sizeof(data) - 1)) byteCount = sizeof(data) - 1;
-	for (int i = 0; i < byteCount; i++) {
-		data[i + 1] = s[i];
-	}
+	memcpy(&data[1], s, byteCount);
 
 	waitForOutbufBytes(byteCount + 50);
 	sendMessage(outputValueMsg, 255, (byteCount + 1), data);
@@ -737,10 +775,12 @@ static void setVariableValue(int varID, int byteCount, uint8 *data) {
 }
 
 static void sendVersionString() {
+	// The ID field is the size of the receive buffer in KB; the IDE sizes chunk batches to fit.
+
 	char s[100];
 	snprintf(s, sizeof(s), " %s %s", VM_VERSION, boardType());
 	s[0] = 2; // data type (2 is string)
-	sendMessage(versionMsg, 0, strlen(s), s);
+	sendMessage(versionMsg, receiveBufferKBytes(), strlen(s), s);
 }
 
 void sendBroadcastToIDE(char *s, int len) {
@@ -791,6 +831,92 @@ const uint32_t crcTable[] = {
 0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D};
 
+// All implementations below compute the standard (zlib/Ethernet) CRC-32 and return
+// identical results. The IDE depends on that when comparing chunk CRCs.
+
+#if defined(__ARM_FEATURE_CRC32)
+
+// ARMv8 CRC32 instructions (e.g. 64-bit Raspberry Pi OS)
+
+#include <arm_acle.h>
+
+uint32_t crc32(uint8_t *buf, int byteCount) {
+	uint32_t crc = ~0;
+	uint8_t *p = buf;
+	uint8_t *end = buf + byteCount;
+	while ((p < end) && ((uintptr_t) p & 7)) crc = __crc32b(crc, *p++);
+	while ((end - p) >= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		crc = __crc32d(crc, w);
+		p += 8;
+	}
+	while (p < end) crc = __crc32b(crc, *p++);
+	return ~crc;
+}
+
+#elif defined(ARDUINO_ARCH_ESP32)
+
+// ESP32 ROM CRC routine (handles the initial and final inversion itself)
+
+#include "rom/crc.h"
+
+uint32_t crc32(uint8_t *buf, int byteCount) {
+	return crc32_le(0, buf, byteCount);
+}
+
+#elif defined(GNUBLOCKS) || defined(RP2040_PHILHOWER)
+
+// Slice-by-8: process eight bytes per iteration using eight 256-entry tables.
+// The tables (8K bytes) are derived from crcTable on first use, so this is only
+// used on boards with plenty of RAM. Assumes a little-endian processor.
+
+static uint32_t crcTables[8][256];
+static int crcTablesInitialized = false;
+
+static void initCRCTables() {
+	for (int i = 0; i < 256; i++) crcTables[0][i] = crcTable[i];
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = crcTable[i];
+		for (int t = 1; t < 8; t++) {
+			crc = (crc >> 8) ^ crcTable[crc & 0xff];
+			crcTables[t][i] = crc;
+		}
+	}
+	crcTablesInitialized = true;
+}
+
+uint32_t crc32(uint8_t *buf, int byteCount) {
+	if (!crcTablesInitialized) initCRCTables();
+
+	uint32_t crc = ~0;
+	uint8_t *p = buf;
+	uint8_t *end = buf + byteCount;
+	while ((p < end) && ((uintptr_t) p & 3)) {
+		crc = (crc >> 8) ^ crcTable[(crc & 0xff) ^ *p++];
+	}
+	while ((end - p) >= 8) {
+		uint32_t lo, hi;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc =
+			crcTables[7][lo & 0xff] ^ crcTables[6][(lo >> 8) & 0xff] ^
+			crcTables[5][(lo >> 16) & 0xff] ^ crcTables[4][lo >> 24] ^
+			crcTables[3][hi & 0xff] ^ crcTables[2][(hi >> 8) & 0xff] ^
+			crcTables[1][(hi >> 16) & 0xff] ^ crcTables[0][hi >> 24];
+		p += 8;
+	}
+	while (p < end) {
+		crc = (crc >> 8) ^ crcTable[(crc & 0xff) ^ *p++];
+	}
+	return ~crc;
+}
+
+#else
+
+// Byte-at-a-time version for boards with limited RAM
+
 uint32_t crc32(uint8_t *buf, int byteCount) {
 	uint32_t crc = ~0;
 	uint8_t *end = buf + byteCount;
@@ -800,11 +926,13 @@ uint32_t crc32(uint8_t *buf, int byteCount) {
 	return ~crc;
 }
 
+#endif
+
 void sendChunkCRC(int chunkID) {
 	// Send the 4-byte CRC-32 for the given chunk. Do nothing if the chunk is not in use.
 
 	if ((chunkID < 0) || (chunkID >= MAX_CHUNKS)) return;
-	OBJ code = chunks[chunkID].code;
+	OBJ code = expandedChunkCode(chunkID);
 	if (code) {
 		int wordCount = *(code + 1); // size is the second word in the persistent store record
 		uint8_t *chunkData = (uint8_t *) (code + PERSISTENT_HEADER_WORDS);
@@ -826,33 +954,225 @@ void sendAllCRCs() {
 	// send message header
 	int dataSize = 5 * chunkCount;
 	waitForOutbufBytes(10);
-	queueByte(251);
-	queueByte(allCRCsMsg);
-	queueByte(0);
-	queueByte(dataSize & 0xFF); // low byte of size
-	queueByte((dataSize >> 8) & 0xFF); // high byte of size
+	queueMessageHeader(allCRCsMsg, 0, dataSize);
 
 	// send CRC records for chunks in use
 	// each record is 5 bytes: chunkID (one byte) + the CRC for that chunk (four bytes)
 	int delayPerCRC = extraByteDelay / 250;  // msec delay for 4 bytes (extraByteDelay is in usecs)
+	#ifdef GNUBLOCKS
+		delayPerCRC = 0; // pseudoterminal has no baud rate limit
+	#endif
 	for (int i = 0; i < MAX_CHUNKS; i++) {
 		if (chunks[i].code) {
-			OBJ code = chunks[i].code;
-			int wordCount = *(code + 1); // size is the second word in the persistent store record
-			uint8_t *chunkData = (uint8_t *) (code + PERSISTENT_HEADER_WORDS);
-			uint32_t crc = crc32(chunkData, (4 * wordCount));
-			char *crcBytes = (char *) &crc;
+			OBJ code = expandedChunkCode(i);
+			uint32_t crc = 0; // if the chunk could not be expanded, the IDE will resend it
+			if (code) {
+				int wordCount = *(code + 1); // size is the second word in the persistent store record
+				uint8_t *chunkData = (uint8_t *) (code + PERSISTENT_HEADER_WORDS);
+				crc = crc32(chunkData, (4 * wordCount));
+			}
 			waitForOutbufBytes(5);
 			queueByte(i);
-			queueByte(crcBytes[0]);
-			queueByte(crcBytes[1]);
-			queueByte(crcBytes[2]);
-			queueByte(crcBytes[3]);
+			queueBytes((char *) &crc, 4);
 			delay(delayPerCRC);
 		}
 	}
 }
 
+// Batched chunk transfer
+
+static int validChunkBatch(int byteCount, uint8 *data) {
+	// Return true if the batch has a correct CRC and its records exactly fill the body.
+	// The body is a sequence of records followed by the CRC-32 of those records.
+	// Each record is: <op> <chunk or var ID> <size LSB> <size MSB> <size bytes of data>
+
+	if (byteCount < 4) return false;
+	int recordBytes = byteCount - 4;
+	uint32_t crc;
+	memcpy(&crc, &data[recordBytes], 4);
+	if (crc != crc32(data, recordBytes)) return false;
+
+	int i = 0;
+	while (i < recordBytes) {
+		if ((i + 4) > recordBytes) return false;
+		i += 4 + ((data[i + 3] << 8) | data[i + 2]);
+	}
+	return (i == recordBytes);
+}
+
+static void storeChunkBatch(int byteCount, uint8 *data) {
+	// Store a batch of chunks, attributes, and variable names sent as a single message.
+	// A batch with a bad CRC or malformed records is discarded; the IDE detects and
+	// resends the missing chunks when it compares CRCs (getAllCRCsMsg).
+
+	if (!validChunkBatch(byteCount, data)) return;
+
+	// defer code file updates so the entire batch is written to the code file once
+	int wasSuspended = codeFileUpdatesSuspended();
+	if (!wasSuspended) suspendCodeFileUpdates();
+
+	uint8 *end = data + (byteCount - 4);
+	uint8 *p = data;
+	while (p < end) {
+		int op = p[0];
+		int id = p[1];
+		int recordBytes = (p[3] << 8) | p[2];
+		uint8 *body = &p[4];
+		switch (op) {
+		case chunkCodeMsg:
+			if (recordBytes > 0) storeCodeChunk(id, recordBytes, body);
+			break;
+		case chunkAttributeMsg:
+			if (recordBytes > 0) storeChunkAttribute(id, recordBytes, body);
+			break;
+		case varNameMsg:
+			storeVarName(id, recordBytes, body);
+			break;
+		case deleteChunkMsg:
+			deleteCodeChunk(id);
+			break;
+		}
+		p = body + recordBytes;
+	}
+
+	if (!wasSuspended) resumeCodeFileUpdates();
+}
+
+// Variable watch subscriptions
+
+// The IDE can subscribe to a set of global variables rather than polling each one with
+// getVarMsg. The VM checks the watched variables periodically and sends the values that
+// have changed since they were last sent, coalesced into a single varValuesMsg. Changes
+// are detected by comparing the CRC of each variable's encoded value, so in-place changes
+// to lists and byte arrays are also detected.
+
+#define MAX_WATCHED_VARS 32
+#define MAX_WATCH_MSG_BYTES 500 // leave room in outBuf for other messages
+
+static uint8 watchedVars[MAX_WATCHED_VARS];
+static uint32_t watchedCRCs[MAX_WATCHED_VARS];
+static uint32_t watchSentMask = 0; // bit i is set if watchedCRCs[i] is valid
+static int watchCount = 0;
+static int watchIntervalMSecs = 100;
+static uint32 lastWatchMSecs = 0;
+
+static void setWatchedVariables(int interval, int byteCount, uint8 *data) {
+	// Replace the watched variable list. Each data byte is a variable ID. The interval
+	// is the minimum time between updates in units of 10 msecs (0 means 100 msecs).
+	// An empty list cancels all subscriptions.
+
+	watchCount = 0;
+	for (int i = 0; (i < byteCount) && (watchCount < MAX_WATCHED_VARS); i++) {
+		if (data[i] < MAX_VARS) watchedVars[watchCount++] = data[i];
+	}
+	watchIntervalMSecs = (interval > 0) ? (10 * interval) : 100;
+	watchSentMask = 0; // send all watched values on the next update
+	lastWatchMSecs = millisecs() - watchIntervalMSecs;
+}
+
+static void sendWatchedVariables() {
+	// Send a varValuesMsg with the watched variables whose values have changed.
+	// Each record is: <varID> <size LSB> <size MSB> <value (as in varValueMsg)>
+
+	if (!watchCount) return;
+	uint32 now = millisecs();
+	if ((now - lastWatchMSecs) < (uint32) watchIntervalMSecs) return;
+	lastWatchMSecs = now;
+
+	// find changed variables and compute the message size
+	char data[801];
+	uint32_t changedMask = 0;
+	int msgSize = 0;
+	for (int i = 0; i < watchCount; i++) {
+		int byteCount = encodeValue(vars[watchedVars[i]], data);
+		if (!byteCount) continue;
+		uint32_t crc = crc32((uint8_t *) data, byteCount);
+		if ((watchSentMask & ((uint32_t) 1 << i)) && (crc == watchedCRCs[i])) continue; // unchanged
+		if ((msgSize > 0) && ((msgSize + 3 + byteCount) > MAX_WATCH_MSG_BYTES)) break; // rest go next time
+		changedMask |= ((uint32_t) 1 << i);
+		msgSize += 3 + byteCount;
+	}
+	if (!changedMask || !hasOutputSpace(msgSize + 5)) return; // nothing to send or no room (retry later)
+
+	queueMessageHeader(varValuesMsg, 0, msgSize);
+	for (int i = 0; i < watchCount; i++) {
+		if (!(changedMask & ((uint32_t) 1 << i))) continue;
+		int byteCount = encodeValue(vars[watchedVars[i]], data);
+		queueByte(watchedVars[i]);
+		queueByte(byteCount & 0xFF);
+		queueByte((byteCount >> 8) & 0xFF);
+		queueBytes(data, byteCount);
+		watchedCRCs[i] = crc32((uint8_t *) data, byteCount);
+		watchSentMask |= ((uint32_t) 1 << i);
+	}
+}
+
+// Telemetry
+
+// The telemetry primitive records timestamped samples of integer values without the
+// per-byte pacing of the say and graph blocks. Samples are packed into a frame that is
+// sent as a telemetryMsg when it is full or TELEMETRY_FLUSH_MSECS after its first sample.
+// If the output buffer has no room for a full frame, new samples are dropped and counted.
+//
+// Frame body: <dropped sample count (2 bytes)> followed by samples of the form:
+//	<timestamp usecs (4 bytes)> <value count (1 byte)> <values (4 bytes each)>
+// All multi-byte fields are little endian.
+
+#if defined(GNUBLOCKS) || defined(ARDUINO_ARCH_ESP32) || defined(RP2040_PHILHOWER)
+	#define TELEMETRY_FRAME_BYTES 960
+#else
+	#define TELEMETRY_FRAME_BYTES 240
+#endif
+#define TELEMETRY_FLUSH_MSECS 50
+
+static uint8 telemetryFrame[TELEMETRY_FRAME_BYTES];
+static int telemetryBytes = 2; // first two bytes are the dropped sample count
+static int telemetryDropped = 0;
+static uint32 telemetryStartMSecs = 0;
+
+static int flushTelemetry() {
+	// Send the current telemetry frame, if any. Return false if there was no room.
+
+	if (telemetryBytes <= 2) return true; // empty frame
+	if (!hasOutputSpace(telemetryBytes + 5)) return false;
+	int dropped = (telemetryDropped > 0xFFFF) ? 0xFFFF : telemetryDropped;
+	telemetryFrame[0] = dropped & 0xFF;
+	telemetryFrame[1] = (dropped >> 8) & 0xFF;
+	queueMessageHeader(telemetryMsg, 0, telemetryBytes);
+	queueBytes((char *) telemetryFrame, telemetryBytes);
+	telemetryBytes = 2;
+	telemetryDropped = 0;
+	return true;
+}
+
+static void checkTelemetryFlush() {
+	if ((telemetryBytes > 2) && ((millisecs() - telemetryStartMSecs) >= TELEMETRY_FLUSH_MSECS)) {
+		flushTelemetry();
+	}
+}
+
+int addTelemetrySample(int valueCount, int *values) {
+	// Add a sample to the telemetry frame. Return false if the sample was dropped.
+
+	int sampleBytes = 5 + (4 * valueCount);
+	if ((valueCount > 255) || ((2 + sampleBytes) > TELEMETRY_FRAME_BYTES)) return false;
+	if ((telemetryBytes + sampleBytes) > TELEMETRY_FRAME_BYTES) {
+		if (!flushTelemetry()) {
+			telemetryDropped++;
+			return false;
+		}
+	}
+	if (telemetryBytes == 2) telemetryStartMSecs = millisecs();
+
+	uint32 timestamp = microsecs();
+	uint8 *dst = &telemetryFrame[telemetryBytes];
+	memcpy(dst, &timestamp, 4);
+	dst[4] = valueCount;
+	memcpy(&dst[5], values, 4 * valueCount);
+	telemetryBytes += sampleBytes;
+	return true;
+}
+
 // Retrieving source code and attributes
 
 // static void sendAttributeMessage(int chunkIndex, int attributeID, int *persistentRecord) {
@@ -881,24 +1201,20 @@ void sendAllCRCs() {
 static void sendCodeChunk(int chunkID, int chunkType, int chunkBytes, char *chunkData) {
 	int msgSize = 1 + chunkBytes;
 	waitForOutbufBytes(5 + msgSize);
-	queueByte(251);
-	queueByte(chunkCodeMsg);
-	queueByte(chunkID);
-	queueByte(msgSize & 0xFF); // low byte of size
-	queueByte((msgSize >> 8) & 0xFF); // high byte of size
+	queueMessageHeader(chunkCodeMsg, chunkID, msgSize);
 	queueByte(chunkType); // first byte of msg body is the chunk type
-	char *end = chunkData + chunkBytes;
-	for (char *p = chunkData; p < end; p++) {
-		queueByte(*p);
-	}
+	queueBytes(chunkData, chunkBytes);
 }
 
 static void sendAllCode() {
 	// Send the code and attributes for all chunks to the IDE.
 
 	int delayPerWord = extraByteDelay / 250; // derive from extraByteDelay
+	#ifdef GNUBLOCKS
+		delayPerWord = 0; // pseudoterminal has no baud rate limit; waitForOutbufBytes() paces output
+	#endif
 	for (int chunkID = 0; chunkID < MAX_CHUNKS; chunkID++) {
-		OBJ code = chunks[chunkID].code;
+		OBJ code = expandedChunkCode(chunkID);
 		if (NULL == code) continue; // skip unused chunk entry
 
 		int chunkType = chunks[chunkID].chunkType;
@@ -913,96 +1229,63 @@ static void sendAllCode() {
 
 // Variable support
 
-static void sendVarNameMessage(int varID, int *persistentRecord) {
-	if (!persistentRecord) return; // NULL persistentRecord; do nothing
+static void sendVarNameMessage(int varID, char *varName) {
+	if (!varName) return; // variable has no name; do nothing
 
-	char *varName = (char *) (persistentRecord + 2);
 	int bodyBytes = strlen(varName);
 	waitForOutbufBytes(5 + bodyBytes);
 
-	queueByte(251);
-	queueByte(varNameMsg);
-	queueByte(varID);
-	queueByte(bodyBytes & 0xFF); // low byte of size
-	queueByte((bodyBytes >> 8) & 0xFF); // high byte of size
-	char *src = varName;
-	for (int i = 0; i < bodyBytes; i++) {
-		queueByte(*src++);
-	}
-}
-
-static int* varsStart() {
-	int *p = scanStart();
-
-	// find the last varsClearAll record
-	int *result = p;
-	while (p) {
-		if (varsClearAll == ((*p >> 16) & 0xFF)) result = p;
-		p = recordAfter(p);
-	}
-	return result;
+	queueMessageHeader(varNameMsg, varID, bodyBytes);
+	queueBytes(varName, bodyBytes);
 }
 
 static void sendVarNames() {
 	// Send the names of all variables.
 
-	int *p = varsStart();
-	while (p) {
-		int recType = (*p >> 16) & 0xFF;
-		int varID = (*p >> 8) & 0xFF;
-		if (recType == varName) sendVarNameMessage(varID, p);
-		p = recordAfter(p);
+	for (int varID = 0; varID < 256; varID++) {
+		sendVarNameMessage(varID, varNameForIndex(varID));
 	}
 }
 
-int indexOfVarNamed(const char *s) {
-	// Return the index of the given variable or -1 if not found.
-
-	int result = -1; // default is not found
-	int *p = varsStart();
-	while (p) {
-		int recType = (*p >> 16) & 0xFF;
-		int id = (*p >> 8) & 0xFF;
-		if (recType == varName) {
-			if (0 == strcmp(s, (char *) (p + 2))) result = id;
-		} else if (recType == varsClearAll) {
-			result = -1;
-		}
-		p = recordAfter(p);
-	}
-	return result;
-}
-
 // Receiving Messages from IDE
 
-#define RCVBUF_SIZE 1024
+// Incoming bytes are appended at rcvEnd and messages are parsed in place starting at
+// rcvStart, so several queued messages can be handled per call without moving any data.
+// Message bodies are always contiguous. The only copying happens when the last, partial
+// message reaches the end of the buffer and must be moved to the start to be completed.
+
+#if defined(GNUBLOCKS)
+	#define RCVBUF_SIZE ((64 * 1024) + 16) // room for any message (data size is 16 bits)
+#elif defined(ARDUINO_ARCH_ESP32) || defined(RP2040_PHILHOWER)
+	#define RCVBUF_SIZE (4 * 1024)
+#else
+	#define RCVBUF_SIZE 1024
+#endif
 #define MAX_MSG_SIZE (RCVBUF_SIZE - 10) // 5 header + 1 terminator bytes plus a few extra
 static uint8 rcvBuf[RCVBUF_SIZE];
-static int rcvByteCount = 0;
+static int rcvStart = 0; // index of the first unprocessed byte
+static int rcvEnd = 0; // index following the last received byte
 static uint32 lastRcvTime = 0;
 
-static void skipToStartByteAfter(int startIndex) {
-	int i, nextStart = -1;
-	for (i = startIndex; i < rcvByteCount; i++) {
+static int receiveBufferKBytes() { return RCVBUF_SIZE / 1024; }
+
+#define RCV_BYTES() (rcvEnd - rcvStart)
+
+static void skipToStartByteAfter(int offset) {
+	// Discard bytes up to the next message start at least offset bytes past rcvStart.
+
+	for (int i = rcvStart + offset; i < rcvEnd; i++) {
 		int b = rcvBuf[i];
 		if ((0xFA == b) || (0xFB == b)) {
-			if ((i + 1) < rcvByteCount) {
+			if ((i + 1) < rcvEnd) {
 				b = rcvBuf[i + 1];
-                if ((b == 0) || ((b > LAST_MSG) && (b < 200))) continue; // illegal msg type; keep scanning			}
+				if ((b == 0) || ((b > LAST_MSG) && (b < 200))) continue; // illegal msg type; keep scanning
 			}
-			nextStart = i;
-			break;
+			rcvStart = i;
+			return;
 		}
 	}
-	if (-1 == nextStart) { // no start byte found; clear the entire buffer
-		rcvByteCount = 0;
-		return;
-	}
-	uint8 *dst = &rcvBuf[0];
-	for (i = nextStart; i < rcvByteCount; i++) {
-		*dst++ = rcvBuf[i];
-	}
-	rcvByteCount -= nextStart;
+	rcvStart = rcvEnd = 0; // no start byte found; clear the entire buffer
 }
 
 static int receiveTimeout() {
@@ -1013,15 +1296,19 @@ static int receiveTimeout() {
 	return (usecs - lastRcvTime) > 20000;
 }
 
-static void processShortMessage() {
-	if (rcvByteCount < 3) { // message is not complete
+static int processShortMessage() {
+	// Process a short message. Return false if the message is incomplete.
+
+	uint8 *msg = &rcvBuf[rcvStart];
+	if (RCV_BYTES() < 3) { // message is not complete
 		if (receiveTimeout()) {
 			skipToStartByteAfter(1);
+			return true;
 		}
-		return; // message incomplete
+		return false; // message incomplete
 	}
-	int cmd = rcvBuf[1];
-	int chunkIndex = rcvBuf[2];
+	int cmd = msg[1];
+	int chunkIndex = msg[2];
 	switch (cmd) {
 	case deleteChunkMsg:
 		deleteCodeChunk(chunkIndex);
@@ -1082,55 +1369,68 @@ static void processShortMessage() {
 		}
 	}
 	skipToStartByteAfter(3);
+	return true;
 }
 
-static void processLongMessage() {
-	int msgLength = (rcvBuf[4] << 8) | rcvBuf[3];
-	if ((rcvByteCount >= 5) && (msgLength > MAX_MSG_SIZE)) { // message too large for buffer
+static int processLongMessage() {
+	// Process a long message. Return false if the message is incomplete.
+
+	uint8 *msg = &rcvBuf[rcvStart];
+	int msgLength = (RCV_BYTES() >= 5) ? ((msg[4] << 8) | msg[3]) : 0;
+	if (msgLength > MAX_MSG_SIZE) { // message too large for buffer
 		skipToStartByteAfter(1);
-		return;
+		return true;
 	}
-	if ((rcvByteCount < 5) || (rcvByteCount < (5 + msgLength))) { // message is not complete
+	if ((RCV_BYTES() < 5) || (RCV_BYTES() < (5 + msgLength))) { // message is not complete
 		if (receiveTimeout()) {
 			skipToStartByteAfter(1);
+			return true;
 		}
-		return; // message incomplete
+		return false; // message incomplete
 	}
-	if (0xFE != rcvBuf[5 + msgLength - 1]) { // chunk does not end with a terminator byte
+	if (0xFE != msg[5 + msgLength - 1]) { // chunk does not end with a terminator byte
 		skipToStartByteAfter(1);
-		return;
+		return true;
 	}
-	int cmd = rcvBuf[1];
-	int chunkIndex = rcvBuf[2];
+	int cmd = msg[1];
+	int chunkIndex = msg[2];
+	uint8 *body = &msg[5];
 	int bodyBytes = msgLength - 1; // subtract terminator byte
 	switch (cmd) {
 	case chunkCodeMsg:
-		storeCodeChunk(chunkIndex, bodyBytes, &rcvBuf[5]);
+		storeCodeChunk(chunkIndex, bodyBytes, body);
 		break;
 	case setVarMsg:
-		setVariableValue(rcvBuf[2], bodyBytes, &rcvBuf[5]);
+		setVariableValue(chunkIndex, bodyBytes, body);
 		break;
 	case getVarMsg:
-		sendValueOfVariableNamed(chunkIndex, bodyBytes, &rcvBuf[5]);
+		sendValueOfVariableNamed(chunkIndex, bodyBytes, body);
 		break;
 	case broadcastMsg:
-		startReceiversOfBroadcast((char *) &rcvBuf[5], bodyBytes);
+		startReceiversOfBroadcast((char *) body, bodyBytes);
 		break;
 	case chunkAttributeMsg:
-		storeChunkAttribute(chunkIndex, bodyBytes, &rcvBuf[5]);
+		storeChunkAttribute(chunkIndex, bodyBytes, body);
 		break;
 	case varNameMsg:
-		storeVarName(chunkIndex, bodyBytes, &rcvBuf[5]);
+		storeVarName(chunkIndex, bodyBytes, body);
 		break;
 	case extendedMsg:
-		processExtendedMessage(chunkIndex, bodyBytes, &rcvBuf[5]);
+		processExtendedMessage(chunkIndex, bodyBytes, body);
+		break;
+	case chunkBatchMsg:
+		storeChunkBatch(bodyBytes, body);
+		break;
+	case watchVarsMsg:
+		setWatchedVariables(chunkIndex, bodyBytes, body);
 		break;
 	default:
 		if ((200 <= cmd) && (cmd <= 205)) {
-			processFileMessage(cmd, bodyBytes, (char *) &rcvBuf[5]);
+			processFileMessage(cmd, bodyBytes, (char *) body);
 		}
 	}
 	skipToStartByteAfter(5 + msgLength);
+	return true;
 }
 
 // Uncomment when building on mbed:
@@ -1140,29 +1440,45 @@ static void processLongMessage() {
 // }
 
 void processMessage() {
-	// Process a message from the client.
+	// Process all complete messages from the client.
 
+	sendWatchedVariables();
+	checkTelemetryFlush();
 	sendData();
 
-	int bytesRead = recvBytes(&rcvBuf[rcvByteCount], RCVBUF_SIZE - rcvByteCount);
-	rcvByteCount += bytesRead;
-	if (!rcvByteCount) return;
+	if (rcvEnd == RCVBUF_SIZE) { // move the partial message at rcvStart to the buffer start
+		memmove(rcvBuf, &rcvBuf[rcvStart], RCV_BYTES());
+		rcvEnd -= rcvStart;
+		rcvStart = 0;
+	}
+	int bytesRead = recvBytes(&rcvBuf[rcvEnd], RCVBUF_SIZE - rcvEnd);
+	rcvEnd += bytesRead;
+	if (!RCV_BYTES()) return;
 
 	// the following is needed when built on mbed to avoid dropped bytes
 // 	while (bytesRead > 0) {
 // 		// on Arduino Primo, 100 sometimes fails; use 150 to be safe (character time is ~90 usecs)
 // 		busyWaitMicrosecs(150);
-// 		bytesRead = recvBytes(&rcvBuf[rcvByteCount], RCVBUF_SIZE - rcvByteCount);
-// 		rcvByteCount += bytesRead;
+// 		bytesRead = recvBytes(&rcvBuf[rcvEnd], RCVBUF_SIZE - rcvEnd);
+// 		rcvEnd += bytesRead;
 // 	}
 
 	lastRcvTime = microsecs();
-	int firstByte = rcvBuf[0];
-	if (0xFA == firstByte) {
-		processShortMessage();
-	} else if (0xFB == firstByte) {
-		processLongMessage();
-	} else {
-		skipToStartByteAfter(1); // bad message, probably due to dropped bytes
+	while (rcvStart < rcvEnd) {
+		int firstByte = rcvBuf[rcvStart];
+		int processed = true;
+		if (0xFA == firstByte) {
+			processed = processShortMessage();
+		} else if (0xFB == firstByte) {
+			processed = processLongMessage();
+		} else {
+			skipToStartByteAfter(1); // bad message, probably due to dropped bytes
+		}
+		if (!processed) break; // wait for the rest of the message
 	}
+	if (rcvStart == rcvEnd) rcvStart = rcvEnd = 0; // all bytes processed
+#if defined(GNUBLOCKS) && !defined(EMSCRIPTEN)
+	sendData(); // send replies to the client that sent the messages before other output
+	endClientReply();
+#endif
 }
@@ -38,8 +38,15 @@ TJR also supports enumeration of object properties and array elements, so one ca
 complete traversal of the entire JSON structure if needed. However, using paths to access
 parts of the structure is often sufficient.
 
+Each tjr_atPath() call scans the JSON string from the beginning. When many values are
+needed from a large document, tjr_parse() can be used to walk the document once, calling
+a handler function for every value and for the end of every array and object. The handler
+gets the position and length of each value, so it can build an index for later lookups.
+Unlike the other functions, tjr_parse() takes a length and does not require the JSON
+string to be null terminated, and it checks the syntax of the JSON.
+
 Limitations:
-	* assumes input is legal JSON
+	* assumes input is legal JSON (except for tjr_parse())
 	* each property name component of a path must be under 100 characters long
 	* floating point numbers are not supported, only integers
 	* the \uHHHH hex escape sequence in strings is not supported; it is passed through verbatim
@@ -324,3 +331,134 @@ char * tjr_nextProperty(char *p, char *propertyName, int propertyNameSize) {
 	if (':' == *p) p = tjr_skipWhitespace(p + 1); // skip colon
 	return p;
 }
+
+// streaming parser
+
+static char * tjr_skipWhitespaceTo(char *p, char *end) {
+	while ((p < end) && (*p <= ' ') && (*p != 0)) p++;
+	return p;
+}
+
+static char * tjr_scalarEnd(char *p, char *end) {
+	// Return a pointer to the first character after the string, number, or literal at p.
+	// Return NULL if a string is not terminated.
+
+	if ('"' == *p) {
+		p++; // skip opening quote
+		while ((p < end) && *p) {
+			int ch = *p++;
+			if ('"' == ch) return p; // closing quote
+			if ('\\' == ch) p++; // skip escaped character
+		}
+		return NULL;
+	}
+	while ((p < end) && (*p > ' ')) {
+		int ch = *p;
+		if ((',' == ch) || ('}' == ch) || (']' == ch) || (':' == ch)) break;
+		p++;
+	}
+	return p;
+}
+
+static int tjr_isLiteral(char *p, int length, int type) {
+	// Return true if the length characters at p spell the true, false, or null literal.
+
+	char *literal = (tjr_True == type) ? "true" : ((tjr_False == type) ? "false" : "null");
+	return (length == (int) strlen(literal)) && (0 == strncmp(p, literal, length));
+}
+
+static int tjr_typeAt(char *p, char *end) {
+	if (p >= end) return tjr_End;
+	int ch = *p;
+	if (('-' == ch) && ((p + 1) < end) && isDigit(*(p + 1))) return tjr_Number;
+	if ('-' == ch) return tjr_Error;
+	return tjr_type(p);
+}
+
+// tjr_parse() keeps a stack frame for each enclosing array and object with just what is
+// needed to report its end; the type and depth follow from the opening character and the
+// position of the frame in the stack.
+
+typedef struct {
+	char *value;	// opening bracket or brace
+	char *key;		// opening quote of the property name or NULL
+	int index;		// one-based index in the parent array or object
+	int count;		// number of items so far
+} tjr_frame;
+
+int tjr_parse(char *p, int length, tjr_handler handler, void *context) {
+	// Walk the JSON value at p in a single pass, calling handler for each value and
+	// for the end of each array or object. Parsing stops early if the handler returns
+	// non-zero. Return the number of bytes parsed or -1 if there is a syntax error or
+	// the nesting is deeper than TJR_MAX_DEPTH.
+
+	char *start = p;
+	char *end = p + length;
+	tjr_frame stack[TJR_MAX_DEPTH]; // the enclosing arrays and objects
+	int depth = 0;
+	tjr_event event;
+
+	while (1) {
+		p = tjr_skipWhitespaceTo(p, end);
+		memset(&event, 0, sizeof(event));
+		if (depth > 0) {
+			tjr_frame *parent = &stack[depth - 1];
+			int parentType = ('{' == *parent->value) ? tjr_Object : tjr_Array;
+			int closer = (tjr_Object == parentType) ? '}' : ']';
+			if (p >= end) return -1; // unterminated array or object
+			if (closer == *p) {
+				depth--;
+				event.type = parentType;
+				event.isEnd = 1;
+				event.depth = depth;
+				event.index = parent->index;
+				event.count = parent->count;
+				event.key = parent->key;
+				event.value = parent->value;
+				event.valueLength = (p + 1) - event.value;
+				p++; // skip closer
+				if (handler && handler(&event, context)) return p - start;
+				if (0 == depth) return p - start;
+				continue;
+			}
+			if (parent->count > 0) {
+				if (',' != *p) return -1;
+				p = tjr_skipWhitespaceTo(p + 1, end);
+			}
+			if (tjr_Object == parentType) {
+				if ((p >= end) || ('"' != *p)) return -1;
+				event.key = p;
+				p = tjr_scalarEnd(p, end);
+				if (!p) return -1;
+				p = tjr_skipWhitespaceTo(p, end);
+				if ((p >= end) || (':' != *p)) return -1;
+				p = tjr_skipWhitespaceTo(p + 1, end);
+			}
+			event.index = ++parent->count;
+			event.depth = depth;
+		}
+		event.type = tjr_typeAt(p, end);
+		if ((tjr_End == event.type) || (tjr_Error == event.type)) return -1;
+		event.value = p;
+		if ((tjr_Array == event.type) || (tjr_Object == event.type)) {
+			if (depth >= TJR_MAX_DEPTH) return -1;
+			stack[depth].value = event.value;
+			stack[depth].key = event.key;
+			stack[depth].index = event.index;
+			stack[depth].count = 0;
+			depth++;
+			p++; // skip opener
+			if (handler && handler(&event, context)) return p - start;
+			continue;
+		}
+		p = tjr_scalarEnd(p, end);
+		if (!p) return -1;
+		event.valueLength = p - event.value;
+		if (((tjr_True == event.type) || (tjr_False == event.type) || (tjr_Null == event.type)) &&
+			!tjr_isLiteral(event.value, event.valueLength, event.type)) {
+				return -1;
+		}
+		if (handler && handler(&event, context)) return p - start;
+		if (0 == depth) return p - start;
+	}
+}
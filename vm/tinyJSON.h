@@ -44,6 +44,32 @@ char * tjr_atIndex(char *p, int index);
 char * tjr_nextElement(char *p);
 char * tjr_nextProperty(char *p, char *propertyName, int propertyNameSize);
 
+// Streaming (single pass) parsing
+
+// Maximum nesting depth. Parsing uses stack space in proportion to this, so it is
+// smaller on boards with 16 KB of RAM.
+
+#if defined(NRF51)
+	#define TJR_MAX_DEPTH 16
+#else
+	#define TJR_MAX_DEPTH 32
+#endif
+
+typedef struct {
+	int type;			// type of the value (tjr_Array, tjr_Object, tjr_Number, etc.)
+	int isEnd;			// true when an array or object ends
+	int depth;			// nesting depth; zero for the top-level value
+	int index;			// one-based index of the value in its parent array or object
+	int count;			// number of items in an array or object (set when it ends)
+	char *key;			// opening quote of the property name or NULL if not in an object
+	char *value;		// start of the value
+	int valueLength;	// length of the value (set when an array or object ends)
+} tjr_event;
+
+typedef int (*tjr_handler)(tjr_event *event, void *context);
+
+int tjr_parse(char *p, int length, tjr_handler handler, void *context);
+
 #ifdef __cplusplus
 }
 #endif
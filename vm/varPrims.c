@@ -43,20 +43,10 @@ OBJ primVarNameForIndex(int argCount, OBJ *args) {
 	int varIndex = ((argCount > 0) && isInt(args[0])) ? obj2int(args[0]) - 1 : -1;
 
 	int maxVarIndex = -1;
-	char *varEntry = NULL;
-	int *p = scanStart();
-	while (p) {
-		int recType = (*p >> 16) & 0xFF;
-		int id = (*p >> 8) & 0xFF;
-		if (recType == varName) {
-			if (id > maxVarIndex) maxVarIndex = id;
-			if (varIndex == id) varEntry = (char *) (p + 2);
-		} else if (recType == varsClearAll) {
-			maxVarIndex = -1;
-			varEntry = NULL;
-		}
-		p = recordAfter(p);
+	for (int i = 0; i < 256; i++) {
+		if (varNameForIndex(i)) maxVarIndex = i;
 	}
+	char *varEntry = varNameForIndex(varIndex);
 	if (varEntry) return newStringFromBytes(varEntry, strlen(varEntry));
 	return int2obj(maxVarIndex + 1);
 }
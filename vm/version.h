@@ -1 +1 @@
-#define VM_VERSION "v170"
+#define VM_VERSION "v173"